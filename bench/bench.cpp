@@ -0,0 +1,326 @@
+// Times each stage of the pipeline on synthetic pixel art and prints the
+// results as JSON, e.g.
+//   bench --sizes 16,64,256 --threads 1,4 --generators checkerboard,noise
+//
+// Every image is generated from a fixed seed, so runs can be compared over
+// time. With several threads, each one runs the whole pipeline on its own
+// copy of the image and the throughput is for all of them together.
+//
+// The cache misses of each stage are read from the perf counters of the
+// kernel, they are -1 where these are not available. Comparing them between
+// a build with and without DPXL_TILED_STORAGE shows the effect of the tiles.
+
+#include "depixel_lib/cells.hpp"
+#include "depixel_lib/graph.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <xtensor/xarray.hpp>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const std::vector<std::string> STAGES = {
+    "compute_neighbours", "remove_trivial_edges", "resolve_diagonals",
+    "build_from_graph", "colorCells"};
+
+// A few YUV colors, the first two are far enough apart to never be similar
+const float PALETTE[][3] = {{0.2f, 0.5f, 0.5f}, {0.9f, 0.5f, 0.5f},
+                            {0.5f, 0.3f, 0.8f}, {0.5f, 0.3f, 0.7f},
+                            {0.6f, 0.7f, 0.4f}, {0.1f, 0.6f, 0.6f}};
+const size_t PALETTE_SIZE = sizeof(PALETTE) / sizeof(PALETTE[0]);
+
+void set_color(xt::xarray<float> &img, size_t i, size_t j, size_t color) {
+  for (size_t c = 0; c < 3; ++c) {
+    img(i, j, c) = PALETTE[color % PALETTE_SIZE][c];
+  }
+}
+
+// Large axis aligned rectangles, almost every edge is trivial
+xt::xarray<float> flat(size_t n) {
+  xt::xarray<float> img = xt::xarray<float>::from_shape({n, n, 3});
+  size_t block = std::max<size_t>(n / 4, 1);
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      set_color(img, i, j, i / block + 2 * (j / block));
+    }
+  }
+  return img;
+}
+
+// Dithering, every 2x2 block is a crossing: the worst case for the heuristics
+xt::xarray<float> checkerboard(size_t n) {
+  xt::xarray<float> img = xt::xarray<float>::from_shape({n, n, 3});
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      set_color(img, i, j, (i + j) % 2);
+    }
+  }
+  return img;
+}
+
+// One pixel wide diagonal lines, long curves for the curve heuristic
+xt::xarray<float> diagonal_curves(size_t n) {
+  xt::xarray<float> img = xt::xarray<float>::from_shape({n, n, 3});
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      bool line = (i + j) % 8 == 0 || (n + i - j) % 13 == 0;
+      set_color(img, i, j, line ? 1 : 0);
+    }
+  }
+  return img;
+}
+
+// Random colors from the palette, with a fixed seed
+xt::xarray<float> noise(size_t n) {
+  std::mt19937 rng(42);
+  xt::xarray<float> img = xt::xarray<float>::from_shape({n, n, 3});
+  for (size_t i = 0; i < n; ++i) {
+    for (size_t j = 0; j < n; ++j) {
+      set_color(img, i, j, rng() % PALETTE_SIZE);
+    }
+  }
+  return img;
+}
+
+const std::vector<std::pair<std::string, std::function<xt::xarray<float>(size_t)>>>
+    GENERATORS = {{"flat", flat},
+                  {"checkerboard", checkerboard},
+                  {"diagonal_curves", diagonal_curves},
+                  {"noise", noise}};
+
+// Cache misses of the calling thread, in user space
+class CacheMisses {
+public:
+  CacheMisses() {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    m_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  ~CacheMisses() {
+    if (m_fd >= 0) {
+      close(m_fd);
+    }
+  }
+
+  // -1 when the counter could not be opened
+  long long read() const {
+    long long count;
+    if (m_fd < 0 || ::read(m_fd, &count, sizeof(count)) != sizeof(count)) {
+      return -1;
+    }
+    return count;
+  }
+
+private:
+  int m_fd;
+};
+
+struct StageResult {
+  double seconds;
+  long long cache_misses;
+};
+
+// Time and cache misses of each stage in one run of the pipeline
+std::vector<StageResult> run_pipeline(const xt::xarray<float> &source,
+                                      size_t scale_factor) {
+  std::vector<StageResult> stages;
+  CacheMisses counter;
+  auto start = Clock::now();
+  long long misses = counter.read();
+  auto lap = [&] {
+    auto now = Clock::now();
+    long long now_misses = counter.read();
+    stages.push_back({std::chrono::duration<double>(now - start).count(),
+                      misses < 0 ? -1 : now_misses - misses});
+    start = now;
+    misses = now_misses;
+  };
+
+  xt::xarray<float> img = source;
+  start = Clock::now();
+  misses = counter.read();
+  dpxl::Graph graph(img);
+  graph.compute_neighbours();
+  lap();
+  graph.remove_trivial_edges();
+  lap();
+  graph.resolve_diagonals();
+  lap();
+
+  dpxl::VoronoiCells cells;
+  cells.build_from_graph(graph);
+  lap();
+  cv::Mat output = cells.colorCells(scale_factor, graph.get_image());
+  lap();
+  return stages;
+}
+
+std::vector<size_t> parse_list(const std::string &value) {
+  std::vector<size_t> list;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    list.push_back(std::strtoul(item.c_str(), nullptr, 10));
+  }
+  return list;
+}
+
+std::vector<std::string> parse_names(const std::string &value) {
+  std::vector<std::string> list;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    list.push_back(item);
+  }
+  return list;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  // 4096 is left out of the default sizes, the cells alone take tens of GB
+  std::vector<size_t> sizes = {16, 64, 256, 1024};
+  std::vector<size_t> thread_counts = {1};
+  std::vector<std::string> generators;
+  for (const auto &generator : GENERATORS) {
+    generators.push_back(generator.first);
+  }
+  size_t scale_factor = 2;
+  size_t repeat = 3;
+
+  for (int arg = 1; arg + 1 < argc; arg += 2) {
+    std::string name = argv[arg];
+    std::string value = argv[arg + 1];
+    if (name == "--sizes") {
+      sizes = parse_list(value);
+    } else if (name == "--threads") {
+      thread_counts = parse_list(value);
+    } else if (name == "--generators") {
+      generators = parse_names(value);
+    } else if (name == "--scale") {
+      scale_factor = std::strtoul(value.c_str(), nullptr, 10);
+    } else if (name == "--trace") {
+      dpxl::trace::enable(value);
+    } else if (name == "--repeat") {
+      repeat = std::max<size_t>(std::strtoul(value.c_str(), nullptr, 10), 1);
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [--sizes 16,64,...] [--threads 1,2,...]"
+                   " [--generators flat,checkerboard,diagonal_curves,noise]"
+                   " [--scale n] [--repeat n] [--trace trace.json]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+#ifdef DPXL_TILED_STORAGE
+  const char *storage = "tiled";
+#else
+  const char *storage = "row_major";
+#endif
+  // Without them, the timings are all there is to compare the storages
+  bool counters = CacheMisses().read() >= 0;
+  if (!counters) {
+    std::cerr << "The cache miss counters are not available (perf_event_open "
+                 "failed), the cache misses are not measured"
+              << std::endl;
+  }
+  std::cout << "{\n  \"storage\": \"" << storage << "\""
+            << ",\n  \"cache_misses_measured\": "
+            << (counters ? "true" : "false")
+            << ",\n  \"scale_factor\": " << scale_factor
+            << ",\n  \"repeat\": " << repeat << ",\n  \"results\": [";
+  bool first_result = true;
+  for (const auto &name : generators) {
+    auto generator = std::find_if(
+        GENERATORS.begin(), GENERATORS.end(),
+        [&name](const auto &entry) { return entry.first == name; });
+    if (generator == GENERATORS.end()) {
+      std::cerr << "Unknown generator: " << name << std::endl;
+      return 1;
+    }
+
+    for (size_t size : sizes) {
+      xt::xarray<float> img = generator->second(size);
+      double pixels = double(size) * size;
+
+      for (size_t threads : thread_counts) {
+        threads = std::max<size_t>(threads, 1);
+
+        // Best of the repeats, the threads' stage times are averaged
+        std::vector<double> best(STAGES.size(), 0.0);
+        std::vector<long long> best_misses(STAGES.size(), 0);
+        double best_wall = 0.0;
+        for (size_t r = 0; r < repeat; ++r) {
+          std::vector<std::vector<StageResult>> results(threads);
+          auto start = Clock::now();
+          std::vector<std::thread> workers;
+          for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&results, &img, scale_factor, t] {
+              results[t] = run_pipeline(img, scale_factor);
+            });
+          }
+          for (auto &worker : workers) {
+            worker.join();
+          }
+          double wall =
+              std::chrono::duration<double>(Clock::now() - start).count();
+
+          for (size_t s = 0; s < STAGES.size(); ++s) {
+            double mean = 0.0;
+            long long misses = 0;
+            for (const auto &thread_results : results) {
+              mean += thread_results[s].seconds / threads;
+              misses = misses < 0 || thread_results[s].cache_misses < 0
+                           ? -1
+                           : misses + thread_results[s].cache_misses / threads;
+            }
+            best[s] = r == 0 ? mean : std::min(best[s], mean);
+            best_misses[s] =
+                r == 0 ? misses : std::min(best_misses[s], misses);
+          }
+          best_wall = r == 0 ? wall : std::min(best_wall, wall);
+        }
+
+        std::cout << (first_result ? "\n" : ",\n") << "    {\"generator\": \""
+                  << name << "\", \"size\": " << size
+                  << ", \"threads\": " << threads << ", \"stages\": {";
+        for (size_t s = 0; s < STAGES.size(); ++s) {
+          std::cout << (s == 0 ? "" : ", ") << "\"" << STAGES[s]
+                    << "\": {\"seconds\": " << best[s]
+                    << ", \"pixels_per_second\": "
+                    << threads * pixels / std::max(best[s], 1e-9)
+                    << ", \"cache_misses\": " << best_misses[s] << "}";
+        }
+        std::cout << "}, \"wall_seconds\": " << best_wall
+                  << ", \"pixels_per_second\": "
+                  << threads * pixels / std::max(best_wall, 1e-9) << "}";
+        first_result = false;
+      }
+    }
+  }
+  std::cout << "\n  ]\n}" << std::endl;
+  return 0;
+}
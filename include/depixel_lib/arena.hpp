@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+#include <vector>
+
+namespace dpxl {
+
+// Bump allocator for the containers of one run of the pipeline. Nothing is
+// freed on deallocation: reset() forgets every allocation at once and keeps
+// the memory, so that the next runs of a similar size allocate nothing.
+// Every container allocated from the arena must be gone before reset().
+class Arena : public std::pmr::memory_resource {
+public:
+  explicit Arena(size_t chunk_size = 1 << 20) : m_chunk_size(chunk_size) {};
+  ~Arena();
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  void reset();
+
+  // Bytes held, and number of chunks taken from the heap so far
+  size_t get_capacity() const;
+  size_t get_chunk_allocations() const { return m_chunk_allocations; }
+
+private:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+  struct Chunk {
+    char *data;
+    size_t size;
+  };
+  std::vector<Chunk> m_chunks;
+  size_t m_current = 0; // chunk being filled
+  size_t m_offset = 0;  // in the current chunk
+
+  size_t m_chunk_size;
+  size_t m_chunk_allocations = 0;
+};
+
+} // namespace dpxl
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "color_metric.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <opencv2/core/mat.hpp>
+#include <string>
+
+namespace dpxl {
+
+// Depixelize an image too large for the whole pipeline to fit in memory. The
+// output is produced in horizontal bands, each one from the pixel rows it
+// needs plus a halo. The halo is widened for a band until the heuristics can
+// not see the cut, so the output is the same as colorCells on the whole image
+// while the memory only grows with the band height times the width.
+class BandDepixelizer {
+public:
+  // img is the BGR input image, only converted band by band
+  BandDepixelizer(const cv::Mat &img, size_t scale_factor,
+                  size_t band_height = 64, size_t halo = 8)
+      : m_img(img), m_scale_factor(scale_factor),
+        m_band_height(band_height), m_halo(halo) {};
+
+  // Metric of the similarity graphs of the bands
+  void set_color_metric(const ColorMetricConfig &config) {
+    m_color_metric = config;
+  }
+
+  // Widest halo a band may grow to, e.g. from halo_for_budget, 0 (the
+  // default) for no limit
+  void set_halo_limit(size_t halo) { m_halo_limit = halo; }
+
+  // Stats of the graphs and cells of the bands, nullptr (the default) for
+  // none. The counters include the rows shared by the windows of the bands
+  // and the windows retried with a wider halo
+  void set_stats(Stats *stats) { m_stats = stats; }
+
+  // Called with the output rows of each band in order, y is the first one.
+  // Returns false when a band needs a wider halo than the limit, after the
+  // bands before it were emitted
+  typedef std::function<void(const cv::Mat &rows, size_t y)> RowsCallback;
+  bool run(const RowsCallback &emit);
+
+  size_t get_output_height() const {
+    return m_img.rows * (4 * m_scale_factor + 1);
+  }
+  size_t get_output_width() const {
+    return m_img.cols * (4 * m_scale_factor + 1);
+  }
+
+  // Widest halo the last run needed
+  size_t get_max_halo() const { return m_max_halo; }
+
+private:
+  bool render_rows(size_t y0, size_t y1, cv::Mat &rows);
+
+  cv::Mat m_img;
+  size_t m_scale_factor;
+  size_t m_band_height;
+  size_t m_halo;
+  size_t m_max_halo = 0;
+  size_t m_halo_limit = 0;
+  ColorMetricConfig m_color_metric;
+  Stats *m_stats = nullptr;
+};
+
+/**
+ * @brief depixelizes an image band by band, the output is streamed to a .ppm
+ * file as the bands are done
+ * @param image_path, the relative path of the image
+ * @param band_height, number of pixel rows per band
+ * @param color_metric (optional), metric of the similarity graph
+ * @param memory_budget (optional), in bytes, limits the halo of the bands.
+ * 0 for none
+ * @param stats (optional), see BandDepixelizer::set_stats
+ * @return false if the image could not be processed
+ */
+bool depixelize_bands(const std::string &image_path, size_t band_height,
+                      const ColorMetricConfig &color_metric = {},
+                      size_t memory_budget = 0, Stats *stats = nullptr);
+
+} // namespace dpxl
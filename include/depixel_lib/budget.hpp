@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace dpxl {
+
+// Steps of the pipeline done the cheap way to meet a TimeBudget, as bits
+enum DegradedStep : uint32_t {
+  // Crossings resolved without the curve length heuristic
+  DegradedCurves = 1u << 0,
+  // Crossings resolved without any heuristic, both diagonals dropped
+  DegradedHeuristics = 1u << 1,
+  // Cells not built, the output is the pixels upscaled
+  DegradedCells = 1u << 2,
+  // Some cells not drawn, their pixels upscaled instead
+  DegradedRender = 1u << 3,
+  // Flat colours, or fewer sweeps, instead of the smooth shading
+  DegradedShading = 1u << 4,
+};
+
+// Comma separated names of the degraded steps, "none" if there are none
+std::string degraded_steps_to_string(uint32_t steps);
+
+// Time budget of a job, shared by its stages. They check it cooperatively
+// between units of work: once it runs low they take cheaper choices, once it
+// is expired the cheapest ones, and record which steps were degraded. The
+// result is always complete, only its quality drops.
+class TimeBudget {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // No time limit, only cancel stops the job
+  TimeBudget() : m_start(Clock::now()) {};
+  // Runs low once low_fraction of the time until deadline is spent
+  explicit TimeBudget(Clock::time_point deadline, double low_fraction = 0.5);
+  explicit TimeBudget(Clock::duration duration, double low_fraction = 0.5)
+      : TimeBudget(Clock::now() + duration, low_fraction) {};
+
+  TimeBudget(const TimeBudget &) = delete;
+  TimeBudget &operator=(const TimeBudget &) = delete;
+
+  // From any thread, the job then degrades everything left
+  void cancel() { m_cancelled = true; }
+
+  bool expired() const;
+  bool running_low() const;
+
+  void degrade(uint32_t steps) { m_degraded |= steps; }
+  uint32_t get_degraded() const { return m_degraded; }
+
+private:
+  Clock::time_point m_start;
+  Clock::time_point m_low;
+  Clock::time_point m_deadline;
+  bool m_limited = false;
+  std::atomic<bool> m_cancelled{false};
+  std::atomic<uint32_t> m_degraded{0};
+};
+
+} // namespace dpxl
@@ -1,13 +1,17 @@
 #pragma once
 
+#include "budget.hpp"
 #include "graph.hpp"
+#include "stats.hpp"
 
 #include <boost/polygon/point_data.hpp>
 #include <boost/polygon/segment_data.hpp>
 #include <boost/polygon/voronoi.hpp>
 #include <cstddef>
+#include <memory_resource>
 #include <opencv2/core/mat.hpp>
 #include <set>
+#include <utility>
 #include <vector>
 
 namespace dpxl {
@@ -19,27 +23,85 @@ namespace dpxl {
 // The unique index is then (i*(4*w+1) + j)
 //
 // List of all cells and their corresponding node index
-typedef std::vector<std::vector<size_t>> CellArray;
+// The containers take their memory from a std::pmr resource (the heap by
+// default), see VoronoiCells::set_memory_resource
+typedef std::pmr::vector<std::pmr::vector<size_t>> CellArray;
 
 // Vector of all possible nodes
 // at index i is represented the indices of points connected to point i
 // such that valency_of_point_at_index(i) = NodeArray[].size()
-typedef std::vector<std::set<size_t>> NodeArray;
+typedef std::pmr::vector<std::pmr::set<size_t>> NodeArray;
+
+// Cells flattened into polygons on the node grid with their colour, in the
+// order colorCells draws them. They can be rasterized at any scale, several
+// at once, without going back to the cells (see multiscale.hpp)
+struct FlatCells {
+  size_t h;
+  size_t w;
+  // Polygon of cell c: counts[c] points from offsets[c] on, as (x, y) nodes
+  std::vector<cv::Point> points;
+  std::vector<size_t> offsets;
+  std::vector<int> counts;
+  // The image in BGR, background and colour of each cell
+  cv::Mat img_bgr;
+};
 
 class VoronoiCells {
 public:
   VoronoiCells() {};
+  // Wrap already built cells, e.g. loaded from a stage file
+  VoronoiCells(size_t h, size_t w, CellArray cells, NodeArray nodes)
+      : m_h(h), m_w(w), m_cells(std::move(cells)), m_nodes(std::move(nodes)) {};
+
+  // Record the time of the stages and the counters into stats, nullptr (the
+  // default) records nothing
+  void set_stats(Stats *stats) { m_stats = stats; }
+
+  // Time budget checked between the rows of build_from_graph and colorCells,
+  // nullptr (the default) for none
+  void set_budget(TimeBudget *budget) { m_budget = budget; }
+
+  // Memory of the cells and nodes built from now on, e.g. an Arena. It must
+  // outlive them
+  void set_memory_resource(std::pmr::memory_resource *resource) {
+    m_resource = resource;
+  }
+  // Destroy the cells and nodes, before resetting their memory resource
+  void clear();
+
+  // Build a valency-2-collapsed voronoi representation of the pixel graph.
+  // Returns false, with no cells, if the time budget expired on the way:
+  // colorCells then draws the pixels upscaled
+  bool build_from_graph(const Graph &g);
 
-  // Build a valency-2-collapsed voronoi representation of the pixel graph
-  void build_from_graph(Graph g);
+  // Rebuild only the cells affected by a change of the neighbours of the
+  // pixels in changed (see Graph::update_region), returns the rebuilt cells
+  cv::Rect update_region(const Graph &g, cv::Rect changed);
 
   // std::pair<size_t, size_t> node_position_from_idx(size_t idx);
 
   CellArray &get_cells() { return m_cells; }
+  const CellArray &get_cells() const { return m_cells; }
   NodeArray &get_nodes() { return m_nodes; }
 
+  size_t get_height() const { return m_h; }
+  size_t get_width() const { return m_w; }
+
   cv::Mat draw(size_t scale_factor, const xt::xarray<float>& img);
   cv::Mat colorCells(size_t scale_factor, const xt::xarray<float>& img);
+  // Same, drawn into output_image which is only reallocated if its size changes
+  void colorCells(cv::Mat &output_image, size_t scale_factor,
+                  const xt::xarray<float> &img);
+  // Redraw in an image returned by colorCells the area covered by the cells of
+  // the pixels in region, returns the redrawn area
+  cv::Rect colorCells(cv::Mat &output_image, size_t scale_factor,
+                      const xt::xarray<float> &img, cv::Rect region);
+  FlatCells flatten(const xt::xarray<float> &img);
+  // Draw the rows [y0, y0 + output_rows.rows) of what colorCells gives for the
+  // whole image, when these cells and img only hold its pixel rows from
+  // first_row on. Every cell reaching these rows must be held
+  void colorBand(cv::Mat &output_rows, size_t scale_factor,
+                 const xt::xarray<float> &img, size_t first_row, size_t y0);
 
 private:
   size_t c_idx(size_t i, size_t j);
@@ -47,12 +109,42 @@ private:
 
   std::pair<size_t, size_t> n_pos(size_t idx);
 
+  void raw_cell(const NeighbourMask &neighbours, size_t i, size_t j,
+                std::pmr::vector<size_t> &cell);
+  void connect_cell(const std::pmr::vector<size_t> &cell);
+  bool on_border(size_t k);
+
   void collapse_valency2_nodes();
 
+  // Flat tiles of the graph (see Graph::is_flat_tile). The cells of the
+  // pixels strictly inside them are squares of 4 corners, built directly, and
+  // colorCells fills them as one rectangle per tile
+  std::vector<bool> m_flat_tiles;
+  void copy_flat_tiles(const Graph &g);
+  // Only for the tiles meeting pixels
+  void copy_flat_tiles(const Graph &g, cv::Rect pixels);
+  bool in_flat_interior(size_t i, size_t j);
+  // Fill the square cells of the flat tile interior from pixel (y, x) as one
+  // rectangle, false if their colours differ in the rendered image
+  bool fill_flat_interior(cv::Mat &output_image, size_t scale_factor, size_t y,
+                          size_t x);
+
+  void fill_cell(cv::Mat &output_image, size_t scale_factor, size_t y,
+                 size_t x, const cv::Vec3b &pixel_color, cv::Point offset);
+
   size_t m_h;
   size_t m_w;
 
   CellArray m_cells;
   NodeArray m_nodes;
+
+  Stats *m_stats = nullptr;
+  TimeBudget *m_budget = nullptr;
+  std::pmr::memory_resource *m_resource = std::pmr::get_default_resource();
+
+  // Reused between renders
+  cv::Mat m_img_yuv;
+  cv::Mat m_img_bgr;
+  std::vector<cv::Point> m_polygon;
 };
 } // namespace dpxl
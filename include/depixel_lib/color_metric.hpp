@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+
+namespace dpxl {
+
+// Metrics deciding whether two pixels are similar enough to be linked in the
+// similarity graph. Each one is a policy the similarity kernel of Graph is
+// instantiated with, so its comparison is inlined in the loop over pixels.
+// Pixels are given as YUV in [0, 1], as held by Graph. A metric with
+// converts = true compares pixels after to_space, which the kernel applies
+// once per pixel beforehand.
+// Every metric must be symmetric: each pair of pixels is compared once.
+
+// Per-channel YUV differences, with the thresholds (in 1/255) known at
+// compile time. The defaults are the thresholds of the paper
+template <int Y = 48, int U = 7, int V = 6> struct YuvMetric {
+  static constexpr bool converts = false;
+  static constexpr size_t channels = 3;
+  static constexpr float y_threshold = static_cast<float>(Y / 255.0);
+  static constexpr float u_threshold = static_cast<float>(U / 255.0);
+  static constexpr float v_threshold = static_cast<float>(V / 255.0);
+
+  bool close(const float *a, const float *b) const {
+    return std::abs(a[0] - b[0]) <= y_threshold &&
+           std::abs(a[1] - b[1]) <= u_threshold &&
+           std::abs(a[2] - b[2]) <= v_threshold;
+  }
+};
+
+// Same, with the thresholds chosen at run time (e.g. on the command line)
+struct RuntimeYuvMetric {
+  static constexpr bool converts = false;
+  static constexpr size_t channels = 3;
+  float y_threshold;
+  float u_threshold;
+  float v_threshold;
+
+  bool close(const float *a, const float *b) const {
+    return std::abs(a[0] - b[0]) <= y_threshold &&
+           std::abs(a[1] - b[1]) <= u_threshold &&
+           std::abs(a[2] - b[2]) <= v_threshold;
+  }
+};
+
+// CIE76 distance in L*a*b*, closer to the perceived difference than YUV for
+// art with smooth gradients
+struct LabMetric {
+  static constexpr bool converts = true;
+  static constexpr size_t channels = 3;
+  static constexpr float max_distance = 10.0f;
+
+  static void to_space(const float *yuv, float *lab);
+
+  bool close(const float *a, const float *b) const {
+    float dl = a[0] - b[0];
+    float da = a[1] - b[1];
+    float db = a[2] - b[2];
+    return dl * dl + da * da + db * db <= max_distance * max_distance;
+  }
+};
+
+// Identical colours only, for art drawn with a strict palette
+struct ExactMetric {
+  static constexpr bool converts = false;
+  static constexpr size_t channels = 3;
+
+  bool close(const float *a, const float *b) const {
+    return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+  }
+};
+
+// Choice of metric at run time. Graph dispatches on it once per pass, the
+// default YUV thresholds going to YuvMetric<> and any other to
+// RuntimeYuvMetric
+enum class ColorMetric { Yuv, Lab, Exact };
+
+struct ColorMetricConfig {
+  ColorMetric metric = ColorMetric::Yuv;
+  // Only used by ColorMetric::Yuv, in [0, 1]
+  float y_threshold = YuvMetric<>::y_threshold;
+  float u_threshold = YuvMetric<>::u_threshold;
+  float v_threshold = YuvMetric<>::v_threshold;
+
+  bool has_default_thresholds() const {
+    return y_threshold == YuvMetric<>::y_threshold &&
+           u_threshold == YuvMetric<>::u_threshold &&
+           v_threshold == YuvMetric<>::v_threshold;
+  }
+};
+
+// "yuv", "lab" or "exact", returns false for anything else
+bool parse_color_metric(const std::string &name, ColorMetric &metric);
+
+} // namespace dpxl
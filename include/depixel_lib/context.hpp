@@ -0,0 +1,53 @@
+#pragma once
+
+#include "arena.hpp"
+#include "cells.hpp"
+#include "graph.hpp"
+
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+#include <xtensor/xarray.hpp>
+
+namespace dpxl {
+
+// Everything one run of the pipeline needs, kept from one image to the next.
+// A worker that owns a context and processes images of a similar size stops
+// allocating after the first few: the arrays and Mats are reused in place and
+// the cells live in an arena that is reset rather than freed.
+// A context is not thread safe, use one per thread.
+class PipelineContext {
+public:
+  PipelineContext() {};
+
+  PipelineContext(const PipelineContext &) = delete;
+  PipelineContext &operator=(const PipelineContext &) = delete;
+
+  // Time budget of the next runs, see Graph::set_budget and
+  // VoronoiCells::set_budget. nullptr (the default) for none
+  void set_budget(TimeBudget *budget);
+
+  // Converts img_bgr and sets the graph up for it, the stages of the graph
+  // are left to the caller
+  Graph &load(const cv::Mat &img_bgr);
+  // Builds the cells of the loaded graph, once its diagonals are resolved
+  VoronoiCells &build_cells();
+  const cv::Mat &render(size_t scale_factor);
+
+  // Whole pipeline. The result stays valid until the next call
+  const cv::Mat &process(const cv::Mat &img_bgr, size_t scale_factor);
+
+  Graph &get_graph() { return m_graph; }
+  VoronoiCells &get_cells() { return m_cells; }
+  const Arena &get_arena() const { return m_arena; }
+
+private:
+  // Declared before the cells, which must be destroyed first
+  Arena m_arena;
+  cv::Mat m_img_yuv;
+  xt::xarray<float> m_img;
+  Graph m_graph;
+  VoronoiCells m_cells;
+  cv::Mat m_output;
+};
+
+} // namespace dpxl
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "cells.hpp"
+#include "graph.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace dpxl {
+
+// Writes the debug images of a run on a background thread. Only a copy of
+// the buffers a drawing needs is taken on the caller's thread, the drawing
+// and the encoding happen later, so the pipeline goes on meanwhile.
+class DebugWriter {
+public:
+  // Submitting blocks while max_pending images are already waiting, which
+  // bounds the memory held by the snapshots
+  explicit DebugWriter(size_t max_pending = 4);
+  // Waits for every image submitted
+  ~DebugWriter();
+
+  DebugWriter(const DebugWriter &) = delete;
+  DebugWriter &operator=(const DebugWriter &) = delete;
+
+  // Graph::draw_neighbours of the graph as it is now
+  void write_neighbours(const Graph &graph, const std::string &path);
+  // VoronoiCells::draw of the cells as they are now
+  void write_cells(const VoronoiCells &cells, const xt::xarray<float> &img,
+                   size_t scale_factor, const std::string &path);
+
+  // Waits until every image submitted so far is written
+  void flush();
+
+private:
+  void submit(std::function<cv::Mat()> draw, const std::string &path);
+  void work();
+
+  std::thread m_worker;
+  struct Job {
+    std::function<cv::Mat()> draw;
+    std::string path;
+  };
+  std::deque<Job> m_jobs;
+  size_t m_max_pending;
+  bool m_busy = false;
+  bool m_stop = false;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+};
+
+} // namespace dpxl
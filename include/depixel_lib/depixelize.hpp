@@ -1,12 +1,39 @@
 #pragma once
 
+#include "budget.hpp"
+#include "color_metric.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
 #include <string>
 
 /**
  * @brief takes a relative path to an image and returns the upscaled version
  * @param image_path, the relative path of the image,
  * @param save_image (optional), to save the different steps
+ * @param dump_stages (optional), to save the graph and cells as a .dpxl file
+ * @param stats (optional), filled with the time of each stage and counters
+ * @param memory_budget (optional), in bytes, 0 for none. An image whose
+ * estimated memory (see memory.hpp) exceeds it is processed in bands, or not
+ * at all if that does not fit either. The debug images of save_image are not
+ * accounted for
+ * @param color_metric (optional), metric of the similarity graph, YUV with the
+ * thresholds of the paper by default
+ * @param shading_scale (optional), 0 for none, otherwise the scale of an
+ * additional output with the colours of similar cells blended (see
+ * shading.hpp). It takes about 40 bytes per output pixel, so it is meant for
+ * much smaller scales than the main output
+ * @param budget (optional), time budget of the run: the stages left when it
+ * runs low or expires take cheaper choices and record them in it, nullptr for
+ * none
+ *
+ * A .dpxl file written by a previous run can be given instead of an image,
+ * the rendering then starts from the saved stages.
  */
 namespace dpxl {
-void depixelize(const std::string &image_path, bool save_image = false);
+void depixelize(const std::string &image_path, bool save_image = false,
+                bool dump_stages = false, Stats *stats = nullptr,
+                size_t memory_budget = 0,
+                const ColorMetricConfig &color_metric = {},
+                size_t shading_scale = 0, TimeBudget *budget = nullptr);
 }
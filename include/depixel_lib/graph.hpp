@@ -4,20 +4,60 @@
 #include <xtensor/xarray.hpp>
 #include <opencv2/opencv.hpp>
 
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "budget.hpp"
+#include "color_metric.hpp"
+#include "stats.hpp"
+#include "tiled.hpp"
+
 
 
 namespace dpxl {
   class Graph {
 
   public:
+    // Empty graph, to be given an image with reset
+    Graph() {};
     Graph(xt::xarray<float> &img);
     Graph(const std::string& image_path);
+    // Restore an already computed similarity graph
+    Graph(xt::xarray<float> &img, const NeighbourMask &neighbours);
+
+    // Start again on another image, keeping the memory of the previous one
+    // when the size is the same
+    void reset(const xt::xarray<float> &img);
 
-    xt::xarray<float> get_image();
-    xt::xarray<bool> get_neighbours();
+    const xt::xarray<float>& get_image() const;
+    const NeighbourMask& get_neighbours() const;
     
-    std::size_t get_height();
-    std::size_t get_width();
+    std::size_t get_height() const;
+    std::size_t get_width() const;
+
+    // Record the time of the stages and the heuristics' counters into stats,
+    // nullptr (the default) records nothing
+    void set_stats(Stats* stats) { m_stats = stats; }
+
+    // Time budget checked by resolve_diagonals, which skips the curve
+    // heuristic once it runs low and every heuristic once it is expired.
+    // nullptr (the default) for none
+    void set_budget(TimeBudget* budget) { m_budget = budget; }
+
+    // Metric telling similar pixels apart, YUV with the paper's thresholds by
+    // default. To be set before compute_neighbours
+    void set_color_metric(const ColorMetricConfig& config) { m_color_metric = config; m_memo.clear(); }
+    const ColorMetricConfig& get_color_metric() const { return m_color_metric; }
+
+    // Reuse the decision of a crossing whose surroundings were met before, on
+    // by default. The memo is kept across reset, for the frames of a sequence
+    void set_crossing_memo(bool enabled) { m_memo_enabled = enabled; }
 
     cv::Mat draw_neighbours();
 
@@ -25,27 +65,155 @@ namespace dpxl {
     void resolve_diagonals();
     void remove_trivial_edges();
 
+    // Replace the pixels inside dirty by the ones of img (same size as the
+    // graph) and patch the resolved graph instead of recomputing it.
+    // The three steps above must have been run on this graph beforehand.
+    // Returns the pixels whose neighbours may have changed.
+    cv::Rect update_region(const xt::xarray<float>& img, cv::Rect dirty);
+    // Same for several dirty rectangles at once, returns the changed pixels as
+    // a list of disjoint rectangles rather than their bounding box
+    std::vector<cv::Rect> update_region(const xt::xarray<float>& img, const std::vector<cv::Rect>& dirty);
+
+    // Side of the tiles of the flat-region pre-pass of compute_neighbours
+    static constexpr std::size_t FLAT_TILE = 8;
+    // Whether tile (ti, tj), of FLAT_TILE x FLAT_TILE pixels wholly inside the
+    // image, has a single colour: its pixels are then linked to their
+    // orthogonal neighbours only and have no crossing. Known once the trivial
+    // edges are removed, false before
+    bool is_flat_tile(std::size_t ti, std::size_t tj) const;
+
+    // When the graph only holds a horizontal band of a larger image, cut above
+    // and/or below, tells whether the resolved neighbours of the pixel rows
+    // [first_row, last_row) are the same as for the whole image
+    bool is_exact_band(std::size_t first_row, std::size_t last_row, bool cut_above, bool cut_below) const;
+
   private:
     xt::xarray<float> m_img;
-    xt::xarray<bool> m_neighbours;
+    NeighbourMask m_neighbours;
+#ifdef DPXL_TILED_STORAGE
+    // Copy of m_img read by every stage of the graph. m_img stays row-major
+    // for get_image, which the cells, the renders and the stage files read as
+    // a whole: the copy costs 12 bytes per pixel, a few percent of the cells
+    // (see estimate_memory), where converting the image back on each of these
+    // calls would cost a pass over it every time
+    TiledArray<float, 3> m_tiled_img;
+#endif
+
+    // Colour of pixel (i, j), from the tiled copy of the image when there is one
+    const float* pixel(std::size_t i, std::size_t j) const {
+#ifdef DPXL_TILED_STORAGE
+        return m_tiled_img.pixel(i, j);
+#else
+        return &m_img(i, j, 0);
+#endif
+    }
+    // Bring the tiled copy of the image up to date in rect
+    void tile_image(cv::Rect rect);
 
     
     void init_graph();
-    
+    void compute_pixel_neighbours(std::size_t i, std::size_t j);
+
+    // Single coloured tiles, see is_flat_tile. The pairs of pixels inside them
+    // are not compared, and their blocks skip the trivial edge check and the
+    // crossing scan
+    std::vector<unsigned char> m_flat_tiles;
+    // Whether pixels of the same colour are similar, false only for a metric
+    // with negative thresholds
+    bool m_flat_similar = true;
+    bool m_trivial_edges_removed = false;
+    void detect_flat_tile(std::size_t ti, std::size_t tj);
+    // Whether the 2x2 block with (i, j) on its top left lies in a flat tile
+    bool in_flat_block(std::size_t i, std::size_t j) const;
+    // Similarity kernel of compute_neighbours, instantiated per metric
+    template <class Metric> void compute_neighbours_with(const Metric& metric);
+
+    // Crossing diagonals met by resolve_diagonals, with the decision taken
+    // and the pixels that were read to take it. One vector per row of blocks,
+    // sorted by column, so that the whole stays in scan order and update_region
+    // only splices the rows it edits
+    struct Crossing {
+        std::size_t i;
+        std::size_t j;
+        bool resolved;
+        int decision;
+        cv::Rect influence;
+    };
+    std::vector<std::vector<Crossing>> m_crossings;
+    // Crossings of row i with a column in [first_col, last_col)
+    std::pair<std::vector<Crossing>::iterator, std::vector<Crossing>::iterator>
+    crossings_of_row(std::size_t i, int first_col, int last_col);
+
+    // Scan position (i * width + j) of the crossings whose influence covers
+    // some pixel of each bucket of INFLUENCE_BUCKET x INFLUENCE_BUCKET pixels.
+    // Built by the first update_region, which looks up the crossings to decide
+    // again there, and dropped with the crossings
+    static constexpr std::size_t INFLUENCE_BUCKET = 16;
+    std::vector<std::vector<std::size_t>> m_influence_buckets;
+    void index_influence(const Crossing& crossing, bool add);
+
+    // Pixels read by the heuristics call in progress
+    cv::Rect m_influence;
+
+    // Memo of the heuristics, keyed by the surroundings of a crossing in the
+    // MEMO_WINDOW x MEMO_WINDOW pixels centred on its block: the links of each
+    // pixel, how its colour compares to the ones of both diagonals, and where
+    // the image edges cut the window. A decision is only kept when its curve
+    // walks stayed inside the window, longer curves are walked each time
+    static constexpr std::size_t MEMO_WINDOW = 8;
+    // Entries kept before the memo starts over
+    static constexpr std::size_t MEMO_CAPACITY = 1 << 16;
+    struct CrossingKey {
+        // 64 bytes of links, 2 bits of colour class per pixel, the window
+        std::array<uint64_t, 11> words{};
+        bool operator==(const CrossingKey& other) const { return words == other.words; }
+    };
+    struct CrossingKeyHash {
+        std::size_t operator()(const CrossingKey& key) const;
+    };
+    // Votes of the heuristics, and the pixels read relative to the block
+    struct CrossingVotes {
+        int curve;
+        int sparse_pixel;
+        int island;
+        cv::Rect influence;
+    };
+    std::unordered_map<CrossingKey, CrossingVotes, CrossingKeyHash> m_memo;
+    bool m_memo_enabled = true;
+    // Key of the crossing with (i, j) on its top left, also returns the vote
+    // of the sparse pixels heuristic, which only reads the colour classes
+    CrossingKey crossing_key(std::size_t i, std::size_t j, int& sparse_pixel_weight, cv::Rect& window);
+
+    Stats* m_stats = nullptr;
+    TimeBudget* m_budget = nullptr;
 
     //defined in heuristics.cpp
     std::size_t node_valence(std::size_t i, std::size_t j);
-    void heuristics(std::size_t i, std::size_t j);
+    int heuristics(std::size_t i, std::size_t j);
+    void apply_decision(std::size_t i, std::size_t j, int decision);
     std::size_t compute_curve_length(std::size_t i, std::size_t j);
-    std::vector<std::size_t> get_neighbours_list(std::size_t i, std::size_t j);
     int compute_component_size_difference(std::size_t i, std::size_t j);
 
-    bool is_close_color(const xt::xarray<float>& color_pixel, const xt::xarray<float>& color_neighboor);
+    bool is_close_color(std::size_t i1, std::size_t j1, std::size_t i2, std::size_t j2) const;
+
+    ColorMetricConfig m_color_metric;
+    // Image in the space of a converting metric, row-major, kept between
+    // passes and read by every comparison of single pairs
+    std::vector<float> m_metric_space;
+    // Convert the pixels of rect into m_metric_space, all of them when its
+    // size does not match the image
+    template <class Metric> void convert_metric_space(cv::Rect rect);
+    const float* metric_pixel(std::size_t i, std::size_t j) const {
+        return m_metric_space.data() + (i * get_width() + j) * 3;
+    }
 
-    // Define the thresholds for each channel (normalized to [0, 1] range)
-    const float Y_THRESHOLD = 48.0 / 255.0;
-    const float U_THRESHOLD = 7.0 / 255.0;
-    const float V_THRESHOLD = 6.0 / 255.0;
+    // Scratch of compute_curve_length, kept from one walk to the next
+    struct CurveWalk {
+        std::pmr::unsynchronized_pool_resource pool;
+        std::pmr::unordered_set<std::size_t> visited{&pool};
+        std::vector<std::pair<std::size_t, std::pair<std::size_t, std::size_t>>> queue;
+    };
+    std::unique_ptr<CurveWalk> m_walk = std::make_unique<CurveWalk>();
 
     // Scale factor for upscaling for the draw function
     const int scale_factor = 100; // Adjust as needed for better visibility
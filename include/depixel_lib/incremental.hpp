@@ -0,0 +1,44 @@
+#pragma once
+
+#include "cells.hpp"
+#include "graph.hpp"
+
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+#include <vector>
+
+namespace dpxl {
+
+// Keeps the graph, the cells and the rendering of an image being edited, so
+// that each edit only costs in proportion to the area it touches
+class IncrementalDepixelizer {
+public:
+  IncrementalDepixelizer(xt::xarray<float> &img, size_t scale_factor);
+
+  // img is the whole edited image, only the pixels inside dirty are read,
+  // unless they cover more than REBUILD_FRACTION of the tiles of
+  // Graph::FLAT_TILE pixels: the image is then processed again from scratch.
+  // Returns the area of the output that was redrawn
+  cv::Rect update(const xt::xarray<float> &img, cv::Rect dirty);
+  // Same for several dirty rectangles, returns every redrawn area
+  std::vector<cv::Rect> update(const xt::xarray<float> &img,
+                               const std::vector<cv::Rect> &dirty);
+
+  // Process img, of the same size, from scratch. The memory of the graph and
+  // its crossing memo are kept
+  void rebuild(const xt::xarray<float> &img);
+
+  static constexpr double REBUILD_FRACTION = 0.25;
+
+  Graph &get_graph() { return m_graph; }
+  VoronoiCells &get_cells() { return m_cells; }
+  const cv::Mat &get_output() const { return m_output; }
+
+private:
+  Graph m_graph;
+  VoronoiCells m_cells;
+  size_t m_scale_factor;
+  cv::Mat m_output;
+};
+
+} // namespace dpxl
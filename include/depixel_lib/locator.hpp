@@ -0,0 +1,48 @@
+#pragma once
+
+#include "cells.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core/mat.hpp>
+#include <vector>
+
+namespace dpxl {
+
+// Cell covering any point of the image, for per pixel renderers, hit testing
+// and sampling. Points are in pixels, the image spanning [0, w]x[0, h] as in
+// CellMesh. A cell only reaches the pixels around its own, so the index is a
+// grid of the pixels, each listing the cells overlapping it, and a query only
+// tests the few polygons of its pixel. Where cells overlap, the one drawn last
+// by colorCells wins, and a point no cell covers is the cell of its pixel, as
+// the background of colorCells. Points outside of the image are clamped to it
+class CellLocator {
+public:
+  // cells must outlive the locator
+  explicit CellLocator(const FlatCells &cells);
+
+  // Index of the cell, i * w + j for the cell of pixel (i, j)
+  uint32_t locate(float x, float y) const;
+
+  // The cells of the count points (x0 + k * dx, y), dx > 0, of a scanline.
+  // Each pixel along the row is done at once: filled when a single cell
+  // overlaps it, else from the crossings of the row with its polygons
+  void locate_row(float y, float x0, float dx, size_t count,
+                  uint32_t *out) const;
+
+  const cv::Vec3b &colour(uint32_t cell) const {
+    return m_cells.img_bgr.at<cv::Vec3b>(cell / m_cells.w, cell % m_cells.w);
+  }
+
+private:
+  const FlatCells &m_cells;
+  // Cells overlapping pixel p, in drawing order: m_bucket_cells from
+  // m_bucket_offsets[p] to m_bucket_offsets[p + 1]
+  std::vector<size_t> m_bucket_offsets;
+  std::vector<uint32_t> m_bucket_cells;
+
+  size_t bucket(float x, float y) const;
+  bool contains(uint32_t cell, float x, float y) const;
+};
+
+} // namespace dpxl
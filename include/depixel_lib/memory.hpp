@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace dpxl {
+
+// Upper estimate of the memory held by the pipeline at the end of each stage,
+// in bytes, computed from the image size only (see memory.cpp for the model)
+struct MemoryEstimate {
+  size_t load = 0;       // decoded image and its YUV float copy
+  size_t graph = 0;      // + similarity graph and crossings
+  size_t cells = 0;      // + cells and the node lattice
+  size_t render = 0;     // + upscaled output
+  size_t peak() const { return render; }
+};
+
+MemoryEstimate estimate_memory(size_t height, size_t width,
+                               size_t scale_factor);
+
+// Same for BandDepixelizer with bands of band_height rows, the halo being the
+// one it starts with
+size_t estimate_band_memory(size_t height, size_t width, size_t scale_factor,
+                            size_t band_height, size_t halo = 8);
+
+// Largest band height (a power of two) that fits in budget with the starting
+// halo, 0 if none does
+size_t band_height_for_budget(size_t height, size_t width, size_t scale_factor,
+                              size_t budget);
+
+// Widest halo bands of band_height rows can grow to within budget (see
+// BandDepixelizer::set_halo_limit), 0 if not even the starting one fits
+size_t halo_for_budget(size_t height, size_t width, size_t scale_factor,
+                       size_t band_height, size_t budget);
+
+// Human readable size, e.g. "1.5 GB"
+std::string format_bytes(size_t bytes);
+
+} // namespace dpxl
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "cells.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dpxl {
+
+// Cells as an indexed triangle mesh, to be drawn at any resolution.
+// A node shared by several cells is a single vertex. Each cell is a fan of
+// triangles around the centre of its pixel, which every cell polygon is star
+// shaped from, all counter-clockwise as seen on the image (y pointing down).
+//
+// File written by save_mesh, in native (little endian) byte order:
+//  - MeshHeader
+//  - float32 [vertex_count*2]   x, y in pixels, the image spans [0, w]x[0, h]
+//  - uint32  [triangle_count*3] vertex indices
+//  - uint8   [triangle_count*4] RGBA colour of each triangle
+const uint32_t MESH_FILE_VERSION = 1;
+
+struct MeshHeader {
+  char magic[4]; // "DPXM"
+  uint32_t version;
+  uint32_t height;
+  uint32_t width;
+  uint32_t vertex_count;
+  uint32_t triangle_count;
+};
+
+struct CellMesh {
+  uint32_t height = 0;
+  uint32_t width = 0;
+  std::vector<float> positions;
+  std::vector<uint32_t> indices;
+  std::vector<uint8_t> colors;
+
+  size_t vertex_count() const { return positions.size() / 2; }
+  size_t triangle_count() const { return indices.size() / 3; }
+};
+
+CellMesh mesh_from_cells(const FlatCells &cells);
+
+bool save_mesh(const std::string &path, const CellMesh &mesh);
+bool load_mesh(const std::string &path, CellMesh &mesh);
+
+/**
+ * @brief depixelizes an image and saves its cells as a mesh
+ * @param image_path, the relative path of the image
+ */
+void depixelize_mesh(const std::string &image_path);
+
+} // namespace dpxl
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "cells.hpp"
+
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+namespace dpxl {
+
+// Same as VoronoiCells::colorCells at scale_factor, from flattened cells.
+// Only reads cells, so several scales can be drawn at the same time
+void render_flat_cells(const FlatCells &cells, size_t scale_factor,
+                       cv::Mat &output_image);
+
+// One image per scale factor, in the same order, drawn in parallel on up to
+// thread_count threads (0 for one per hardware thread)
+std::vector<cv::Mat> render_scales(const FlatCells &cells,
+                                   const std::vector<size_t> &scale_factors,
+                                   size_t thread_count = 0);
+
+// The cells drawn at multiple times the size of the image, e.g. 2 for twice
+// its width and height. Nodes are a quarter of a pixel apart, so they are
+// drawn at multiple / 4 output pixels apart, with sub-pixel precision
+void render_multiple(const FlatCells &cells, size_t multiple,
+                     cv::Mat &output_image);
+
+// One image per multiple, as render_scales does for scale factors
+std::vector<cv::Mat> render_multiples(const FlatCells &cells,
+                                      const std::vector<size_t> &multiples,
+                                      size_t thread_count = 0);
+
+/**
+ * @brief depixelizes an image once and saves it at several sizes
+ * @param image_path, the relative path of the image
+ * @param multiples, each output is that many times the width and height of
+ * the image, e.g. {2, 3, 4, 8}
+ */
+void depixelize_scales(const std::string &image_path,
+                       const std::vector<size_t> &multiples);
+
+} // namespace dpxl
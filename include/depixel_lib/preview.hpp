@@ -0,0 +1,81 @@
+#pragma once
+
+#include "budget.hpp"
+#include "context.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <opencv2/core/mat.hpp>
+#include <thread>
+
+namespace dpxl {
+
+// Successive results of a progressive preview, all of the output size
+enum class PreviewLevel {
+  Pixels, // the input upscaled, shown right away
+  Coarse, // the cells rasterized at scale 1, then upscaled
+  Full,   // the cells at the full scale, as colorCells gives them
+  Smooth, // the same drawn at twice the scale and reduced, anti-aliased
+};
+
+// Depixelize images for an interactive preview. Each image submitted is
+// worked on in the background, and every level of PreviewLevel is handed to
+// the callback as soon as it is done. Submitting a new image, e.g. after an
+// edit, drops what was left to do for the previous one: the stage under way
+// sees its time budget cancelled and finishes the cheapest way.
+class ProgressivePreview {
+public:
+  // Called on the worker thread, image is only valid during the call.
+  // generation is the value submit returned for the image
+  typedef std::function<void(const cv::Mat &image, PreviewLevel level,
+                             uint64_t generation)>
+      Callback;
+
+  ProgressivePreview(size_t scale_factor, Callback callback);
+  // Cancels the work in progress
+  ~ProgressivePreview();
+
+  ProgressivePreview(const ProgressivePreview &) = delete;
+  ProgressivePreview &operator=(const ProgressivePreview &) = delete;
+
+  // img_bgr is copied. Returns the generation of the image
+  uint64_t submit(const cv::Mat &img_bgr);
+  // Drops the image being worked on, no level of it is delivered after this
+  // returns
+  void cancel();
+  // Waits until the last image submitted is done or cancelled
+  void wait();
+
+private:
+  void work();
+  void run(const cv::Mat &img_bgr, uint64_t generation);
+  // Hands a level over, unless the image was replaced or cancelled
+  bool deliver(const cv::Mat &image, PreviewLevel level, uint64_t generation);
+
+  size_t m_scale_factor;
+  Callback m_callback;
+  PipelineContext m_context;
+  cv::Mat m_preview;
+
+  // Bumped by every submit and cancel, work of an older one is dropped
+  std::atomic<uint64_t> m_generation{0};
+  // Of the image being worked on, cancelled along with it
+  std::unique_ptr<TimeBudget> m_budget;
+  cv::Mat m_pending;
+  bool m_has_pending = false;
+  bool m_busy = false;
+  bool m_stop = false;
+  // Held while delivering, so that cancel waits for a delivery under way
+  std::mutex m_deliver_mutex;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_idle;
+  std::thread m_worker;
+};
+
+} // namespace dpxl
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "incremental.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <opencv2/core/mat.hpp>
+#include <string>
+#include <vector>
+
+namespace dpxl {
+
+// Depixelize the frames of an animation one after the other. Each frame is
+// compared with the previous one tile by tile and only the tiles that differ
+// are processed again, the result is the same as for independent frames.
+class SequenceDepixelizer {
+public:
+  SequenceDepixelizer(size_t scale_factor, size_t tile_size = 8)
+      : m_scale_factor(scale_factor), m_tile_size(tile_size) {};
+
+  // img is a YUV frame, as loaded by Graph. Returns its rendering
+  const cv::Mat &next_frame(xt::xarray<float> &img);
+
+  // Tiles of the last frame that had to be processed again
+  size_t get_changed_tiles() const { return m_changed_tiles; }
+  size_t get_total_tiles() const { return m_total_tiles; }
+
+private:
+  std::vector<cv::Rect> changed_tiles(const xt::xarray<float> &img);
+
+  size_t m_scale_factor;
+  size_t m_tile_size;
+  std::unique_ptr<IncrementalDepixelizer> m_depixelizer;
+
+  size_t m_changed_tiles = 0;
+  size_t m_total_tiles = 0;
+};
+
+/**
+ * @brief depixelizes the frames of an animation
+ * @param frame_paths, the frames in order, or a single multi-frame file
+ * (e.g. a multi-page tiff)
+ */
+void depixelize_sequence(const std::vector<std::string> &frame_paths);
+
+} // namespace dpxl
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "cells.hpp"
+#include "graph.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace dpxl {
+
+// Binary dump of the intermediate stages of the pipeline, so that the graph
+// resolution and the rendering can run in different processes (or be resumed
+// later without recomputation).
+//
+// The file starts with a StageHeader followed by a table of StageSection
+// entries. Every section is a flat array in native (little endian) byte order
+// aligned on 8 bytes, so a mapped file is read in place without any parsing:
+//  - Image         : uint8  [h*w*3]  YUV pixels (0-255)
+//  - Mask          : uint8  [h*w]    bit k is set if neighbour k is connected
+//  - CellOffsets   : uint32 [h*w+1]  start of each cell in CellNodes
+//  - CellNodes     : uint32 [...]    node indices of every cell
+//  - NodeIds       : uint32 [n]      sorted indices of the non isolated nodes
+//  - NodeOffsets   : uint32 [n+1]    start of each node in NodeAdjacency
+//  - NodeAdjacency : uint32 [...]    indices of the connected nodes
+const uint32_t STAGE_FILE_VERSION = 1;
+
+enum class StageSectionTag : uint32_t {
+  Image = 1,
+  Mask = 2,
+  CellOffsets = 3,
+  CellNodes = 4,
+  NodeIds = 5,
+  NodeOffsets = 6,
+  NodeAdjacency = 7,
+};
+
+struct StageHeader {
+  char magic[4]; // "DPXL"
+  uint32_t version;
+  uint32_t height;
+  uint32_t width;
+  uint32_t section_count;
+  uint32_t reserved;
+};
+
+struct StageSection {
+  uint32_t tag;
+  uint32_t reserved;
+  uint64_t offset; // from the start of the file
+  uint64_t size;   // in bytes
+};
+
+// Write the image and resolved similarity graph, and the cells if given
+bool save_stages(const std::string &path, const Graph &graph,
+                 VoronoiCells *cells = nullptr);
+
+// Read-only memory mapping of a file written by save_stages
+class StageFile {
+public:
+  StageFile() {};
+  ~StageFile();
+
+  StageFile(const StageFile &) = delete;
+  StageFile &operator=(const StageFile &) = delete;
+  StageFile(StageFile &&other) noexcept;
+  StageFile &operator=(StageFile &&other) noexcept;
+
+  bool open(const std::string &path);
+  void close();
+  bool is_open() const { return m_data != nullptr; }
+
+  size_t get_height() const { return m_h; }
+  size_t get_width() const { return m_w; }
+
+  bool has_cells() const { return m_cell_offsets != nullptr; }
+
+  // Zero copy accessors, pointing directly into the mapping
+  const uint8_t *image() const { return m_image; }
+  const uint8_t *mask() const { return m_mask; }
+  bool neighbour(size_t i, size_t j, size_t k) const {
+    return (m_mask[i * m_w + j] >> k) & 1;
+  }
+
+  size_t cell_size(size_t c) const {
+    return m_cell_offsets[c + 1] - m_cell_offsets[c];
+  }
+  const uint32_t *cell(size_t c) const {
+    return m_cell_nodes + m_cell_offsets[c];
+  }
+
+  // Nodes connected to the node of index idx, count is 0 if it is isolated
+  const uint32_t *node_adjacency(size_t idx, size_t &count) const;
+
+  // Copy the stages back into the library types
+  Graph to_graph() const;
+  VoronoiCells to_cells() const;
+
+private:
+  const void *section(StageSectionTag tag, size_t elem_size,
+                      size_t expected_count, size_t &count) const;
+
+  void *m_data = nullptr;
+  size_t m_length = 0;
+
+  size_t m_h = 0;
+  size_t m_w = 0;
+
+  const uint8_t *m_image = nullptr;
+  const uint8_t *m_mask = nullptr;
+  const uint32_t *m_cell_offsets = nullptr;
+  const uint32_t *m_cell_nodes = nullptr;
+  const uint32_t *m_node_ids = nullptr;
+  const uint32_t *m_node_offsets = nullptr;
+  const uint32_t *m_node_adjacency = nullptr;
+  size_t m_node_count = 0;
+};
+
+} // namespace dpxl
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dpxl {
+
+// Long running mode: jobs are read from a stream (stdin/stdout or a unix
+// socket) and processed by a pool of warm worker threads, so that a small
+// sprite does not pay the process startup and cold allocations every time.
+//
+// Every message is a frame: a uint32 payload size followed by the payload, in
+// native (little endian) byte order.
+//  - request  : uint32 id, uint32 deadline_ms, uint32 scale_factor, then the
+//               encoded image (any format cv::imdecode reads)
+//  - response : uint32 id, uint32 status, uint32 degraded steps (see
+//               DegradedStep), then the PNG encoded output, or an error
+//               message if the status is not Ok
+// A job that starts before its deadline always completes: the stages left
+// when it runs out of time take cheaper choices, reported in degraded.
+// Responses come back as the jobs finish, not in the order of the requests.
+enum class JobStatus : uint32_t {
+  Ok = 0,
+  InvalidRequest = 1, // also a job over the memory limit of the server
+  InvalidImage = 2,
+  DeadlineExceeded = 3,
+  Busy = 4,          // too many jobs waiting, to be sent again later
+  InternalError = 5, // the job failed, e.g. out of memory
+};
+
+struct JobRequest {
+  uint32_t id = 0;
+  uint32_t deadline_ms = 0; // from the reception of the request, 0 for none
+  uint32_t scale_factor = 100;
+  std::vector<unsigned char> image;
+};
+
+struct JobResponse {
+  uint32_t id = 0;
+  JobStatus status = JobStatus::Ok;
+  uint32_t degraded = 0;
+  std::vector<unsigned char> data;
+};
+
+bool read_frame(int fd, std::vector<unsigned char> &payload);
+bool write_frame(int fd, const std::vector<unsigned char> &payload);
+
+std::vector<unsigned char> encode_request(const JobRequest &request);
+bool decode_request(const std::vector<unsigned char> &payload,
+                    JobRequest &request);
+std::vector<unsigned char> encode_response(const JobResponse &response);
+bool decode_response(const std::vector<unsigned char> &payload,
+                     JobResponse &response);
+
+class Server {
+public:
+  // Requests are answered Busy while max_queued_jobs wait for a worker, and
+  // InvalidRequest when their estimated memory (see estimate_memory) is over
+  // max_job_bytes
+  explicit Server(size_t thread_count = std::thread::hardware_concurrency(),
+                  size_t max_queued_jobs = 256,
+                  size_t max_job_bytes = size_t(1) << 30);
+  ~Server();
+
+  Server(const Server &) = delete;
+  Server &operator=(const Server &) = delete;
+
+  // Serve the requests read from in_fd until it is closed, each response is
+  // written to out_fd as soon as its job is done
+  void serve(int in_fd, int out_fd);
+
+  // Accept connections on a unix socket, each one is served as above
+  bool listen(const std::string &socket_path);
+
+  typedef std::chrono::steady_clock::time_point Deadline;
+  JobResponse process(const JobRequest &request, Deadline deadline);
+
+private:
+  // false when the queue is full
+  bool submit(std::function<void()> task);
+  void work();
+
+  size_t m_max_queued_jobs;
+  size_t m_max_job_bytes;
+
+  std::vector<std::thread> m_workers;
+  std::deque<std::function<void()>> m_tasks;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  bool m_stop = false;
+};
+
+// Blocking client, e.g. for tests or a front end in the same process
+class Client {
+public:
+  Client() {};
+  explicit Client(int fd) : m_fd(fd) {};
+  ~Client();
+
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+
+  bool connect(const std::string &socket_path);
+
+  bool send(const JobRequest &request);
+  bool receive(JobResponse &response);
+
+private:
+  int m_fd = -1;
+  bool m_owned = false;
+};
+
+} // namespace dpxl
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "budget.hpp"
+#include "cells.hpp"
+#include "graph.hpp"
+#include "stats.hpp"
+
+#include <cstddef>
+#include <opencv2/core/mat.hpp>
+
+namespace dpxl {
+
+// Colours blend across the boundary of two cells whose pixels are linked in
+// the similarity graph, and stay sharp everywhere else. The blend minimizes
+// data_weight * |u - colour|^2 + sum over linked neighbours of |u - u'|^2,
+// first on the pixel graph, then on the output grid from the interpolated
+// pixel solution
+struct ShadingOptions {
+  // Pull of each cell towards its own colour, smaller blends further
+  float data_weight = 1.0f;
+  // Relaxation sweeps on the pixel graph and on the output grid. The system
+  // is screened by data_weight, so a fixed count converges at any size
+  size_t coarse_sweeps = 20;
+  size_t fine_sweeps = 4;
+  // 0 for one per hardware thread
+  size_t thread_count = 0;
+  // Checked between sweeps, the ones left are skipped once it is expired
+  TimeBudget *budget = nullptr;
+};
+
+// Same image as VoronoiCells::colorCells at scale_factor for the cells
+// flattened from the resolved graph, with smooth shading
+void shade_cells(const Graph &graph, const FlatCells &cells,
+                 size_t scale_factor, cv::Mat &output_image,
+                 const ShadingOptions &options = {}, Stats *stats = nullptr);
+
+} // namespace dpxl
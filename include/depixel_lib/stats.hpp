@@ -0,0 +1,74 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace dpxl {
+
+struct StageStats {
+  double seconds = 0.0;
+  // Largest growth of the heap during the stage, in bytes, counted on the
+  // thread running it. Stays 0 unless the executable links depixel_heap_hook
+  long peak_bytes = 0;
+};
+
+// Instrumentation of a run of the pipeline. The library only records into it
+// when given one (see Graph::set_stats and VoronoiCells::set_stats)
+struct Stats {
+  StageStats load;
+  StageStats similarity;
+  StageStats trivial_edges;
+  StageStats heuristics;
+  StageStats cells;
+  StageStats collapse;
+  StageStats render;
+  StageStats shading;
+  StageStats encode;
+
+  size_t crossings = 0;
+  // Heuristic with the largest vote for the kept diagonal
+  size_t decided_by_curves = 0;
+  size_t decided_by_sparse_pixels = 0;
+  size_t decided_by_islands = 0;
+  // Both diagonals dropped
+  size_t ties = 0;
+  // Crossings whose decision was found in the memo of Graph, or not
+  size_t memo_hits = 0;
+  size_t memo_misses = 0;
+
+  // Single coloured tiles found by the pre-pass of compute_neighbours
+  size_t flat_tiles = 0;
+  size_t nodes_collapsed = 0;
+  size_t polygons_rasterized = 0;
+
+  // See estimate_memory, to compare with the peaks of the stages
+  size_t estimated_peak_bytes = 0;
+
+  std::string to_json() const;
+};
+
+// Allocations and frees of the calling thread, reported by a replaced global
+// operator new such as the one of depixel_heap_hook. The library does not
+// replace it itself, the executable opts in
+void record_heap_alloc(std::size_t bytes);
+void record_heap_free(std::size_t bytes);
+
+// Records the time and heap growth of a stage until it goes out of scope, does
+// nothing if stats is null. Only the allocations of the thread running the
+// stage count, not the ones of other threads working at the same time (nor of
+// the helper threads of the stage).
+class StageTimer {
+public:
+  StageTimer(Stats *stats, StageStats Stats::*stage);
+  ~StageTimer();
+
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+
+private:
+  StageStats *m_stage = nullptr;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+} // namespace dpxl
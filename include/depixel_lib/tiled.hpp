@@ -0,0 +1,142 @@
+#pragma once
+
+#include <xtensor/xarray.hpp>
+#include <xtensor/xio.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+namespace dpxl {
+
+// Per-pixel data of an image with C values per pixel, stored by square tiles
+// of TILE x TILE pixels: the tiles in row-major order, the pixels of a tile in
+// row-major order, the values of a pixel next to each other. The pixels
+// around one, as read by the heuristics' windows and curve walks or by the
+// cells, then sit in a few tiles instead of as many rows as the window is
+// tall. Offers the part of the xt::xarray interface the graph relies on, so
+// that it can stand in for it (see DPXL_TILED_STORAGE), and pixel_values for
+// the C values of a pixel at once.
+template <class T, size_t C> class TiledArray {
+public:
+  static constexpr size_t TILE = 8;
+
+  TiledArray() {};
+  template <class U> TiledArray(const xt::xarray<U> &array) {
+    resize(array.shape()[0], array.shape()[1]);
+    for (size_t i = 0; i < m_h; ++i) {
+      for (size_t j = 0; j < m_w; ++j) {
+        for (size_t c = 0; c < C; ++c) {
+          (*this)(i, j, c) = array(i, j, c);
+        }
+      }
+    }
+  }
+
+  static TiledArray from_shape(const std::array<size_t, 3> &shape) {
+    TiledArray array;
+    array.resize(shape[0], shape[1]);
+    return array;
+  }
+
+  void resize(size_t h, size_t w) {
+    m_h = h;
+    m_w = w;
+    m_tiles_w = (w + TILE - 1) / TILE;
+    m_data.resize((h + TILE - 1) / TILE * m_tiles_w * TILE * TILE * C);
+  }
+
+  std::array<size_t, 3> shape() const { return {m_h, m_w, C}; }
+  size_t dimension() const { return 3; }
+  size_t size() const { return m_h * m_w * C; }
+
+  T &operator()(size_t i, size_t j, size_t c) {
+    return m_data[offset(i, j) + c];
+  }
+  const T &operator()(size_t i, size_t j, size_t c) const {
+    return m_data[offset(i, j) + c];
+  }
+
+  // The C values of pixel (i, j), next to each other
+  T *pixel(size_t i, size_t j) { return m_data.data() + offset(i, j); }
+  const T *pixel(size_t i, size_t j) const {
+    return m_data.data() + offset(i, j);
+  }
+
+  void fill(const T &value) { std::fill(m_data.begin(), m_data.end(), value); }
+
+  bool operator==(const TiledArray &other) const {
+    if (shape() != other.shape()) {
+      return false;
+    }
+    for (size_t i = 0; i < m_h; ++i) {
+      for (size_t j = 0; j < m_w; ++j) {
+        for (size_t c = 0; c < C; ++c) {
+          if ((*this)(i, j, c) != other(i, j, c)) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+  bool operator!=(const TiledArray &other) const { return !(*this == other); }
+
+  xt::xarray<T> to_xarray() const {
+    xt::xarray<T> array = xt::xarray<T>::from_shape({m_h, m_w, C});
+    for (size_t i = 0; i < m_h; ++i) {
+      for (size_t j = 0; j < m_w; ++j) {
+        for (size_t c = 0; c < C; ++c) {
+          array(i, j, c) = (*this)(i, j, c);
+        }
+      }
+    }
+    return array;
+  }
+
+private:
+  size_t offset(size_t i, size_t j) const {
+    return ((i / TILE * m_tiles_w + j / TILE) * TILE * TILE +
+            i % TILE * TILE + j % TILE) *
+           C;
+  }
+
+  std::vector<T> m_data;
+  size_t m_h = 0;
+  size_t m_w = 0;
+  size_t m_tiles_w = 0;
+};
+
+template <class T, size_t C>
+std::ostream &operator<<(std::ostream &out, const TiledArray<T, C> &array) {
+  return out << array.to_xarray();
+}
+
+// The values of pixel (i, j) of an h x w x C array in either storage
+template <class T> T *pixel_values(xt::xarray<T> &array, size_t i, size_t j) {
+  return &array(i, j, 0);
+}
+template <class T>
+const T *pixel_values(const xt::xarray<T> &array, size_t i, size_t j) {
+  return &array(i, j, 0);
+}
+template <class T, size_t C>
+T *pixel_values(TiledArray<T, C> &array, size_t i, size_t j) {
+  return array.pixel(i, j);
+}
+template <class T, size_t C>
+const T *pixel_values(const TiledArray<T, C> &array, size_t i, size_t j) {
+  return array.pixel(i, j);
+}
+
+// Storage of the neighbour mask of Graph, h x w x 8. std::vector<bool> packs
+// its bits, the tiled mask takes a byte per link like xt::xarray<bool>
+#ifdef DPXL_TILED_STORAGE
+typedef TiledArray<unsigned char, 8> NeighbourMask;
+#else
+typedef xt::xarray<bool> NeighbourMask;
+#endif
+
+} // namespace dpxl
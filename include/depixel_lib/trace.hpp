@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace dpxl {
+namespace trace {
+
+// Opt-in timeline of the pipeline, written at exit in the Chrome trace event
+// format (chrome://tracing, ui.perfetto.dev). Each thread appends its zones
+// to its own buffer without locking, the trace is read while they record;
+// a disabled zone costs one atomic load.
+
+// Start recording, the trace is written to path when the process exits
+void enable(const std::string &path);
+// Write the events recorded so far, also done at exit
+bool write();
+
+extern std::atomic<bool> g_enabled;
+inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+// Records a complete event from its construction to its destruction. name
+// must outlive the trace, e.g. a string literal
+class Zone {
+public:
+  explicit Zone(const char *name) {
+    if (enabled()) {
+      m_name = name;
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+  ~Zone() {
+    if (m_name != nullptr) {
+      record(m_name, m_start, std::chrono::steady_clock::now());
+    }
+  }
+
+  Zone(const Zone &) = delete;
+  Zone &operator=(const Zone &) = delete;
+
+private:
+  static void record(const char *name,
+                     std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end);
+
+  const char *m_name = nullptr;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+} // namespace trace
+} // namespace dpxl
+
+#define DPXL_TRACE_CONCAT_(a, b) a##b
+#define DPXL_TRACE_CONCAT(a, b) DPXL_TRACE_CONCAT_(a, b)
+// Scoped zone named after the enclosing block
+#define DPXL_TRACE_ZONE(name)                                                  \
+  dpxl::trace::Zone DPXL_TRACE_CONCAT(dpxl_trace_zone_, __LINE__)(name)
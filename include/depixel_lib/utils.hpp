@@ -9,6 +9,8 @@
 #include <xtensor/xadapt.hpp>
 #include <xtensor/xarray.hpp>
 
+#include <cstddef>
+#include <vector>
 
 namespace dpxl
 {
@@ -16,9 +18,37 @@ namespace dpxl
 namespace utils
 {
 
+    // 8 bit mat of 3 or 4 channels (the 4th is dropped) to floats in [0, 1].
+    // The rows are read in place, views and padded mats need no copy
     xt::xarray<float> mat_to_arr(const cv::Mat &mat);
+    // Into arr, only reallocated if its shape changes
+    void mat_to_arr(const cv::Mat &mat, xt::xarray<float> &arr);
 
     cv::Mat arr_to_mat(const xt::xarray<float> &arr);
+    // Into mat, only reallocated if its size changes
+    void arr_to_mat(const xt::xarray<float> &arr, cv::Mat &mat);
+    // Only the pixels inside roi
+    cv::Mat arr_to_mat(const xt::xarray<float> &arr, const cv::Rect &roi);
+
+    // Decoded image (BGR, BGRA or grey, 8 bit) to the YUV array of the
+    // pipeline. Colour images go through one cvtColor into yuv_scratch, grey
+    // ones are converted directly. Same values as cvtColor to YUV followed by
+    // mat_to_arr
+    void image_to_arr(const cv::Mat &image, xt::xarray<float> &arr, cv::Mat &yuv_scratch);
+    // YUV array of the pipeline to BGR, through yuv_scratch
+    void arr_to_bgr(const xt::xarray<float> &arr, cv::Mat &bgr, cv::Mat &yuv_scratch);
+
+    // Rectangle extended by margin on every side
+    cv::Rect grow_rect(const cv::Rect &rect, int margin);
+
+    // Pixels of rects inside bounds as fewer, disjoint rectangles: the tiles of
+    // tile x tile pixels they meet are joined into rectangles of tiles, and
+    // each one gives the smallest rectangle holding the pixels of rects in it.
+    // Only the tiles met are visited. tile_count, if given, receives their
+    // number
+    std::vector<cv::Rect> merge_rects(const std::vector<cv::Rect> &rects,
+                                      const cv::Rect &bounds, int tile,
+                                      size_t *tile_count = nullptr);
 };
     
 }
\ No newline at end of file
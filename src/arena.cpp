@@ -0,0 +1,58 @@
+#include "depixel_lib/arena.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+
+namespace dpxl {
+
+Arena::~Arena() {
+  for (auto &chunk : m_chunks) {
+    ::operator delete(chunk.data);
+  }
+}
+
+void Arena::reset() {
+  // A run that needed several chunks gets a single one as large as all of
+  // them, the next runs of the same size then fit in it
+  if (m_chunks.size() > 1) {
+    size_t capacity = get_capacity();
+    for (auto &chunk : m_chunks) {
+      ::operator delete(chunk.data);
+    }
+    m_chunks.clear();
+    m_chunks.push_back(
+        {static_cast<char *>(::operator new(capacity)), capacity});
+    ++m_chunk_allocations;
+  }
+  m_current = 0;
+  m_offset = 0;
+}
+
+size_t Arena::get_capacity() const {
+  size_t capacity = 0;
+  for (const auto &chunk : m_chunks) {
+    capacity += chunk.size;
+  }
+  return capacity;
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+  for (; m_current < m_chunks.size(); ++m_current, m_offset = 0) {
+    auto &chunk = m_chunks[m_current];
+    void *ptr = chunk.data + m_offset;
+    size_t space = chunk.size - m_offset;
+    if (std::align(alignment, bytes, ptr, space)) {
+      m_offset = static_cast<char *>(ptr) - chunk.data + bytes;
+      return ptr;
+    }
+  }
+
+  // The new chunk is the current one, the allocation fits in it
+  size_t size = std::max(m_chunk_size, bytes + alignment);
+  m_chunks.push_back({static_cast<char *>(::operator new(size)), size});
+  ++m_chunk_allocations;
+  return do_allocate(bytes, alignment);
+}
+
+} // namespace dpxl
@@ -0,0 +1,161 @@
+#include "depixel_lib/band.hpp"
+#include "depixel_lib/cells.hpp"
+#include "depixel_lib/graph.hpp"
+#include "depixel_lib/memory.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+namespace dpxl {
+
+bool BandDepixelizer::run(const RowsCallback &emit) {
+  m_max_halo = 0;
+  size_t band_rows = m_band_height * (4 * m_scale_factor + 1);
+  size_t height = get_output_height();
+  cv::Mat rows;
+  for (size_t y0 = 0; y0 < height; y0 += band_rows) {
+    if (!render_rows(y0, std::min(y0 + band_rows, height), rows)) {
+      return false;
+    }
+    emit(rows, y0);
+  }
+  return true;
+}
+
+bool BandDepixelizer::render_rows(size_t y0, size_t y1, cv::Mat &rows) {
+  long h = m_img.rows;
+  long s = m_scale_factor;
+  long step = 4 * s + 1;
+
+  // Pixel rows of the background and of the cells reaching [y0, y1), a cell
+  // spans the nodes 4 * i - 1 to 4 * i + 5 of its pixel
+  long first = std::min(long(y0) / step, (long(y0) - 5 * s) / (4 * s));
+  long last = std::max(long(y1 - 1) / step, (long(y1 - 1) + s) / (4 * s)) + 1;
+  first = std::max(first, 0L);
+  last = std::min(last, h);
+
+  // Cells depend on the neighbours of the rows around them
+  long exact_first = std::max(first - 1, 0L);
+  long exact_last = std::min(last + 1, h);
+
+  for (long halo = m_halo;; halo *= 2) {
+    // Past the limit, a last try at the limit itself
+    if (m_halo_limit != 0 && halo > long(m_halo_limit)) {
+      if (halo / 2 >= long(m_halo_limit)) {
+        return false;
+      }
+      halo = m_halo_limit;
+    }
+    long top = std::max(exact_first - 1 - halo, 0L);
+    long bottom = std::min(exact_last + 1 + halo, h);
+
+    cv::Mat img_yuv;
+    xt::xarray<float> img;
+    utils::image_to_arr(m_img(cv::Rect(0, top, m_img.cols, bottom - top)), img,
+                        img_yuv);
+
+    Graph graph(img);
+    graph.set_stats(m_stats);
+    graph.set_color_metric(m_color_metric);
+    graph.compute_neighbours();
+    graph.remove_trivial_edges();
+    graph.resolve_diagonals();
+
+    bool whole = top == 0 && bottom == h;
+    if (!whole && !graph.is_exact_band(exact_first - top, exact_last - top,
+                                       top > 0, bottom < h)) {
+      continue;
+    }
+    m_max_halo = std::max(m_max_halo, size_t(halo));
+
+    VoronoiCells cells;
+    cells.set_stats(m_stats);
+    cells.build_from_graph(graph);
+
+    rows.create(y1 - y0, get_output_width(), CV_8UC3);
+    cells.colorBand(rows, m_scale_factor, graph.get_image(), top, y0);
+    return true;
+  }
+}
+
+bool depixelize_bands(const std::string &image_path, size_t band_height,
+                      const ColorMetricConfig &color_metric,
+                      size_t memory_budget, Stats *stats) {
+  fs::path output_dir = "visualisation";
+  fs::create_directories(output_dir); // Ensure the output directory exists
+  std::string file_name = fs::absolute(image_path).stem().string();
+
+  cv::Mat img_bgr;
+  {
+    StageTimer timer(stats, &Stats::load);
+    img_bgr = cv::imread(image_path, cv::IMREAD_COLOR);
+  }
+  if (img_bgr.empty()) {
+    std::cerr << "Could not read the image: " << image_path << std::endl;
+    return false;
+  }
+
+  BandDepixelizer bands(img_bgr, 100, band_height);
+  bands.set_color_metric(color_metric);
+  bands.set_stats(stats);
+  size_t halo_limit = 0;
+  if (memory_budget != 0) {
+    halo_limit = halo_for_budget(img_bgr.rows, img_bgr.cols, 100, band_height,
+                                 memory_budget);
+    if (halo_limit == 0) {
+      std::cerr << "Bands of " << band_height << " rows do not fit in the "
+                << "memory budget of " << format_bytes(memory_budget)
+                << std::endl;
+      return false;
+    }
+    bands.set_halo_limit(halo_limit);
+  }
+
+  // PNG can not be written a few rows at a time, a binary PPM can
+  fs::path output_path =
+      output_dir / (file_name + "_voronoi_cells_colored.ppm");
+  std::ofstream out(output_path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Failed to save the output image." << std::endl;
+    return false;
+  }
+  out << "P6\n"
+      << bands.get_output_width() << " " << bands.get_output_height()
+      << "\n255\n";
+
+  bool done = bands.run([&](const cv::Mat &rows, size_t) {
+    StageTimer timer(stats, &Stats::encode);
+    cv::Mat rows_rgb;
+    cv::cvtColor(rows, rows_rgb, cv::COLOR_BGR2RGB);
+    for (int y = 0; y < rows_rgb.rows; ++y) {
+      out.write(reinterpret_cast<const char *>(rows_rgb.ptr(y)),
+                rows_rgb.cols * 3);
+    }
+  });
+  if (!done) {
+    // Long curves crossing the cut between two bands
+    std::cerr << "A band of " << image_path << " needs a halo of more than "
+              << halo_limit << " rows to be exact, more than the memory "
+              << "budget of " << format_bytes(memory_budget) << " allows. "
+              << "The output " << output_path << " is incomplete"
+              << std::endl;
+    return false;
+  }
+
+  if (out) {
+    std::cout << "Output image saved to " << output_path << std::endl;
+    return true;
+  }
+  std::cerr << "Failed to save the output image." << std::endl;
+  return false;
+}
+
+} // namespace dpxl
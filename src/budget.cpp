@@ -0,0 +1,39 @@
+#include "depixel_lib/budget.hpp"
+
+#include <utility>
+
+namespace dpxl {
+
+std::string degraded_steps_to_string(uint32_t steps) {
+  static const std::pair<uint32_t, const char *> names[] = {
+      {DegradedCurves, "curves"},
+      {DegradedHeuristics, "heuristics"},
+      {DegradedCells, "cells"},
+      {DegradedRender, "render"},
+      {DegradedShading, "shading"},
+  };
+  std::string result;
+  for (const auto &name : names) {
+    if (steps & name.first) {
+      result += (result.empty() ? "" : ",") + std::string(name.second);
+    }
+  }
+  return result.empty() ? "none" : result;
+}
+
+TimeBudget::TimeBudget(Clock::time_point deadline, double low_fraction)
+    : m_start(Clock::now()), m_deadline(deadline), m_limited(true) {
+  auto total = std::chrono::duration_cast<Clock::duration>(
+      (deadline - m_start) * low_fraction);
+  m_low = m_start + total;
+}
+
+bool TimeBudget::expired() const {
+  return m_cancelled || (m_limited && Clock::now() >= m_deadline);
+}
+
+bool TimeBudget::running_low() const {
+  return m_cancelled || (m_limited && Clock::now() >= m_low);
+}
+
+} // namespace dpxl
@@ -1,10 +1,13 @@
 #include "depixel_lib/cells.hpp"
+#include "depixel_lib/trace.hpp"
 #include "depixel_lib/utils.hpp"
 
 #include <algorithm>
 #include <boost/polygon/voronoi_diagram.hpp>
 #include <cstddef>
 #include <iterator>
+#include <map>
+#include <new>
 #include <opencv2/core/hal/interface.h>
 #include <opencv2/core/types.hpp>
 #include <ostream>
@@ -53,154 +56,309 @@ direction get_direction(size_t n) {
   }
 }
 
-size_t valency(std::set<size_t> s) { return s.size(); }
+template <class Set> size_t valency(const Set &s) { return s.size(); }
 
 size_t VoronoiCells::c_idx(size_t i, size_t j) { return m_w * i + j; };
 size_t VoronoiCells::n_idx(size_t i, size_t j, size_t k, size_t l) {
   return (4 * m_w + 1) * (4 * i + k) + 4 * j + l;
 };
 
-void VoronoiCells::build_from_graph(Graph g) {
+namespace {
+// polymorphic_allocator does not propagate on assignment, an assigned
+// container would keep its old resource. It is rebuilt in place instead
+template <class Container>
+void rebuild(Container &container, std::pmr::memory_resource *resource) {
+  container.~Container();
+  new (&container) Container(resource);
+}
+} // namespace
+
+void VoronoiCells::clear() {
+  rebuild(m_cells, m_resource);
+  rebuild(m_nodes, m_resource);
+  m_flat_tiles.clear();
+}
+
+void VoronoiCells::copy_flat_tiles(const Graph &g) {
+  size_t tiles_h = m_h / Graph::FLAT_TILE;
+  size_t tiles_w = m_w / Graph::FLAT_TILE;
+  m_flat_tiles.assign(tiles_h * tiles_w, false);
+  for (size_t ti = 0; ti < tiles_h; ++ti) {
+    for (size_t tj = 0; tj < tiles_w; ++tj) {
+      m_flat_tiles[ti * tiles_w + tj] = g.is_flat_tile(ti, tj);
+    }
+  }
+}
+
+void VoronoiCells::copy_flat_tiles(const Graph &g, cv::Rect pixels) {
+  // Cells built elsewhere, e.g. loaded from a stage file, have no map yet
+  const size_t tile = Graph::FLAT_TILE;
+  size_t tiles_h = m_h / tile;
+  size_t tiles_w = m_w / tile;
+  if (m_flat_tiles.size() != tiles_h * tiles_w) {
+    copy_flat_tiles(g);
+    return;
+  }
+  for (size_t ti = pixels.y / tile;
+       ti < std::min((pixels.y + pixels.height - 1) / tile + 1, tiles_h); ++ti) {
+    for (size_t tj = pixels.x / tile;
+         tj < std::min((pixels.x + pixels.width - 1) / tile + 1, tiles_w);
+         ++tj) {
+      m_flat_tiles[ti * tiles_w + tj] = g.is_flat_tile(ti, tj);
+    }
+  }
+}
 
-  auto neighbours = g.get_neighbours();
+bool VoronoiCells::in_flat_interior(size_t i, size_t j) {
+  const size_t tile = Graph::FLAT_TILE;
+  size_t tiles_w = m_w / tile;
+  return i % tile != 0 && i % tile != tile - 1 && j % tile != 0 &&
+         j % tile != tile - 1 && i / tile < m_h / tile && j / tile < tiles_w &&
+         !m_flat_tiles.empty() && m_flat_tiles[i / tile * tiles_w + j / tile];
+}
+
+bool VoronoiCells::build_from_graph(const Graph &g) {
+  DPXL_TRACE_ZONE("VoronoiCells::build_from_graph");
+
+  const auto &neighbours = g.get_neighbours();
   auto h = neighbours.shape()[0];
   m_h = h;
   auto w = neighbours.shape()[1];
   m_w = w;
 
-  m_cells = CellArray(h * w);
-  m_nodes = NodeArray((4 * w + 1) * (4 * h + 1));
+  clear();
+  m_cells.resize(h * w);
+  m_nodes.resize((4 * w + 1) * (4 * h + 1));
+  copy_flat_tiles(g);
 
   // Create base pseudo voronoi diagram
   // This is not a true voronoi diagram, rather we apply a set of rules designed
   // to approach what is seemingly done in the paper
   // See details in our pdf document
-  for (int i = 0; i < h; i++) {
-    for (int j = 0; j < w; j++) {
-
-      auto &cell = m_cells[c_idx(i, j)];
-      // Wether there is an edge or not,
-      // The node between to horizontal pixel is allways at the midpoint
-
-      // Diagonally if there are no edge connecting the pixels, add a
-      // midpoint Else add two point to both sides of the mid (see the image
-      // in the paper)
-
-      // We place the node in trigonometric order to know which nodes are linked
-      // together
-
-      cell.push_back(n_idx(i, j, 2, 4)); // Right midpoint
-
-      if (neighbours(i, j, 1)) {
-        cell.push_back(n_idx(i, j, 1, 5));
-        cell.push_back(n_idx(i, j, -1, 3));
-      } else {
-        if (j < w - 1 and neighbours(i, j + 1, 3)) {
-          cell.push_back(n_idx(i, j, 1, 3));
-        } else {
+  {
+    StageTimer timer(m_stats, &Stats::cells);
+    size_t skipped_midpoints = 0;
+    for (int i = 0; i < h; i++) {
+      if (m_budget && m_budget->expired()) {
+        m_budget->degrade(DegradedCells);
+        clear();
+        return false;
+      }
+      for (int j = 0; j < w; j++) {
+        // Inside a flat tile every corner keeps a valency above 2 and every
+        // midpoint is collapsed: the cell is the pixel's square. Its corners
+        // get linked through the neighbouring cells, a midpoint shared with
+        // another such cell gets no link and is counted here as collapsed
+        if (in_flat_interior(i, j)) {
+          auto &cell = m_cells[c_idx(i, j)];
+          cell.clear();
           cell.push_back(n_idx(i, j, 0, 4));
-        }
-      } // Top Right
-
-      cell.push_back(n_idx(i, j, 0, 2)); // Top midpoint
-
-      if (neighbours(i, j, 3)) {
-        cell.push_back(n_idx(i, j, -1, 1));
-        cell.push_back(n_idx(i, j, 1, -1));
-      } else {
-        if (j > 0 and neighbours(i, j - 1, 1)) {
-          cell.push_back(n_idx(i, j, 1, 1));
-        } else {
           cell.push_back(n_idx(i, j, 0, 0));
-        }
-      } // Top Left
-
-      cell.push_back(n_idx(i, j, 2, 0)); // Left midpoint
-
-      if (neighbours(i, j, 5)) {
-        cell.push_back(n_idx(i, j, 3, -1));
-        cell.push_back(n_idx(i, j, 5, 1));
-      } else {
-        if (j > 0 and neighbours(i, j - 1, 7)) {
-          cell.push_back(n_idx(i, j, 3, 1));
-        } else {
           cell.push_back(n_idx(i, j, 4, 0));
-        }
-      } // Bottom Left
-
-      cell.push_back(n_idx(i, j, 4, 2)); // Bottom midpoint
-
-      if (neighbours(i, j, 7)) {
-        cell.push_back(n_idx(i, j, 5, 3));
-        cell.push_back(n_idx(i, j, 3, 5));
-      } else {
-        if (j < w - 1 and neighbours(i, j + 1, 5)) {
-          cell.push_back(n_idx(i, j, 3, 3));
-        } else {
           cell.push_back(n_idx(i, j, 4, 4));
+          skipped_midpoints += in_flat_interior(i, j + 1);
+          skipped_midpoints += in_flat_interior(i + 1, j);
+          continue;
         }
-      } // Bottom Right
-
-      // We now iterate over the nodes in the cell to connect them together
-      // , creating a graph
-      // We assume trigonometric ordering of the nodes
-      auto num_of_nodes = cell.size();
-      for (int k = 0; k < num_of_nodes; k++) {
-        m_nodes[cell[k]].insert(cell[(k + 1) % num_of_nodes]);
-        m_nodes[cell[(k + 1) % num_of_nodes]].insert(cell[k]);
+        raw_cell(neighbours, i, j, m_cells[c_idx(i, j)]);
+        connect_cell(m_cells[c_idx(i, j)]);
       }
     }
+    if (m_stats) {
+      m_stats->nodes_collapsed += skipped_midpoints;
+    }
   }
 
+  StageTimer timer(m_stats, &Stats::collapse);
   collapse_valency2_nodes();
+  return true;
 }
 
-void VoronoiCells::collapse_valency2_nodes() {
-  std::vector<size_t> deleted_nodes;
+void VoronoiCells::raw_cell(const NeighbourMask &neighbours, size_t i,
+                            size_t j, std::pmr::vector<size_t> &cell) {
+  auto w = m_w;
+  cell.clear();
+  // Wether there is an edge or not,
+  // The node between to horizontal pixel is allways at the midpoint
+
+  // Diagonally if there are no edge connecting the pixels, add a
+  // midpoint Else add two point to both sides of the mid (see the image
+  // in the paper)
+
+  // We place the node in trigonometric order to know which nodes are linked
+  // together
+
+  cell.push_back(n_idx(i, j, 2, 4)); // Right midpoint
+
+  if (neighbours(i, j, 1)) {
+    cell.push_back(n_idx(i, j, 1, 5));
+    cell.push_back(n_idx(i, j, -1, 3));
+  } else {
+    if (j < w - 1 and neighbours(i, j + 1, 3)) {
+      cell.push_back(n_idx(i, j, 1, 3));
+    } else {
+      cell.push_back(n_idx(i, j, 0, 4));
+    }
+  } // Top Right
+
+  cell.push_back(n_idx(i, j, 0, 2)); // Top midpoint
+
+  if (neighbours(i, j, 3)) {
+    cell.push_back(n_idx(i, j, -1, 1));
+    cell.push_back(n_idx(i, j, 1, -1));
+  } else {
+    if (j > 0 and neighbours(i, j - 1, 1)) {
+      cell.push_back(n_idx(i, j, 1, 1));
+    } else {
+      cell.push_back(n_idx(i, j, 0, 0));
+    }
+  } // Top Left
+
+  cell.push_back(n_idx(i, j, 2, 0)); // Left midpoint
+
+  if (neighbours(i, j, 5)) {
+    cell.push_back(n_idx(i, j, 3, -1));
+    cell.push_back(n_idx(i, j, 5, 1));
+  } else {
+    if (j > 0 and neighbours(i, j - 1, 7)) {
+      cell.push_back(n_idx(i, j, 3, 1));
+    } else {
+      cell.push_back(n_idx(i, j, 4, 0));
+    }
+  } // Bottom Left
+
+  cell.push_back(n_idx(i, j, 4, 2)); // Bottom midpoint
+
+  if (neighbours(i, j, 7)) {
+    cell.push_back(n_idx(i, j, 5, 3));
+    cell.push_back(n_idx(i, j, 3, 5));
+  } else {
+    if (j < w - 1 and neighbours(i, j + 1, 5)) {
+      cell.push_back(n_idx(i, j, 3, 3));
+    } else {
+      cell.push_back(n_idx(i, j, 4, 4));
+    }
+  } // Bottom Right
+}
+
+void VoronoiCells::connect_cell(const std::pmr::vector<size_t> &cell) {
+  // We now iterate over the nodes in the cell to connect them together
+  // , creating a graph
+  // We assume trigonometric ordering of the nodes
+  auto num_of_nodes = cell.size();
+  for (int k = 0; k < num_of_nodes; k++) {
+    m_nodes[cell[k]].insert(cell[(k + 1) % num_of_nodes]);
+    m_nodes[cell[(k + 1) % num_of_nodes]].insert(cell[k]);
+  }
+}
+
+bool VoronoiCells::on_border(size_t k) {
+  return k % (4 * m_w + 1) == 4 * m_w or k % (4 * m_w + 1) == 0 or
+         k / (4 * m_w + 1) == 0 or k / (4 * m_w + 1) == 4 * m_h;
+}
 
+void VoronoiCells::collapse_valency2_nodes() {
+  // We only collapse valency 2 nodes that aren't on the border
+  // Such a node sits in the middle of a chain shared by the same cells, so
+  // collapsing it amounts to removing it from these cells: the nodes are
+  // then connected again from the remaining ones
+  DPXL_TRACE_ZONE("VoronoiCells::collapse_valency2_nodes");
+  std::pmr::vector<bool> deleted_nodes(m_nodes.size(), false, m_resource);
   for (int k = 0; k < m_nodes.size(); k++) {
-    auto &node = m_nodes[k];
-    // We only collapse valency 2 nodes that aren't on the border
-    if (valency(m_nodes[k]) == 2 and
-        not(k % (4 * m_w + 1) == 4 * m_w or k % (4 * m_w + 1) == 0 or
-            std::div(k, 4 * m_w + 1).quot == 0 or
-            std::div(k, 4 * m_w + 1).quot == 4 * m_h)) {
-      auto neighbour_idx_0_ptr = m_nodes[k].begin();
-      auto neighbour_idx_1_ptr = std::next(m_nodes[k].begin(), 1);
-
-      m_nodes[*neighbour_idx_0_ptr].erase(k);
-      m_nodes[*neighbour_idx_0_ptr].insert(*neighbour_idx_1_ptr);
-      m_nodes[*neighbour_idx_1_ptr].erase(k);
-      m_nodes[*neighbour_idx_1_ptr].insert(*neighbour_idx_0_ptr);
-
-      node.erase(*neighbour_idx_0_ptr);
-      node.erase(*neighbour_idx_1_ptr);
-
-      // Create a list of erased nodes
-      // Then go through the cells again, deleting valency 2 nodes
-      //
-      // TODO If we knew in how many cell a node was, we could add it to the
-      // vector after having deleted the node enough time its deleted from
-      // deleted_nodes to make traversal shorter ?
-      deleted_nodes.push_back(k);
-    }
+    deleted_nodes[k] = valency(m_nodes[k]) == 2 and not on_border(k);
+  }
+  if (m_stats) {
+    m_stats->nodes_collapsed +=
+        std::count(deleted_nodes.begin(), deleted_nodes.end(), true);
+  }
+
+  for (auto &cell : m_cells) {
+    cell.erase(std::remove_if(cell.begin(), cell.end(),
+                              [&](size_t n) { return deleted_nodes[n]; }),
+               cell.end());
   }
 
-  for (int k = 0; k < m_cells.size(); k++) {
-    auto cell = m_cells[k];
-    std::vector<size_t> new_cell;
+  for (auto &node : m_nodes) {
+    node.clear();
+  }
+  for (const auto &cell : m_cells) {
+    connect_cell(cell);
+  }
+}
 
-    for (int i = 0; i < cell.size(); i++) {
-      if (std::find(deleted_nodes.begin(), deleted_nodes.end(), cell[i]) ==
-          deleted_nodes.end()) {
-        // Node isn't in the deleted_nodes list
-        // We add it to the new cell
-        new_cell.push_back(cell[i]);
+cv::Rect VoronoiCells::update_region(const Graph &g, cv::Rect changed) {
+  // Only the cells around the changed pixels are rebuilt, so that the result
+  // matches build_from_graph on the whole graph:
+  //  - raw cells depend on the horizontal neighbours' diagonals (cols +-1)
+  //  - the valency of their nodes on the raw cells one pixel further
+  //  - collapsing these nodes changes every cell holding them
+  DPXL_TRACE_ZONE("VoronoiCells::update_region");
+  const auto &neighbours = g.get_neighbours();
+  cv::Rect bounds(0, 0, m_w, m_h);
+  cv::Rect raw =
+      cv::Rect(changed.x - 1, changed.y, changed.width + 2, changed.height) &
+      bounds;
+  if (raw.empty()) {
+    return raw;
+  }
+  cv::Rect rebuilt = utils::grow_rect(raw, 1) & bounds;
+  cv::Rect around = utils::grow_rect(rebuilt, 1) & bounds;
+  // The graph only redetects the flat tiles it edits, inside changed
+  copy_flat_tiles(g, around);
+
+  // Raw cells and valency of their nodes
+  std::map<size_t, std::set<size_t>> raw_nodes;
+  CellArray raw_cells(around.area());
+  for (int i = around.y; i < around.y + around.height; i++) {
+    for (int j = around.x; j < around.x + around.width; j++) {
+      auto &cell = raw_cells[(i - around.y) * around.width + j - around.x];
+      raw_cell(neighbours, i, j, cell);
+      for (int k = 0; k < cell.size(); k++) {
+        raw_nodes[cell[k]].insert(cell[(k + 1) % cell.size()]);
+        raw_nodes[cell[(k + 1) % cell.size()]].insert(cell[k]);
       }
     }
+  }
 
-    m_cells[k] = new_cell;
+  // Every node of a rebuilt cell, before and after, gets connected again
+  std::set<size_t> affected_nodes;
+  for (int i = rebuilt.y; i < rebuilt.y + rebuilt.height; i++) {
+    for (int j = rebuilt.x; j < rebuilt.x + rebuilt.width; j++) {
+      auto &cell = m_cells[c_idx(i, j)];
+      affected_nodes.insert(cell.begin(), cell.end());
+
+      cell = raw_cells[(i - around.y) * around.width + j - around.x];
+      cell.erase(std::remove_if(cell.begin(), cell.end(),
+                                [&](size_t n) {
+                                  return valency(raw_nodes[n]) == 2 and
+                                         not on_border(n);
+                                }),
+                 cell.end());
+      affected_nodes.insert(cell.begin(), cell.end());
+    }
+  }
+
+  for (auto n : affected_nodes) {
+    m_nodes[n].clear();
+  }
+  for (int i = around.y; i < around.y + around.height; i++) {
+    for (int j = around.x; j < around.x + around.width; j++) {
+      const auto &cell = m_cells[c_idx(i, j)];
+      auto num_of_nodes = cell.size();
+      for (int k = 0; k < num_of_nodes; k++) {
+        auto n0 = cell[k];
+        auto n1 = cell[(k + 1) % num_of_nodes];
+        if (affected_nodes.count(n0)) {
+          m_nodes[n0].insert(n1);
+        }
+        if (affected_nodes.count(n1)) {
+          m_nodes[n1].insert(n0);
+        }
+      }
+    }
   }
+
+  return rebuilt;
 }
 
 std::pair<size_t, size_t> VoronoiCells::n_pos(size_t idx) {
@@ -211,78 +369,243 @@ cv::Mat VoronoiCells::draw(size_t scale_factor, const xt::xarray<float>& img) {
   
   //cv::Mat img_bgr(m_h, m_w, CV_8UC3, cv::Scalar(255, 255, 255));
   // Create a copy of the base image to draw on
-  cv::Mat img_yuv = utils::arr_to_mat(img);
+  cv::Mat img_yuv;
   cv::Mat img_bgr;
-  cv::cvtColor(img_yuv, img_bgr, cv::COLOR_YUV2BGR);
+  utils::arr_to_bgr(img, img_bgr, img_yuv);
 
   // Upscale the image
   cv::Mat output_image;
   cv::resize(img_bgr, output_image, cv::Size(), 4 * scale_factor + 1,
              4 * scale_factor + 1, cv::INTER_NEAREST);
 
-  for (int y = 0; y < m_h; ++y) {
-    for (int x = 0; x < m_w; ++x) {
-      // std::cout << "Accessing cell: (" << y << "," << x << ")" << std::endl;
-      auto cell = m_cells[c_idx(y, x)];
-      // std::cout << "size: " << cell.size();
-      // std::cout << "\nDone\n";
-
-      // for (int k = 0; k < cell.size(); k++) {
-      for (int k = 0; k < cell.size(); k++) {
-        auto node_1_pos = n_pos(cell[k]);
-        auto node_2_pos = n_pos(cell[(k + 1) % cell.size()]);
-
-        cv::line(output_image,
-                 cv::Point(node_1_pos.second * scale_factor,
-                           node_1_pos.first * scale_factor),
-                 cv::Point(node_2_pos.second * scale_factor,
-                           node_2_pos.first * scale_factor),
-                 cv::Scalar(0, 0, 255), 2);
+  // The nodes hold the edges of the cells, each edge shared by two cells is
+  // drawn once from its smaller node
+  for (size_t n1 = 0; n1 < m_nodes.size(); ++n1) {
+    auto node_1_pos = n_pos(n1);
+    for (size_t n2 : m_nodes[n1]) {
+      if (n2 < n1) {
+        continue;
       }
+      auto node_2_pos = n_pos(n2);
+      cv::line(output_image,
+               cv::Point(node_1_pos.second * scale_factor,
+                         node_1_pos.first * scale_factor),
+               cv::Point(node_2_pos.second * scale_factor,
+                         node_2_pos.first * scale_factor),
+               cv::Scalar(0, 0, 255), 2);
     }
   }
 
   return output_image;
 }
 
+FlatCells VoronoiCells::flatten(const xt::xarray<float> &img) {
+  DPXL_TRACE_ZONE("VoronoiCells::flatten");
+  FlatCells flat;
+  flat.h = m_h;
+  flat.w = m_w;
+  cv::Mat img_yuv;
+  utils::arr_to_bgr(img, flat.img_bgr, img_yuv);
+
+  flat.offsets.reserve(m_cells.size());
+  flat.counts.reserve(m_cells.size());
+  for (const auto &cell : m_cells) {
+    flat.offsets.push_back(flat.points.size());
+    flat.counts.push_back(cell.size());
+    for (size_t node : cell) {
+      auto node_pos = n_pos(node);
+      flat.points.emplace_back(node_pos.first, node_pos.second);
+    }
+  }
+  return flat;
+}
+
 cv::Mat VoronoiCells::colorCells(size_t scale_factor, const xt::xarray<float>& img) {
+    cv::Mat output_image;
+    colorCells(output_image, scale_factor, img);
+    return output_image;
+}
+
+void VoronoiCells::colorCells(cv::Mat& output_image, size_t scale_factor, const xt::xarray<float>& img) {
+    DPXL_TRACE_ZONE("VoronoiCells::colorCells");
+    StageTimer timer(m_stats, &Stats::render);
+
     // Convert the input image to BGR format
-    cv::Mat img_yuv = utils::arr_to_mat(img);
-    cv::Mat img_bgr;
-    cv::cvtColor(img_yuv, img_bgr, cv::COLOR_YUV2BGR);
+    utils::arr_to_bgr(img, m_img_bgr, m_img_yuv);
 
     // Upscale the image
-    cv::Mat output_image;
-    cv::resize(img_bgr, output_image, cv::Size(), 4 * scale_factor + 1,
+    cv::resize(m_img_bgr, output_image, cv::Size(), 4 * scale_factor + 1,
                4 * scale_factor + 1, cv::INTER_NEAREST);
 
-    for (int y = 0; y < m_h; ++y) {
+    // The square cells inside a flat tile are filled at once, from its first
+    // one, unless img is no longer flat there
+    const size_t tile = Graph::FLAT_TILE;
+    std::vector<bool> filled(m_flat_tiles.size(), false);
+    // Without cells, or out of time, the pixels stay upscaled
+    int rows = m_cells.size() == m_h * m_w ? m_h : 0;
+    for (int y = 0; y < rows; ++y) {
+        if (m_budget && m_budget->expired()) {
+            m_budget->degrade(DegradedRender);
+            break;
+        }
         for (int x = 0; x < m_w; ++x) {
-            // Get the color of the pixel at (y, x)
-            cv::Vec3b pixel_color = img_bgr.at<cv::Vec3b>(y, x);
-
-            // Access the cell corresponding to the pixel
-            auto cell = m_cells[c_idx(y, x)];
-
-            // Create a vector of points to define the polygon
-            std::vector<cv::Point> polygon;
-            for (int k = 0; k < cell.size(); k++) {
-                auto node_pos = n_pos(cell[k]);
-                polygon.emplace_back(
-                    node_pos.first * scale_factor, // x-coordinate
-                    node_pos.second * scale_factor   // y-coordinate
-                );
+            if (in_flat_interior(y, x)) {
+                size_t t = y / tile * (m_w / tile) + x / tile;
+                if (y % tile == 1 && x % tile == 1) {
+                    filled[t] = fill_flat_interior(output_image, scale_factor, y, x);
+                }
+                if (filled[t]) {
+                    continue;
+                }
             }
+            // Fill the cell with the color of the pixel at (y, x)
+            fill_cell(output_image, scale_factor, y, x, m_img_bgr.at<cv::Vec3b>(y, x), cv::Point(0, 0));
+        }
+    }
+}
 
-            // Fill the polygon with the pixel color
-            cv::fillPoly(output_image, std::vector<std::vector<cv::Point>>{polygon},
-                         cv::Scalar(pixel_color[0], pixel_color[1], pixel_color[2]));
+bool VoronoiCells::fill_flat_interior(cv::Mat& output_image, size_t scale_factor, size_t y, size_t x) {
+    const size_t side = Graph::FLAT_TILE - 2;
+    const cv::Vec3b pixel_color = m_img_bgr.at<cv::Vec3b>(y, x);
+    for (size_t i = y; i < y + side; ++i) {
+        for (size_t j = x; j < x + side; ++j) {
+            if (m_img_bgr.at<cv::Vec3b>(i, j) != pixel_color) {
+                return false;
+            }
         }
     }
 
-    return output_image;
+    int x0 = 4 * x * scale_factor;
+    int y0 = 4 * y * scale_factor;
+    int x1 = 4 * (x + side) * scale_factor;
+    int y1 = 4 * (y + side) * scale_factor;
+    m_polygon.assign({{x1, y0}, {x0, y0}, {x0, y1}, {x1, y1}});
+    if (m_stats) {
+        m_stats->polygons_rasterized++;
+    }
+
+    const cv::Point* points = m_polygon.data();
+    int count = m_polygon.size();
+    cv::fillPoly(output_image, &points, &count, 1,
+                 cv::Scalar(pixel_color[0], pixel_color[1], pixel_color[2]));
+    return true;
+}
+
+cv::Rect VoronoiCells::colorCells(cv::Mat& output_image, size_t scale_factor,
+                                  const xt::xarray<float>& img, cv::Rect region) {
+    DPXL_TRACE_ZONE("VoronoiCells::colorCells(region)");
+    cv::Rect bounds(0, 0, m_w, m_h);
+    region &= bounds;
+    if (region.empty()) {
+        return cv::Rect();
+    }
+
+    // Cells reach one node outside of their pixel
+    int step = 4 * scale_factor + 1;
+    cv::Rect area = cv::Rect((4 * region.x - 1) * scale_factor, (4 * region.y - 1) * scale_factor,
+                             (4 * region.width + 2) * scale_factor + 1,
+                             (4 * region.height + 2) * scale_factor + 1) &
+                    cv::Rect(0, 0, output_image.cols, output_image.rows);
+
+    // Pixels needed for the background (see the resize in colorCells) and the cells
+    cv::Rect cells = utils::grow_rect(region, 1) & bounds;
+    cv::Rect background(area.x / step, area.y / step,
+                        (area.x + area.width - 1) / step - area.x / step + 1,
+                        (area.y + area.height - 1) / step - area.y / step + 1);
+    cv::Rect source = (cells | background) & bounds;
+
+    cv::Mat img_yuv = utils::arr_to_mat(img, source);
+    cv::Mat img_bgr;
+    cv::cvtColor(img_yuv, img_bgr, cv::COLOR_YUV2BGR);
+
+    for (int y = area.y; y < area.y + area.height; ++y) {
+        for (int x = area.x; x < area.x + area.width; ++x) {
+            output_image.at<cv::Vec3b>(y, x) = img_bgr.at<cv::Vec3b>(y / step - source.y, x / step - source.x);
+        }
+    }
+
+    // The cells only cover 4 * scale_factor per pixel, the background of the
+    // region is also visible in the right and bottom margins
+    cv::Rect margin = cv::Rect(region.x * step, region.y * step, region.width * step, region.height * step) &
+                      cv::Rect(0, 0, output_image.cols, output_image.rows);
+    for (int y = margin.y; y < margin.y + margin.height; ++y) {
+        for (int x = margin.x; x < margin.x + margin.width; ++x) {
+            if (y > 4 * m_h * scale_factor || x > 4 * m_w * scale_factor) {
+                output_image.at<cv::Vec3b>(y, x) = img_bgr.at<cv::Vec3b>(y / step - source.y, x / step - source.x);
+            }
+        }
+    }
+
+    // Every cell crossing the area is drawn again in the same order as colorCells
+    cv::Mat output_area = output_image(area);
+    for (int y = cells.y; y < cells.y + cells.height; ++y) {
+        for (int x = cells.x; x < cells.x + cells.width; ++x) {
+            fill_cell(output_area, scale_factor, y, x,
+                      img_bgr.at<cv::Vec3b>(y - source.y, x - source.x),
+                      cv::Point(-area.x, -area.y));
+        }
+    }
+
+    return area | margin;
 }
 
+void VoronoiCells::colorBand(cv::Mat& output_rows, size_t scale_factor, const xt::xarray<float>& img,
+                             size_t first_row, size_t y0) {
+    DPXL_TRACE_ZONE("VoronoiCells::colorBand");
+    cv::Mat img_yuv;
+    cv::Mat img_bgr;
+    utils::arr_to_bgr(img, img_bgr, img_yuv);
+
+    // Background, as the resize in colorCells
+    size_t step = 4 * scale_factor + 1;
+    for (int y = 0; y < output_rows.rows; ++y) {
+        const cv::Vec3b* source = img_bgr.ptr<cv::Vec3b>((y0 + y) / step - first_row);
+        cv::Vec3b* row = output_rows.ptr<cv::Vec3b>(y);
+        for (int x = 0; x < output_rows.cols; ++x) {
+            row[x] = source[x / step];
+        }
+    }
 
+    // Cells reaching the rows, in the same order as colorCells. A cell spans
+    // the nodes 4 * y - 1 to 4 * y + 5 of its pixel
+    long offset = long(4 * first_row * scale_factor) - long(y0);
+    for (int y = 0; y < m_h; ++y) {
+        long top = offset + (4 * y - 1) * long(scale_factor);
+        long bottom = offset + (4 * y + 5) * long(scale_factor);
+        if (bottom < 0 || top >= output_rows.rows) {
+            continue;
+        }
+        for (int x = 0; x < m_w; ++x) {
+            fill_cell(output_rows, scale_factor, y, x, img_bgr.at<cv::Vec3b>(y, x), cv::Point(0, offset));
+        }
+    }
+}
+
+void VoronoiCells::fill_cell(cv::Mat& output_image, size_t scale_factor, size_t y, size_t x,
+                             const cv::Vec3b& pixel_color, cv::Point offset) {
+    // Access the cell corresponding to the pixel
+    const auto& cell = m_cells[c_idx(y, x)];
+
+    // Create a vector of points to define the polygon
+    m_polygon.clear();
+    for (int k = 0; k < cell.size(); k++) {
+        auto node_pos = n_pos(cell[k]);
+        m_polygon.emplace_back(
+            node_pos.first * scale_factor, // x-coordinate
+            node_pos.second * scale_factor   // y-coordinate
+        );
+    }
+
+    if (m_stats) {
+        m_stats->polygons_rasterized++;
+    }
+
+    // Fill the polygon with the pixel color
+    const cv::Point* points = m_polygon.data();
+    int count = m_polygon.size();
+    cv::fillPoly(output_image, &points, &count, 1,
+                 cv::Scalar(pixel_color[0], pixel_color[1], pixel_color[2]),
+                 cv::LINE_8, 0, offset);
+}
 
 } // namespace dpxl
@@ -0,0 +1,50 @@
+#include "depixel_lib/color_metric.hpp"
+
+#include <algorithm>
+
+namespace dpxl {
+
+namespace {
+float srgb_to_linear(float c) {
+  c = std::clamp(c, 0.0f, 1.0f);
+  return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float lab_f(float t) {
+  return t > 0.008856f ? std::cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+}
+} // namespace
+
+void LabMetric::to_space(const float *yuv, float *lab) {
+  // Back to RGB, inverting cv::COLOR_BGR2YUV
+  float y = yuv[0];
+  float u = yuv[1] - 0.5f;
+  float v = yuv[2] - 0.5f;
+  float r = srgb_to_linear(y + 1.140f * v);
+  float g = srgb_to_linear(y - 0.395f * u - 0.581f * v);
+  float b = srgb_to_linear(y + 2.032f * u);
+
+  // XYZ relative to the D65 white point
+  float fx = lab_f((0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f);
+  float fy = lab_f(0.2126f * r + 0.7152f * g + 0.0722f * b);
+  float fz = lab_f((0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f);
+
+  lab[0] = 116.0f * fy - 16.0f;
+  lab[1] = 500.0f * (fx - fy);
+  lab[2] = 200.0f * (fy - fz);
+}
+
+bool parse_color_metric(const std::string &name, ColorMetric &metric) {
+  if (name == "yuv") {
+    metric = ColorMetric::Yuv;
+  } else if (name == "lab") {
+    metric = ColorMetric::Lab;
+  } else if (name == "exact") {
+    metric = ColorMetric::Exact;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+} // namespace dpxl
@@ -0,0 +1,43 @@
+#include "depixel_lib/context.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+namespace dpxl {
+
+void PipelineContext::set_budget(TimeBudget *budget) {
+  m_graph.set_budget(budget);
+  m_cells.set_budget(budget);
+}
+
+Graph &PipelineContext::load(const cv::Mat &img_bgr) {
+  utils::image_to_arr(img_bgr, m_img, m_img_yuv);
+  m_graph.reset(m_img);
+  return m_graph;
+}
+
+VoronoiCells &PipelineContext::build_cells() {
+  // The cells of the previous image go before the arena is reused
+  m_cells.clear();
+  m_arena.reset();
+  m_cells.set_memory_resource(&m_arena);
+  m_cells.build_from_graph(m_graph);
+  return m_cells;
+}
+
+const cv::Mat &PipelineContext::render(size_t scale_factor) {
+  m_cells.colorCells(m_output, scale_factor, m_graph.get_image());
+  return m_output;
+}
+
+const cv::Mat &PipelineContext::process(const cv::Mat &img_bgr,
+                                        size_t scale_factor) {
+  Graph &graph = load(img_bgr);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  build_cells();
+  return render(scale_factor);
+}
+
+} // namespace dpxl
@@ -0,0 +1,134 @@
+#include "depixel_lib/debug_writer.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <opencv2/imgcodecs.hpp>
+#include <sstream>
+#include <vector>
+
+namespace dpxl {
+
+DebugWriter::DebugWriter(size_t max_pending)
+    : m_max_pending(std::max<size_t>(max_pending, 1)) {
+  m_worker = std::thread(&DebugWriter::work, this);
+}
+
+DebugWriter::~DebugWriter() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  m_worker.join();
+}
+
+void DebugWriter::write_neighbours(const Graph &graph,
+                                   const std::string &path) {
+  // The image and the mask are all draw_neighbours reads
+  xt::xarray<float> img = graph.get_image();
+  NeighbourMask neighbours = graph.get_neighbours();
+  submit(
+      [img = std::move(img), neighbours = std::move(neighbours)]() mutable {
+        return Graph(img, neighbours).draw_neighbours();
+      },
+      path);
+}
+
+void DebugWriter::write_cells(const VoronoiCells &cells,
+                              const xt::xarray<float> &img,
+                              size_t scale_factor, const std::string &path) {
+  // Only the node indices of the cells are copied here, as CSR offsets and
+  // values, and the edges are rebuilt from them on the writer thread: a copy
+  // of the node sets would cost about as much as building them
+  const CellArray &cell_array = cells.get_cells();
+  std::vector<size_t> offsets(1, 0);
+  offsets.reserve(cell_array.size() + 1);
+  for (const auto &cell : cell_array) {
+    offsets.push_back(offsets.back() + cell.size());
+  }
+  std::vector<size_t> cell_nodes;
+  cell_nodes.reserve(offsets.back());
+  for (const auto &cell : cell_array) {
+    cell_nodes.insert(cell_nodes.end(), cell.begin(), cell.end());
+  }
+  submit(
+      [h = cells.get_height(), w = cells.get_width(),
+       offsets = std::move(offsets), cell_nodes = std::move(cell_nodes), img,
+       scale_factor] {
+        // The cells are closed polygons, their consecutive nodes are joined
+        // as VoronoiCells::connect_cell does. No cells, e.g. when the time
+        // budget expired, draws the pixels only
+        size_t cell_count = offsets.size() - 1;
+        CellArray cells(cell_count);
+        NodeArray nodes(cell_count == 0 ? 0 : (4 * h + 1) * (4 * w + 1));
+        for (size_t c = 0; c < cell_count; ++c) {
+          cells[c].assign(cell_nodes.begin() + offsets[c],
+                          cell_nodes.begin() + offsets[c + 1]);
+          size_t count = cells[c].size();
+          for (size_t k = 0; k < count; ++k) {
+            nodes[cells[c][k]].insert(cells[c][(k + 1) % count]);
+            nodes[cells[c][(k + 1) % count]].insert(cells[c][k]);
+          }
+        }
+        return VoronoiCells(h, w, std::move(cells), std::move(nodes))
+            .draw(scale_factor, img);
+      },
+      path);
+}
+
+void DebugWriter::flush() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_jobs.empty() && !m_busy; });
+}
+
+void DebugWriter::submit(std::function<cv::Mat()> draw,
+                         const std::string &path) {
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_jobs.size() < m_max_pending; });
+    m_jobs.push_back(Job{std::move(draw), path});
+  }
+  m_wake.notify_one();
+}
+
+void DebugWriter::work() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+      if (m_jobs.empty()) {
+        return;
+      }
+      job = std::move(m_jobs.front());
+      m_jobs.pop_front();
+      m_busy = true;
+    }
+    m_done.notify_all();
+
+    bool written;
+    {
+      DPXL_TRACE_ZONE("DebugWriter::write");
+      written = cv::imwrite(job.path, job.draw());
+    }
+    // One write per message, the pipeline may be printing too
+    std::ostringstream message;
+    if (written) {
+      message << "Output image saved to \"" << job.path << "\"\n";
+      std::cout << message.str() << std::flush;
+    } else {
+      message << "Failed to save the output image " << job.path << "\n";
+      std::cerr << message.str();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_busy = false;
+    }
+    m_done.notify_all();
+  }
+}
+
+} // namespace dpxl
@@ -4,6 +4,7 @@
 #include <opencv2/core/types.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 
 #include <xtensor/xadapt.hpp>
 #include <xtensor/xarray.hpp>
@@ -12,98 +13,226 @@
 
 #include <filesystem>
 #include <iostream>
+#include <memory>
 
+#include "depixel_lib/band.hpp"
 #include "depixel_lib/cells.hpp"
+#include "depixel_lib/debug_writer.hpp"
 #include "depixel_lib/depixelize.hpp"
 #include "depixel_lib/graph.hpp"
+#include "depixel_lib/memory.hpp"
+#include "depixel_lib/mesh.hpp"
+#include "depixel_lib/multiscale.hpp"
+#include "depixel_lib/sequence.hpp"
+#include "depixel_lib/serialize.hpp"
+#include "depixel_lib/server.hpp"
+#include "depixel_lib/shading.hpp"
 #include "depixel_lib/spline.hpp"
+#include "depixel_lib/trace.hpp"
+#include "depixel_lib/utils.hpp"
 
 namespace fs = std::filesystem;
 
 namespace dpxl {
 
-void depixelize(const std::string &image_path, bool save_image) {
+namespace {
+bool write_image(const fs::path &path, const cv::Mat &image) {
+  DPXL_TRACE_ZONE("write_image");
+  return cv::imwrite(path.string(), image);
+}
+} // namespace
+
+void depixelize(const std::string &image_path, bool save_image,
+                bool dump_stages, Stats *stats, size_t memory_budget,
+                const ColorMetricConfig &color_metric, size_t shading_scale,
+                TimeBudget *budget) {
   // Processing steps:
   // 1 - Establish similarity graph
   // 2 - Resolve crossings
   // 3 - Create reshaped cells
+  DPXL_TRACE_ZONE("depixelize");
 
   fs::path output_dir = "visualisation";
   fs::create_directories(output_dir); // Ensure the output directory exists
   std::string file_name = fs::absolute(image_path).stem().string();
 
-  Graph graph(image_path);
-  // compute the neighbours
-  graph.compute_neighbours();
-  if (save_image) {
-    cv::Mat neighbours_computed = graph.draw_neighbours();
+  // A .dpxl stage file from a previous run resumes right before rendering
+  StageFile stages;
+  bool resume = fs::path(image_path).extension() == ".dpxl";
+  if (resume && !stages.open(image_path)) {
+    return;
+  }
 
-    fs::path output_path = output_dir / (file_name + "_initial_neighbours.png");
+  // The budget is checked as soon as the size of the image is known
+  cv::Mat img_bgr;
+  if (!resume) {
+    StageTimer timer(stats, &Stats::load);
+    img_bgr = cv::imread(image_path, cv::IMREAD_COLOR);
+    if (img_bgr.empty()) {
+      std::cerr << "Could not read the image: " << image_path << std::endl;
+      return;
+    }
+  }
+  size_t height = resume ? stages.get_height() : img_bgr.rows;
+  size_t width = resume ? stages.get_width() : img_bgr.cols;
 
-    if (cv::imwrite(output_path.string(), neighbours_computed)) {
-      std::cout << "Output image saved to " << output_path << std::endl;
-    } else {
-      std::cerr << "Failed to save the output image." << std::endl;
+  MemoryEstimate estimate = estimate_memory(height, width, 100);
+  if (stats) {
+    stats->estimated_peak_bytes = estimate.peak();
+  }
+  if (memory_budget != 0 && estimate.peak() > memory_budget) {
+    // Bands need the source image, a stage file can not be split
+    size_t band_height =
+        resume ? 0 : band_height_for_budget(height, width, 100, memory_budget);
+    if (band_height == 0) {
+      std::cerr << "The estimated memory of " << format_bytes(estimate.peak())
+                << " for " << image_path << " exceeds the budget of "
+                << format_bytes(memory_budget)
+                << " and can not be processed in bands within it"
+                << std::endl;
+      return;
+    }
+    // A PNG can not be written a few rows at a time
+    std::cout << "The estimated memory of " << format_bytes(estimate.peak())
+              << " exceeds the budget of " << format_bytes(memory_budget)
+              << ", processing in bands of " << band_height
+              << " rows, the output is written as a .ppm" << std::endl;
+    std::string skipped;
+    if (save_image) {
+      skipped += " --save_image";
     }
+    if (dump_stages) {
+      skipped += " --save_stages";
+    }
+    if (shading_scale != 0) {
+      skipped += " --smooth";
+    }
+    if (budget) {
+      skipped += " --deadline";
+    }
+    if (!skipped.empty()) {
+      std::cerr << "Not available when processing in bands, ignored:"
+                << skipped << std::endl;
+    }
+    img_bgr.release();
+    depixelize_bands(image_path, band_height, color_metric, memory_budget,
+                     stats);
+    return;
   }
 
-  // remove trivial edges (from flat shaded area)
-  graph.remove_trivial_edges();
+  Graph graph = [&] {
+    StageTimer timer(stats, &Stats::load);
+    if (resume) {
+      return stages.to_graph();
+    }
+    cv::Mat img_yuv;
+    xt::xarray<float> img;
+    utils::image_to_arr(img_bgr, img, img_yuv);
+    return Graph(img);
+  }();
+  img_bgr.release();
+  graph.set_stats(stats);
+  graph.set_color_metric(color_metric);
+  graph.set_budget(budget);
+
+  // The debug images are drawn and written in the background, from copies
+  // of the stages they show
+  std::unique_ptr<DebugWriter> debug_writer;
   if (save_image) {
-    cv::Mat trivial_edges_removed = graph.draw_neighbours();
+    debug_writer = std::make_unique<DebugWriter>();
+  }
 
-    fs::path output_path =
-        output_dir / (file_name + "_trivial_edges_removed.png");
+  if (!resume) {
+    // compute the neighbours
+    graph.compute_neighbours();
+    if (save_image) {
+      fs::path output_path =
+          output_dir / (file_name + "_initial_neighbours.png");
+      debug_writer->write_neighbours(graph, output_path.string());
+    }
 
-    if (cv::imwrite(output_path.string(), trivial_edges_removed)) {
-      std::cout << "Output image saved to " << output_path << std::endl;
-    } else {
-      std::cerr << "Failed to save the output image." << std::endl;
+    // remove trivial edges (from flat shaded area)
+    graph.remove_trivial_edges();
+    if (save_image) {
+      fs::path output_path =
+          output_dir / (file_name + "_trivial_edges_removed.png");
+      debug_writer->write_neighbours(graph, output_path.string());
+    }
+
+    // resolve non trivial cross edges with heuristics
+    graph.resolve_diagonals();
+    if (save_image) {
+      fs::path output_path =
+          output_dir / (file_name + "_heuristics_applied.png");
+      debug_writer->write_neighbours(graph, output_path.string());
     }
   }
 
-  // resolve non trivial cross edges with heuristics
-  graph.resolve_diagonals();
-  if (save_image) {
-    cv::Mat heuristics_applied = graph.draw_neighbours();
+  // created voronoi_cells
+  VoronoiCells cells;
+  if (resume && stages.has_cells()) {
+    cells = stages.to_cells();
+  }
+  // After the assignment, which replaces them too
+  cells.set_stats(stats);
+  cells.set_budget(budget);
+  if (!resume || !stages.has_cells()) {
+    cells.build_from_graph(graph);
+  }
 
-    fs::path output_path = output_dir / (file_name + "_heuristics_applied.png");
+  if (dump_stages) {
+    fs::path output_path = output_dir / (file_name + ".dpxl");
 
-    if (cv::imwrite(output_path.string(), heuristics_applied)) {
-      std::cout << "Output image saved to " << output_path << std::endl;
+    if (save_stages(output_path.string(), graph, &cells)) {
+      std::cout << "Stages saved to " << output_path << std::endl;
     } else {
-      std::cerr << "Failed to save the output image." << std::endl;
+      std::cerr << "Failed to save the stages." << std::endl;
     }
   }
 
-  // created voronoi_cells
-  VoronoiCells cells;
-  cells.build_from_graph(graph);
-
   if (save_image) {
     //represent the voronoi cells
-    cv::Mat voronoi_cells = cells.draw(100, graph.get_image());
-  
-
     fs::path output_path = output_dir / (file_name + "_voronoi_cells.png");
-
-    if (cv::imwrite(output_path.string(), voronoi_cells)) {
-      std::cout << "Output image saved to " << output_path << std::endl;
-    } else {
-      std::cerr << "Failed to save the output image." << std::endl;
-    }
+    debug_writer->write_cells(cells, graph.get_image(), 100,
+                              output_path.string());
   }
 
   cv::Mat voronoi_cells_colored = cells.colorCells(100, graph.get_image());
 
   fs::path output_path = output_dir / (file_name + "_voronoi_cells_colored.png");
 
-  if (cv::imwrite(output_path.string(), voronoi_cells_colored)) {
+  bool written;
+  {
+    StageTimer timer(stats, &Stats::encode);
+    written = write_image(output_path, voronoi_cells_colored);
+  }
+  if (written) {
     std::cout << "Output image saved to " << output_path << std::endl;
   } else {
     std::cerr << "Failed to save the output image." << std::endl;
   }
 
+  // Short of time, the flat output is all there is
+  if (shading_scale != 0 && budget && budget->running_low()) {
+    budget->degrade(DegradedShading);
+  } else if (shading_scale != 0) {
+    cv::Mat shaded;
+    ShadingOptions options;
+    options.budget = budget;
+    shade_cells(graph, cells.flatten(graph.get_image()), shading_scale, shaded,
+                options, stats);
+    fs::path output_path = output_dir / (file_name + "_voronoi_cells_shaded.png");
+    {
+      StageTimer timer(stats, &Stats::encode);
+      written = write_image(output_path, shaded);
+    }
+    if (written) {
+      std::cout << "Shaded image saved to " << output_path << std::endl;
+    } else {
+      std::cerr << "Failed to save the shaded image." << std::endl;
+    }
+  }
+
     // 4 - Define splines based on reshaped cells
     // 5 - Create new tensor with resolution scaled based on scaling
 
@@ -130,28 +259,275 @@ void depixelize(const std::string &image_path, bool save_image) {
 
 } // namespace dpxl
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
+#include <unistd.h>
+
+namespace {
+// Whole number from 1 to max, strtoul alone would take "-1" as a huge one
+bool parse_positive(const char *value, unsigned long max,
+                    unsigned long &result) {
+  char *end;
+  errno = 0;
+  result = std::strtoul(value, &end, 10);
+  return std::isdigit(static_cast<unsigned char>(*value)) && *end == '\0' &&
+         errno != ERANGE && result > 0 && result <= max;
+}
+} // namespace
 
 int main(int argc, char *argv[]) {
   // Check if enough arguments are provided
   if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <path_to_image> [--save_image]"
+    std::cerr << "Usage: " << argv[0]
+              << " <path_to_image|stages.dpxl> [--save_image] [--save_stages]"
+                 " [--stats <stats.json>] [--trace <trace.json>]"
+                 " [--memory_budget <bytes[K|M|G]>]"
+                 " [--color_metric yuv|lab|exact] [--thresholds <y> <u> <v>]"
+                 " [--smooth <scale>] [--deadline <ms>]"
+              << std::endl
+              << "       " << argv[0]
+              << " --sequence <frame> [<frame> ...]" << std::endl
+              << "       " << argv[0] << " --bands <rows> <path_to_image>"
+              << std::endl
+              << "       " << argv[0]
+              << " --scales <multiple>[,<multiple>...] <path_to_image>"
+              << std::endl
+              << "       " << argv[0] << " --mesh <path_to_image>" << std::endl
+              << "       " << argv[0] << " --serve [<socket_path>]"
               << std::endl;
     return 1;
   }
 
+  // Resident mode, jobs come from a unix socket or from stdin
+  if (std::string(argv[1]) == "--serve") {
+    // A client leaving early must not kill the server
+    std::signal(SIGPIPE, SIG_IGN);
+    dpxl::Server server;
+    if (argc > 2) {
+      return server.listen(argv[2]) ? 0 : 1;
+    }
+    server.serve(STDIN_FILENO, STDOUT_FILENO);
+    return 0;
+  }
+
+  // Animation frames, processed as a sequence
+  if (std::string(argv[1]) == "--sequence") {
+    std::vector<std::string> frame_paths(argv + 2, argv + argc);
+    if (frame_paths.empty()) {
+      std::cerr << "No frames given to --sequence" << std::endl;
+      return 1;
+    }
+    dpxl::depixelize_sequence(frame_paths);
+    return 0;
+  }
+
+  // Very large image, processed a few rows at a time
+  if (std::string(argv[1]) == "--bands") {
+    if (argc < 4 || std::atoi(argv[2]) <= 0) {
+      std::cerr << "Usage: " << argv[0] << " --bands <rows> <path_to_image>"
+                << std::endl;
+      return 1;
+    }
+    dpxl::depixelize_bands(argv[3], std::atoi(argv[2]));
+    return 0;
+  }
+
+  // Several output sizes, as multiples of the image size, from one pass
+  // over the geometry
+  if (std::string(argv[1]) == "--scales") {
+    std::vector<size_t> multiples;
+    bool valid = argc >= 4;
+    if (valid) {
+      std::string list = argv[2];
+      for (size_t start = 0; start <= list.size() && valid;) {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string item = list.substr(start, end - start);
+        // Positive integers only, strtoul would take "-1" as a huge one
+        char *item_end;
+        errno = 0;
+        unsigned long multiple = std::strtoul(item.c_str(), &item_end, 10);
+        valid = !item.empty() &&
+                std::isdigit(static_cast<unsigned char>(item[0])) &&
+                *item_end == '\0' && errno != ERANGE && multiple > 0 &&
+                multiple <= 1024;
+        multiples.push_back(multiple);
+        start = end + 1;
+      }
+    }
+    if (!valid) {
+      std::cerr << "Usage: " << argv[0]
+                << " --scales <multiple>[,<multiple>...] <path_to_image>, "
+                   "e.g. --scales 2,3,4,8, multiples from 1 to 1024"
+                << std::endl;
+      return 1;
+    }
+    dpxl::depixelize_scales(argv[3], multiples);
+    return 0;
+  }
+
+  // Cells as a triangle mesh, for renderers drawing them at any size
+  if (std::string(argv[1]) == "--mesh") {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " --mesh <path_to_image>"
+                << std::endl;
+      return 1;
+    }
+    dpxl::depixelize_mesh(argv[2]);
+    return 0;
+  }
+
   // Get the path to the image
   std::string relative_path = argv[1];
 
-  // Check if the optional '--save_image' argument is provided
+  // Check for the optional '--save_image', '--save_stages', '--stats',
+  // '--trace', '--memory_budget', '--color_metric', '--thresholds',
+  // '--smooth' and '--deadline' arguments
   bool save_image = false;
-  if (argc > 2 && std::string(argv[2]) == "--save_image") {
-    save_image = true;
+  bool save_stages = false;
+  std::string stats_path;
+  size_t shading_scale = 0;
+  long deadline_ms = 0;
+  size_t memory_budget = 0;
+  dpxl::ColorMetricConfig color_metric;
+  bool thresholds_given = false;
+  for (int arg = 2; arg < argc; ++arg) {
+    // Flags followed by values, reported when they are missing
+    std::string flag = argv[arg];
+    int values = flag == "--thresholds" ? 3
+                 : flag == "--stats" || flag == "--trace" ||
+                         flag == "--memory_budget" ||
+                         flag == "--color_metric" || flag == "--smooth" ||
+                         flag == "--deadline"
+                     ? 1
+                     : 0;
+    if (arg + values >= argc) {
+      std::cerr << flag << " expects " << values
+                << (values == 1 ? " value" : " values") << std::endl;
+      return 1;
+    }
+    if (std::string(argv[arg]) == "--save_image") {
+      save_image = true;
+    } else if (std::string(argv[arg]) == "--save_stages") {
+      save_stages = true;
+    } else if (std::string(argv[arg]) == "--stats") {
+      stats_path = argv[++arg];
+    } else if (std::string(argv[arg]) == "--trace") {
+      dpxl::trace::enable(argv[++arg]);
+    } else if (std::string(argv[arg]) == "--memory_budget") {
+      // In bytes, or with a K, M or G suffix
+      const char *value = argv[++arg];
+      char *suffix;
+      errno = 0;
+      unsigned long long bytes = std::strtoull(value, &suffix, 10);
+      int shift = 0;
+      if (*suffix != '\0' && suffix[1] == '\0') {
+        switch (std::toupper(*suffix)) {
+        case 'G':
+          shift = 30;
+          break;
+        case 'M':
+          shift = 20;
+          break;
+        case 'K':
+          shift = 10;
+          break;
+        default:
+          shift = -1;
+        }
+      } else if (*suffix != '\0') {
+        shift = -1;
+      }
+      if (!std::isdigit(static_cast<unsigned char>(*value)) ||
+          suffix == value || errno == ERANGE || shift < 0 || bytes == 0 ||
+          bytes > (std::numeric_limits<size_t>::max() >> shift)) {
+        std::cerr << "Invalid memory budget: " << value
+                  << ", expected a positive number of bytes with an optional "
+                     "K, M or G suffix"
+                  << std::endl;
+        return 1;
+      }
+      memory_budget = size_t(bytes) << shift;
+    } else if (std::string(argv[arg]) == "--color_metric") {
+      if (!dpxl::parse_color_metric(argv[++arg], color_metric.metric)) {
+        std::cerr << "Unknown color metric: " << argv[arg] << std::endl;
+        return 1;
+      }
+    } else if (std::string(argv[arg]) == "--thresholds") {
+      // Of the yuv metric, in 1/255
+      float *thresholds[] = {&color_metric.y_threshold,
+                             &color_metric.u_threshold,
+                             &color_metric.v_threshold};
+      for (float *threshold : thresholds) {
+        char *end;
+        *threshold = std::strtod(argv[++arg], &end) / 255.0;
+        if (end == argv[arg] || *end != '\0') {
+          std::cerr << "Invalid threshold: " << argv[arg] << std::endl;
+          return 1;
+        }
+      }
+      thresholds_given = true;
+    } else if (std::string(argv[arg]) == "--smooth") {
+      // The shaded image has 4 * scale + 1 rows per pixel row
+      unsigned long scale;
+      if (!parse_positive(argv[++arg], 1024, scale)) {
+        std::cerr << "Invalid smoothing scale: " << argv[arg]
+                  << ", expected a whole number from 1 to 1024" << std::endl;
+        return 1;
+      }
+      shading_scale = scale;
+    } else if (std::string(argv[arg]) == "--deadline") {
+      // In milliseconds without a unit, at most a day so that the deadline
+      // stays within the range of the clock
+      unsigned long ms;
+      if (!parse_positive(argv[++arg], 24 * 60 * 60 * 1000ul, ms)) {
+        std::cerr << "Invalid deadline: " << argv[arg]
+                  << ", expected a whole number of milliseconds from 1 to "
+                     "86400000"
+                  << std::endl;
+        return 1;
+      }
+      deadline_ms = ms;
+    }
+  }
+
+  // The lab and exact metrics have no thresholds to set
+  if (thresholds_given && color_metric.metric != dpxl::ColorMetric::Yuv) {
+    std::cerr << "--thresholds only applies to --color_metric yuv"
+              << std::endl;
+    return 1;
   }
 
   // Call depixelize with the specified arguments
-  dpxl::depixelize(relative_path, save_image);
+  dpxl::Stats stats;
+  std::unique_ptr<dpxl::TimeBudget> budget;
+  if (deadline_ms > 0) {
+    budget = std::make_unique<dpxl::TimeBudget>(
+        std::chrono::milliseconds(deadline_ms));
+  }
+  dpxl::depixelize(relative_path, save_image, save_stages,
+                   stats_path.empty() ? nullptr : &stats, memory_budget,
+                   color_metric, shading_scale, budget.get());
+  if (budget && budget->get_degraded() != 0) {
+    std::cout << "Degraded to meet the deadline: "
+              << dpxl::degraded_steps_to_string(budget->get_degraded())
+              << std::endl;
+  }
+  // In a file of its own, the progress lines would break the JSON
+  if (!stats_path.empty()) {
+    std::ofstream stats_file(stats_path);
+    stats_file << stats.to_json() << std::endl;
+    if (!stats_file) {
+      std::cerr << "Failed to write the stats to " << stats_path << std::endl;
+      return 1;
+    }
+  }
 
   return 0;
 }
@@ -1,7 +1,11 @@
 #include "depixel_lib/graph.hpp"
+#include "depixel_lib/trace.hpp"
 #include "depixel_lib/utils.hpp"
 
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <queue>
 #include <xtensor/xadapt.hpp>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xio.hpp>
@@ -15,6 +19,12 @@ namespace dpxl {
         init_graph();
     }
 
+    Graph::Graph(xt::xarray<float>& img, const NeighbourMask& neighbours) {
+        m_img = img;
+        m_neighbours = neighbours;
+        tile_image(cv::Rect(0, 0, get_width(), get_height()));
+    }
+
 
     Graph::Graph(const std::string& image_path) {
         // Load the image from the file path in BGR format (OpenCV default)
@@ -28,13 +38,9 @@ namespace dpxl {
         //std::cout << "Base image \n" << img_bgr << std::endl;
 
 
+        // Adapt OpenCV matrix to xtensor array, in YUV
         cv::Mat img_yuv;
-        cv::cvtColor(img_bgr, img_yuv, cv::COLOR_BGR2YUV);
-
-        //std::cout << "Base image converted to YUV \n" << img_yuv << std::endl;
-
-        // Adapt OpenCV matrix to xtensor array
-        m_img = utils::mat_to_arr(img_yuv);
+        utils::image_to_arr(img_bgr, m_img, img_yuv);
 
         //std::cout << "xtensor array \n" << m_img << std::endl;
 
@@ -42,78 +48,536 @@ namespace dpxl {
     }
 
     void Graph::init_graph() {
-        // Initialize m_neighbours
+        // Initialize m_neighbours, unless it already has the right shape
         std::size_t height = get_height();
         std::size_t width = get_width();
-        m_neighbours = xt::xarray<bool>::from_shape({height, width, 8});
+        if (m_neighbours.dimension() != 3 || m_neighbours.shape()[0] != height || m_neighbours.shape()[1] != width) {
+            m_neighbours = NeighbourMask::from_shape({height, width, 8});
+        }
+        tile_image(cv::Rect(0, 0, width, height));
+    }
+
+    void Graph::tile_image([[maybe_unused]] cv::Rect rect) {
+#ifdef DPXL_TILED_STORAGE
+        if (m_tiled_img.shape()[0] != get_height() || m_tiled_img.shape()[1] != get_width()) {
+            m_tiled_img.resize(get_height(), get_width());
+        }
+        for (int i = rect.y; i < rect.y + rect.height; ++i) {
+            for (int j = rect.x; j < rect.x + rect.width; ++j) {
+                for (std::size_t c = 0; c < 3; ++c) {
+                    m_tiled_img(i, j, c) = m_img(i, j, c);
+                }
+            }
+        }
+#endif
+    }
+
+    void Graph::reset(const xt::xarray<float>& img) {
+        m_img = img;
+        for (auto& row : m_crossings) {
+            row.clear();
+        }
+        m_influence_buckets.clear();
+        m_flat_tiles.clear();
+        m_trivial_edges_removed = false;
+        init_graph();
     }
         
-    std::size_t Graph::get_height() {
+    std::size_t Graph::get_height() const {
         return m_img.shape()[0];
     }
 
-    std::size_t Graph::get_width() {
+    std::size_t Graph::get_width() const {
         return m_img.shape()[1];
     } 
 
 
     void Graph::compute_neighbours() {
+        DPXL_TRACE_ZONE("Graph::compute_neighbours");
+        StageTimer timer(m_stats, &Stats::similarity);
+
+        // Pre-pass over coarse tiles, the flat ones skip most of the work
+        std::size_t tiles_h = get_height() / FLAT_TILE;
+        std::size_t tiles_w = get_width() / FLAT_TILE;
+        m_flat_tiles.assign(tiles_h * tiles_w, false);
+        m_trivial_edges_removed = false;
+        for (std::size_t ti = 0; ti < tiles_h; ++ti) {
+            for (std::size_t tj = 0; tj < tiles_w; ++tj) {
+                detect_flat_tile(ti, tj);
+            }
+        }
+        if (m_stats) {
+            m_stats->flat_tiles += std::count(m_flat_tiles.begin(), m_flat_tiles.end(), true);
+        }
+
+        // The metric is chosen once for the whole pass
+        switch (m_color_metric.metric) {
+        case ColorMetric::Lab:
+            compute_neighbours_with(LabMetric());
+            break;
+        case ColorMetric::Exact:
+            compute_neighbours_with(ExactMetric());
+            break;
+        case ColorMetric::Yuv:
+            if (m_color_metric.has_default_thresholds()) {
+                compute_neighbours_with(YuvMetric<>());
+            } else {
+                compute_neighbours_with(RuntimeYuvMetric{m_color_metric.y_threshold, m_color_metric.u_threshold, m_color_metric.v_threshold});
+            }
+            break;
+        }
+    }
+
+    template <class Metric>
+    void Graph::compute_neighbours_with(const Metric& metric) {
         std::size_t height = get_height();
         std::size_t width = get_width();
+        constexpr std::size_t channels = Metric::channels;
 
-        // Iterate over each pixel
-        for (std::size_t i = 0; i < height; ++i) {
-            for (std::size_t j = 0; j < width; ++j) {
-                // Extract the Y, U, and V values of the pixel
-                auto color_pixel = xt::view(m_img, i, j, xt::all());
-                for (int k = 0; k < 8; ++k) {
-                    // Compute neighbor coordinates
-                    int ni = i + ((k == 1 || k == 2 || k == 3) ? -1 : (k == 5 || k == 6 || k == 7) ? 1 : 0);
-                    int nj = j + ((k == 0 || k == 1 || k == 7) ? 1 : (k == 3 || k == 4 || k == 5) ? -1 : 0);
-                    
-
-                    // Check bounds and compare colors
-                    if (ni >= 0 && ni < height && nj >= 0 && nj < width) {
-                        // Extract the Y, U, and V values of the neighbooring pixel 
-                        auto color_neighboor = xt::view(m_img, ni, nj, xt::all());
-                        m_neighbours(i, j, k) = is_close_color(color_pixel, color_neighboor);
-                    } else {
-                        m_neighbours(i, j, k) = false;
+        if constexpr (Metric::converts) {
+            convert_metric_space<Metric>(cv::Rect(0, 0, width, height));
+        }
+
+        // Pixel (i, j) as the metric compares it
+        auto at = [&](std::size_t i, std::size_t j) -> const float* {
+            if constexpr (Metric::converts) {
+                return m_metric_space.data() + (i * width + j) * channels;
+            } else {
+                return pixel(i, j);
+            }
+        };
+
+        // Each pair is compared once, from the pixel above or on the left:
+        // E (0), SE (7), S (6) and SW (5) give W (4), NW (3), N (2) and NE (1)
+        // of the other pixel. Links out of the image stay false. The 8 links
+        // of a pixel are contiguous in either storage of the mask.
+        // The pairs do not depend on each other: with the tiled storage the
+        // pixels are visited tile by tile, so that the pixels read and the
+        // links written stay within a few tiles, and row by row otherwise
+#ifdef DPXL_TILED_STORAGE
+        const std::size_t tile_h = TiledArray<float, 3>::TILE;
+        const std::size_t tile_w = TiledArray<float, 3>::TILE;
+#else
+        const std::size_t tile_h = 1;
+        const std::size_t tile_w = width;
+#endif
+        m_neighbours.fill(false);
+        m_flat_similar = metric.close(at(0, 0), at(0, 0));
+        for (std::size_t i0 = 0; i0 < height; i0 += tile_h) {
+            for (std::size_t j0 = 0; j0 < width; j0 += tile_w) {
+                for (std::size_t i = i0; i < std::min(i0 + tile_h, height); ++i) {
+                    for (std::size_t j = j0; j < std::min(j0 + tile_w, width); ++j) {
+                        const float* current = at(i, j);
+                        auto* links = pixel_values(m_neighbours, i, j);
+
+                        // Every pair from a pixel inside a flat tile, but on its last
+                        // row or on its first or last column, stays in the tile
+                        if (j % FLAT_TILE != 0 && in_flat_block(i, j)) {
+                            links[0] = links[5] = links[6] = links[7] = m_flat_similar;
+                            m_neighbours(i, j + 1, 4) = m_flat_similar;
+                            m_neighbours(i + 1, j - 1, 1) = m_flat_similar;
+                            m_neighbours(i + 1, j, 2) = m_flat_similar;
+                            m_neighbours(i + 1, j + 1, 3) = m_flat_similar;
+                            continue;
+                        }
+
+                        if (j + 1 < width) {
+                            bool close = metric.close(current, at(i, j + 1));
+                            links[0] = close;
+                            m_neighbours(i, j + 1, 4) = close;
+                        }
+                        if (i + 1 < height) {
+                            bool close = metric.close(current, at(i + 1, j));
+                            links[6] = close;
+                            m_neighbours(i + 1, j, 2) = close;
+                            if (j + 1 < width) {
+                                close = metric.close(current, at(i + 1, j + 1));
+                                links[7] = close;
+                                m_neighbours(i + 1, j + 1, 3) = close;
+                            }
+                            if (j > 0) {
+                                close = metric.close(current, at(i + 1, j - 1));
+                                links[5] = close;
+                                m_neighbours(i + 1, j - 1, 1) = close;
+                            }
+                        }
                     }
                 }
             }
         }
     }
 
-    xt::xarray<bool> Graph::get_neighbours() {
+    template <class Metric>
+    void Graph::convert_metric_space(cv::Rect rect) {
+        static_assert(Metric::channels == 3, "metric_pixel reads 3 channels");
+        std::size_t height = get_height();
+        std::size_t width = get_width();
+        if (m_metric_space.size() != height * width * Metric::channels) {
+            m_metric_space.resize(height * width * Metric::channels);
+            rect = cv::Rect(0, 0, width, height);
+        }
+        for (int i = rect.y; i < rect.y + rect.height; ++i) {
+            for (int j = rect.x; j < rect.x + rect.width; ++j) {
+                Metric::to_space(pixel(i, j), m_metric_space.data() + (i * width + j) * Metric::channels);
+            }
+        }
+    }
+
+    void Graph::compute_pixel_neighbours(std::size_t i, std::size_t j) {
+        std::size_t height = get_height();
+        std::size_t width = get_width();
+
+        for (int k = 0; k < 8; ++k) {
+            // Compute neighbor coordinates
+            int ni = i + ((k == 1 || k == 2 || k == 3) ? -1 : (k == 5 || k == 6 || k == 7) ? 1 : 0);
+            int nj = j + ((k == 0 || k == 1 || k == 7) ? 1 : (k == 3 || k == 4 || k == 5) ? -1 : 0);
+            
+
+            // Check bounds and compare colors
+            if (ni >= 0 && ni < height && nj >= 0 && nj < width) {
+                m_neighbours(i, j, k) = is_close_color(i, j, ni, nj);
+            } else {
+                m_neighbours(i, j, k) = false;
+            }
+        }
+    }
+
+    const NeighbourMask& Graph::get_neighbours() const {
         return m_neighbours;
     }
 
-    xt::xarray<float> Graph::get_image() {
+    const xt::xarray<float>& Graph::get_image() const {
         return m_img;
     }
 
     void Graph::resolve_diagonals(){
+        DPXL_TRACE_ZONE("Graph::resolve_diagonals");
+        StageTimer timer(m_stats, &Stats::heuristics);
         std::size_t height = get_height();
         std::size_t width = get_width();
+        m_crossings.resize(height);
+        for (auto& row : m_crossings) {
+            row.clear();
+        }
+        m_influence_buckets.clear();
         // Iterate over each pixel
         for (std::size_t i = 0; i < height - 1; ++i) {
             for (std::size_t j = 0; j < width - 1; ++j) {
+                // The diagonals of flat blocks went with the trivial edges
+                if (m_trivial_edges_removed && in_flat_block(i, j)) {
+                    continue;
+                }
                 if (m_neighbours(i,j,7) && m_neighbours(i + 1,j,1)){
-                    heuristics(i,j);
+                    // Out of time, the crossings left lose both diagonals
+                    if (m_budget && m_budget->expired()) {
+                        m_budget->degrade(DegradedHeuristics);
+                        apply_decision(i, j, 0);
+                        m_crossings[i].push_back({i, j, true, 0, cv::Rect(j, i, 2, 2)});
+                        continue;
+                    }
+                    int decision = heuristics(i,j);
+                    m_crossings[i].push_back({i, j, true, decision, m_influence});
                 }
             }
         }
     }    
 
+    cv::Rect Graph::update_region(const xt::xarray<float>& img, cv::Rect dirty) {
+        cv::Rect updated;
+        for (const auto& rect : update_region(img, std::vector<cv::Rect>{dirty})) {
+            updated |= rect;
+        }
+        return updated;
+    }
+
+    std::vector<cv::Rect> Graph::update_region(const xt::xarray<float>& img, const std::vector<cv::Rect>& dirty_rects) {
+        // The result must be the same as running the whole pipeline again on img.
+        // Only the similarity bits next to the dirty pixels are recomputed, then the
+        // crossings whose influence (every pixel their heuristics read) meets the
+        // changed pixels are resolved again in scan order, the others keep their
+        // decision. A decision that changes marks its block as changed in turn.
+        DPXL_TRACE_ZONE("Graph::update_region");
+        std::size_t height = get_height();
+        std::size_t width = get_width();
+        cv::Rect bounds(0, 0, width, height);
+
+        // Neighbouring dirty rectangles are processed together, from the
+        // pixels of img inside the given ones only
+        std::vector<cv::Rect> dirty = utils::merge_rects(dirty_rects, bounds, FLAT_TILE);
+        if (dirty.empty()) {
+            return dirty;
+        }
+        for (const auto& given : dirty_rects) {
+            cv::Rect rect = given & bounds;
+            for (int i = rect.y; i < rect.y + rect.height; ++i) {
+                for (int j = rect.x; j < rect.x + rect.width; ++j) {
+                    for (std::size_t c = 0; c < 3; ++c) {
+                        m_img(i, j, c) = img(i, j, c);
+                    }
+                }
+            }
+        }
+
+        for (const auto& rect : dirty) {
+            tile_image(rect);
+            if (m_color_metric.metric == ColorMetric::Lab) {
+                convert_metric_space<LabMetric>(rect);
+            }
+
+            // Edited tiles may no longer be flat, or have become so
+            for (std::size_t ti = rect.y / FLAT_TILE; ti <= (rect.y + rect.height - 1) / FLAT_TILE; ++ti) {
+                for (std::size_t tj = rect.x / FLAT_TILE; tj <= (rect.x + rect.width - 1) / FLAT_TILE; ++tj) {
+                    if (!m_flat_tiles.empty() && ti < height / FLAT_TILE && tj < width / FLAT_TILE) {
+                        detect_flat_tile(ti, tj);
+                    }
+                }
+            }
+        }
+
+        // Similarity of every pixel next to an edited one
+        std::vector<cv::Rect> touched;
+        for (const auto& rect : dirty) {
+            touched.push_back(utils::grow_rect(rect, 1) & bounds);
+            for (int i = touched.back().y; i < touched.back().y + touched.back().height; ++i) {
+                for (int j = touched.back().x; j < touched.back().x + touched.back().width; ++j) {
+                    compute_pixel_neighbours(i, j);
+                }
+            }
+        }
+
+        // Both diagonals of the 2x2 blocks holding a touched pixel go back to
+        // their raw similarity before the trivial edges are removed again
+        std::vector<cv::Rect> blocks;
+        for (const auto& rect : touched) {
+            blocks.push_back(cv::Rect(rect.x - 1, rect.y - 1, rect.width + 1, rect.height + 1) &
+                             cv::Rect(0, 0, width - 1, height - 1));
+            for (int i = blocks.back().y; i < blocks.back().y + blocks.back().height; ++i) {
+                for (int j = blocks.back().x; j < blocks.back().x + blocks.back().width; ++j) {
+                    bool diagonal_1 = is_close_color(i, j, i + 1, j + 1);
+                    bool diagonal_2 = is_close_color(i + 1, j, i, j + 1);
+                    if (diagonal_1 && diagonal_2 && m_neighbours(i, j, 6)) {
+                        diagonal_1 = false;
+                        diagonal_2 = false;
+                    }
+                    m_neighbours(i, j, 7) = diagonal_1;
+                    m_neighbours(i + 1, j + 1, 3) = diagonal_1;
+                    m_neighbours(i + 1, j, 1) = diagonal_2;
+                    m_neighbours(i, j + 1, 5) = diagonal_2;
+                }
+            }
+        }
+
+        // Crossings are looked up by the pixels their influence covers
+        std::size_t buckets_w = (width + INFLUENCE_BUCKET - 1) / INFLUENCE_BUCKET;
+        if (m_influence_buckets.empty()) {
+            m_influence_buckets.resize((height + INFLUENCE_BUCKET - 1) / INFLUENCE_BUCKET * buckets_w);
+            for (const auto& row : m_crossings) {
+                for (const auto& crossing : row) {
+                    index_influence(crossing, true);
+                }
+            }
+        }
+        auto find_crossing = [this, width](std::size_t key) -> Crossing* {
+            auto [first, last] = crossings_of_row(key / width, key % width, key % width + 1);
+            return first != last ? &*first : nullptr;
+        };
+
+        // Worklist of the crossings to decide again, in scan order. The
+        // position of the next one never goes back, so that every crossing
+        // is decided after the earlier ones it reads
+        std::priority_queue<std::size_t, std::vector<std::size_t>, std::greater<std::size_t>> worklist;
+        // Push the crossings from position from on whose influence meets rect
+        auto push_influenced = [&](cv::Rect rect, std::size_t from) {
+            for (int bi = rect.y / INFLUENCE_BUCKET; bi <= (rect.y + rect.height - 1) / int(INFLUENCE_BUCKET); ++bi) {
+                for (int bj = rect.x / INFLUENCE_BUCKET; bj <= (rect.x + rect.width - 1) / int(INFLUENCE_BUCKET); ++bj) {
+                    for (std::size_t key : m_influence_buckets[bi * buckets_w + bj]) {
+                        if (key >= from && (find_crossing(key)->influence & rect).area() > 0) {
+                            worklist.push(key);
+                        }
+                    }
+                }
+            }
+        };
+
+        // Crossings inside the blocks are detected again and have no decision
+        // yet: only the rows of the blocks are spliced
+        std::vector<Crossing> found;
+        for (const auto& rect : blocks) {
+            for (int i = rect.y; i < rect.y + rect.height; ++i) {
+                found.clear();
+                for (int j = rect.x; j < rect.x + rect.width; ++j) {
+                    if (m_neighbours(i, j, 7) && m_neighbours(i + 1, j, 1)) {
+                        found.push_back({std::size_t(i), std::size_t(j), false, 0, cv::Rect()});
+                        worklist.push(i * width + j);
+                    }
+                }
+                auto [first, last] = crossings_of_row(i, rect.x, rect.x + rect.width);
+                for (auto it = first; it != last; ++it) {
+                    index_influence(*it, false);
+                }
+                auto& row = m_crossings[i];
+                row.insert(row.erase(first, last), found.begin(), found.end());
+            }
+        }
+
+        std::vector<cv::Rect> changed;
+        for (const auto& rect : touched) {
+            changed.push_back(utils::grow_rect(rect, 1) & bounds);
+            push_influenced(changed.back(), 0);
+        }
+
+        // A crossing is decided again with the earlier ones decided and the
+        // later ones unresolved, as in resolve_diagonals. Only the later ones
+        // met by the pixels read are set back to both diagonals: when the
+        // heuristics read past them, the ones met there are too and the
+        // crossing is decided once more
+        auto set_both_diagonals = [this](std::size_t i, std::size_t j) {
+            m_neighbours(i, j, 7) = true;
+            m_neighbours(i + 1, j + 1, 3) = true;
+            m_neighbours(i + 1, j, 1) = true;
+            m_neighbours(i, j + 1, 5) = true;
+        };
+        std::vector<Crossing*> unresolved;
+        auto set_unresolved = [&](cv::Rect rect, std::size_t after) {
+            for (int i = std::max(rect.y - 1, 0); i < std::min(rect.y + rect.height, int(height) - 1); ++i) {
+                auto [first, last] = crossings_of_row(i, rect.x - 1, rect.x + rect.width);
+                for (auto it = first; it != last; ++it) {
+                    if (it->i * width + it->j > after) {
+                        set_both_diagonals(it->i, it->j);
+                        unresolved.push_back(&*it);
+                    }
+                }
+            }
+        };
+        std::size_t previous = std::size_t(-1);
+        while (!worklist.empty()) {
+            std::size_t key = worklist.top();
+            worklist.pop();
+            if (key == previous) {
+                continue;
+            }
+            previous = key;
+            Crossing& crossing = *find_crossing(key);
+            std::size_t i = crossing.i;
+            std::size_t j = crossing.j;
+
+            cv::Rect read = crossing.resolved ? crossing.influence : cv::Rect(j, i, 2, 2);
+            unresolved.clear();
+            set_unresolved(read, key);
+            int decision;
+            while (true) {
+                set_both_diagonals(i, j);
+                decision = heuristics(i, j);
+                if ((m_influence & read) == m_influence) {
+                    break;
+                }
+                set_unresolved(m_influence, key);
+                read |= m_influence;
+            }
+            for (const Crossing* later : unresolved) {
+                if (later->resolved) {
+                    apply_decision(later->i, later->j, later->decision);
+                }
+            }
+
+            if (!crossing.resolved || decision != crossing.decision) {
+                changed.push_back(cv::Rect(j, i, 2, 2));
+                push_influenced(changed.back(), key + 1);
+            }
+            index_influence(crossing, false);
+            crossing.resolved = true;
+            crossing.decision = decision;
+            crossing.influence = m_influence;
+            index_influence(crossing, true);
+        }
+
+        // One rectangle per block decided otherwise, merged with its neighbours
+        return utils::merge_rects(changed, bounds, FLAT_TILE);
+    }
+
+    std::pair<std::vector<Graph::Crossing>::iterator, std::vector<Graph::Crossing>::iterator>
+    Graph::crossings_of_row(std::size_t i, int first_col, int last_col) {
+        auto& row = m_crossings[i];
+        auto before = [](const Crossing& crossing, int col) { return int(crossing.j) < col; };
+        auto first = std::lower_bound(row.begin(), row.end(), first_col, before);
+        return {first, std::lower_bound(first, row.end(), last_col, before)};
+    }
+
+    void Graph::index_influence(const Crossing& crossing, bool add) {
+        // Crossings without a decision have read nothing yet
+        const cv::Rect& influence = crossing.influence;
+        if (m_influence_buckets.empty() || influence.empty()) {
+            return;
+        }
+        std::size_t key = crossing.i * get_width() + crossing.j;
+        std::size_t buckets_w = (get_width() + INFLUENCE_BUCKET - 1) / INFLUENCE_BUCKET;
+        for (int bi = influence.y / INFLUENCE_BUCKET; bi <= (influence.y + influence.height - 1) / int(INFLUENCE_BUCKET); ++bi) {
+            for (int bj = influence.x / INFLUENCE_BUCKET; bj <= (influence.x + influence.width - 1) / int(INFLUENCE_BUCKET); ++bj) {
+                auto& bucket = m_influence_buckets[bi * buckets_w + bj];
+                if (add) {
+                    bucket.push_back(key);
+                } else {
+                    bucket.erase(std::find(bucket.begin(), bucket.end(), key));
+                }
+            }
+        }
+    }
+
+    bool Graph::is_exact_band(std::size_t first_row, std::size_t last_row, bool cut_above, bool cut_below) const {
+        // The similarity of a row next to a cut misses the pixels beyond it, so
+        // is every decision that read such a row, or the outcome of a crossing
+        // that is not exact itself (see update_region for the influence)
+        std::size_t height = get_height();
+        std::size_t width = get_width();
+        int safe_first = cut_above ? 1 : 0;
+        int safe_last = cut_below ? int(height) - 1 : int(height);
+        if (int(first_row) < safe_first || int(last_row) > safe_last) {
+            return false;
+        }
+
+        std::vector<bool> inexact(height * width, false);
+        for (const auto& row : m_crossings) {
+            for (const auto& crossing : row) {
+                const auto& influence = crossing.influence;
+                bool exact = influence.y >= safe_first && influence.y + influence.height <= safe_last;
+                for (int i = influence.y; exact && i < influence.y + influence.height; ++i) {
+                    for (int j = influence.x; j < influence.x + influence.width; ++j) {
+                        if (inexact[i * width + j]) {
+                            exact = false;
+                            break;
+                        }
+                    }
+                }
+                if (exact) {
+                    continue;
+                }
+
+                // The decision sets the neighbours of the pixels of its block
+                if (crossing.i + 1 >= first_row && crossing.i < last_row) {
+                    return false;
+                }
+                for (std::size_t i = crossing.i; i < crossing.i + 2; ++i) {
+                    for (std::size_t j = crossing.j; j < crossing.j + 2; ++j) {
+                        inexact[i * width + j] = true;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
     void Graph::remove_trivial_edges() {
         // this function removes the diagonal edges when all 4 corners of a square are the same colors (flat shaded region)
+        DPXL_TRACE_ZONE("Graph::remove_trivial_edges");
+        StageTimer timer(m_stats, &Stats::trivial_edges);
         std::size_t height = get_height();
         std::size_t width = get_width();
         // Iterate over each pixel
         for (std::size_t i = 0; i < height - 1; ++i) {
             for (std::size_t j = 0; j < width - 1; ++j) {
-                if (m_neighbours(i,j,7) && m_neighbours(i + 1,j,1) && m_neighbours(i,j,6)) {
+                // A flat block is fully linked when flat pixels are similar
+                if (in_flat_block(i, j) ? m_flat_similar :
+                    m_neighbours(i,j,7) && m_neighbours(i + 1,j,1) && m_neighbours(i,j,6)) {
                     m_neighbours(i,j,7) = false;
                     m_neighbours(i + 1,j,1) = false;
                     m_neighbours(i,j + 1, 5) = false;
@@ -121,25 +585,60 @@ namespace dpxl {
                 }
             }
         }
+        m_trivial_edges_removed = true;
+    }
+
+    void Graph::detect_flat_tile(std::size_t ti, std::size_t tj) {
+        const float* first = &m_img(ti * FLAT_TILE, tj * FLAT_TILE, 0);
+        bool flat = true;
+        for (std::size_t i = ti * FLAT_TILE; flat && i < (ti + 1) * FLAT_TILE; ++i) {
+            const float* row = &m_img(i, tj * FLAT_TILE, 0);
+            for (std::size_t k = 0; k < 3 * FLAT_TILE; ++k) {
+                if (row[k] != first[k % 3]) {
+                    flat = false;
+                    break;
+                }
+            }
+        }
+        m_flat_tiles[ti * (get_width() / FLAT_TILE) + tj] = flat;
     }
 
+    bool Graph::in_flat_block(std::size_t i, std::size_t j) const {
+        std::size_t ti = i / FLAT_TILE;
+        std::size_t tj = j / FLAT_TILE;
+        std::size_t tiles_w = get_width() / FLAT_TILE;
+        return i % FLAT_TILE != FLAT_TILE - 1 && j % FLAT_TILE != FLAT_TILE - 1 &&
+               !m_flat_tiles.empty() && ti < get_height() / FLAT_TILE && tj < tiles_w &&
+               m_flat_tiles[ti * tiles_w + tj];
+    }
+
+    bool Graph::is_flat_tile(std::size_t ti, std::size_t tj) const {
+        std::size_t tiles_w = get_width() / FLAT_TILE;
+        return m_trivial_edges_removed && m_flat_similar && !m_flat_tiles.empty() &&
+               ti < get_height() / FLAT_TILE && tj < tiles_w && m_flat_tiles[ti * tiles_w + tj];
+    }
 
-    bool Graph::is_close_color(const xt::xarray<float>& color_pixel, const xt::xarray<float>& color_neighboor) {
-        // Compare Y, U, and V differences
-        float delta_Y = std::abs(color_pixel(0) - color_neighboor(0)); // Y channel
-        float delta_U = std::abs(color_pixel(1) - color_neighboor(1)); // U channel
-        float delta_V = std::abs(color_pixel(2) - color_neighboor(2)); // V channel
 
-        // Check if the differences are within the thresholds
-        return (delta_Y <= Y_THRESHOLD && delta_U <= U_THRESHOLD && delta_V <= V_THRESHOLD);
+    bool Graph::is_close_color(std::size_t i1, std::size_t j1, std::size_t i2, std::size_t j2) const {
+        // Pixels compared one at a time, outside of compute_neighbours. A
+        // converting metric reads the pixels compute_neighbours converted
+        switch (m_color_metric.metric) {
+        case ColorMetric::Lab:
+            return LabMetric().close(metric_pixel(i1, j1), metric_pixel(i2, j2));
+        case ColorMetric::Exact:
+            return ExactMetric().close(pixel(i1, j1), pixel(i2, j2));
+        case ColorMetric::Yuv:
+            break;
+        }
+        return RuntimeYuvMetric{m_color_metric.y_threshold, m_color_metric.u_threshold, m_color_metric.v_threshold}.close(pixel(i1, j1), pixel(i2, j2));
     }
 
 
     cv::Mat Graph::draw_neighbours() {
         // Create a copy of the base image to draw on
-        cv::Mat img_yuv = utils::arr_to_mat(m_img);
+        cv::Mat img_yuv;
         cv::Mat img_bgr;
-        cv::cvtColor(img_yuv, img_bgr, cv::COLOR_YUV2BGR);
+        utils::arr_to_bgr(m_img, img_bgr, img_yuv);
 
         
 
@@ -157,66 +656,28 @@ namespace dpxl {
 
         //cv::imwrite("visualisation/output_base_image.png", output_image);
 
-        // Iterate through each pixel
+        // Each link is drawn once, from the pixel it leaves towards E, SW, S
+        // or SE; the other pixel holds the same link towards W, NE, N or NW
         int rows = m_neighbours.shape()[0];
         int cols = m_neighbours.shape()[1];
+        static constexpr int forward[4] = {0, 5, 6, 7};
+        static constexpr int offsets[8][2] = {
+            {1, 0}, {1, -1}, {0, -1}, {-1, -1}, {-1, 0}, {-1, 1}, {0, 1}, {1, 1}
+        }; // (dx, dy) of each direction
 
         for (int y = 0; y < rows; ++y) {
             for (int x = 0; x < cols; ++x) {
-                // Get the 7 neighbors for the current pixel
-                std::vector<bool> n = {
-                    m_neighbours(y, x, 0),
-                    m_neighbours(y, x, 1),
-                    m_neighbours(y, x, 2),
-                    m_neighbours(y, x, 3),
-                    m_neighbours(y, x, 4),
-                    m_neighbours(y, x, 5),
-                    m_neighbours(y, x, 6)
-                };
-
-                // Define pixel coordinates for neighbors (scaled)
-                std::vector<cv::Point> neighbor_coords = {
-                    cv::Point((x + 1) * scale_factor, y * scale_factor),      // 0
-                    cv::Point((x + 1) * scale_factor, (y - 1) * scale_factor), // 1
-                    cv::Point(x * scale_factor, (y - 1) * scale_factor),       // 2
-                    cv::Point((x - 1) * scale_factor, (y - 1) * scale_factor), // 3
-                    cv::Point((x - 1) * scale_factor, y * scale_factor),       // 4
-                    cv::Point((x - 1) * scale_factor, (y + 1) * scale_factor), // 5
-                    cv::Point(x * scale_factor, (y + 1) * scale_factor)        // 6
-                };
-
-                // Current pixel center (scaled)
-                cv::Point current_pixel(x * scale_factor, y * scale_factor);
-
-                // Draw lines for active neighbors
-                for (std::size_t i = 0; i < n.size(); ++i) {
-                    if (n[i]) {
-                        cv::Point neighbor_pixel = neighbor_coords[i];
-
-                        // Current pixel center (scaled and shifted to the center of the pixel)
-                        cv::Point current_pixel(x * scale_factor + scale_factor / 2, y * scale_factor + scale_factor / 2);
-
-                        // Draw lines for active neighbors
-                        for (std::size_t i = 0; i < n.size(); ++i) {
-                            if (n[i]) {
-                                // Neighbor pixel center (scaled and shifted)
-                                cv::Point neighbor_pixel(
-                                    neighbor_coords[i].x + scale_factor / 2,
-                                    neighbor_coords[i].y + scale_factor / 2
-                                );
-
-                                // Check bounds before drawing
-                                if (neighbor_pixel.x >= 0 && neighbor_pixel.x < output_image.cols &&
-                                    neighbor_pixel.y >= 0 && neighbor_pixel.y < output_image.rows) {
-                                    cv::line(output_image, current_pixel, neighbor_pixel, cv::Scalar(0, 0, 255), 2);
-                                }
-                            }
-                        }
+                // Pixel center (scaled and shifted to the center of the pixel)
+                cv::Point current_pixel(x * scale_factor + scale_factor / 2, y * scale_factor + scale_factor / 2);
+                for (int k : forward) {
+                    int nx = x + offsets[k][0];
+                    int ny = y + offsets[k][1];
+                    if (m_neighbours(y, x, k) && nx >= 0 && nx < cols && ny < rows) {
+                        cv::Point neighbor_pixel(nx * scale_factor + scale_factor / 2, ny * scale_factor + scale_factor / 2);
+                        cv::line(output_image, current_pixel, neighbor_pixel, cv::Scalar(0, 0, 255), 2);
                     }
                 }
             }
-            //std::string file_path = "visualisation/output_image_" + std::to_string(y) + ".png";
-            //cv::imwrite(file_path, output_image);
         }
 
         // Optionally downscale the final image
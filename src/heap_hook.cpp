@@ -0,0 +1,111 @@
+// Replaces the global operator new and delete to report the allocations to
+// dpxl::record_heap_alloc / record_heap_free, for the heap peaks of Stats.
+// Linked by the executables that want them, never by depixel_lib. The size of
+// each block is kept just before it, so it works with any malloc.
+#include "depixel_lib/stats.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace {
+// Room for the size in front of the blocks of the default alignment
+constexpr std::size_t HEADER = alignof(std::max_align_t);
+
+void *allocate(std::size_t size, std::size_t alignment) {
+  std::size_t header = std::max(alignment, HEADER);
+  void *base =
+      alignment <= HEADER
+          ? std::malloc(header + size)
+          : std::aligned_alloc(alignment,
+                               (header + size + alignment - 1) / alignment *
+                                   alignment);
+  if (base == nullptr) {
+    return nullptr;
+  }
+  char *ptr = static_cast<char *>(base) + header;
+  reinterpret_cast<std::size_t *>(ptr)[-1] = size;
+  dpxl::record_heap_alloc(size);
+  return ptr;
+}
+
+void deallocate(void *ptr, std::size_t alignment) {
+  if (ptr == nullptr) {
+    return;
+  }
+  dpxl::record_heap_free(reinterpret_cast<std::size_t *>(ptr)[-1]);
+  std::free(static_cast<char *>(ptr) - std::max(alignment, HEADER));
+}
+
+void *allocate_or_throw(std::size_t size, std::size_t alignment) {
+  void *ptr = allocate(size, alignment);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+std::size_t align(std::align_val_t alignment) {
+  return static_cast<std::size_t>(alignment);
+}
+} // namespace
+
+void *operator new(std::size_t size) { return allocate_or_throw(size, 0); }
+void *operator new[](std::size_t size) { return allocate_or_throw(size, 0); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, 0);
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, 0);
+}
+
+void operator delete(void *ptr) noexcept { deallocate(ptr, 0); }
+void operator delete[](void *ptr) noexcept { deallocate(ptr, 0); }
+void operator delete(void *ptr, std::size_t) noexcept { deallocate(ptr, 0); }
+void operator delete[](void *ptr, std::size_t) noexcept { deallocate(ptr, 0); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr, 0);
+}
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr, 0);
+}
+
+// The aligned forms too, std::pmr containers allocate through them
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, align(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, align(alignment));
+}
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocate(size, align(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocate(size, align(alignment));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept {
+  deallocate(ptr, align(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment) noexcept {
+  deallocate(ptr, align(alignment));
+}
+void operator delete(void *ptr, std::size_t,
+                     std::align_val_t alignment) noexcept {
+  deallocate(ptr, align(alignment));
+}
+void operator delete[](void *ptr, std::size_t,
+                       std::align_val_t alignment) noexcept {
+  deallocate(ptr, align(alignment));
+}
+void operator delete(void *ptr, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  deallocate(ptr, align(alignment));
+}
+void operator delete[](void *ptr, std::align_val_t alignment,
+                       const std::nothrow_t &) noexcept {
+  deallocate(ptr, align(alignment));
+}
@@ -1,39 +1,160 @@
 #include "depixel_lib/graph.hpp"
+#include "depixel_lib/trace.hpp"
 #include <xtensor/xview.hpp>
 
+
 //This file implements the functions of Graph.hpp related to heuristic resolution of crossing diagonals
 
 namespace dpxl {
-    void Graph::heuristics(std::size_t i, std::size_t j) {
+    int Graph::heuristics(std::size_t i, std::size_t j) {
+        // Returns the decision: 1 keeps diagonal 1, -1 keeps diagonal 2, 0 none
+        DPXL_TRACE_ZONE("Graph::heuristics");
+        m_influence = cv::Rect(j, i, 2, 2);
+
         //Define weight for each of the heuristics
         int curve_weight = 0;
         int sparse_pixel_weight = 0;
         int island_weight = 0;
 
-        //Heuristic 1 : curve lengths from each of the 2 diagonals:   
-        std::size_t curve_length_1 = std::max(compute_curve_length(i, j), compute_curve_length(i+1,j+1)); // Diagonal 1 (Top-left to Bottom-right)
-        std::size_t curve_length_2 = std::max(compute_curve_length(i, j+1), compute_curve_length(i+1,j)); // Diagonal 2 (Top-right to Bottom-left)
+        // The memo only holds decisions taken with the curve heuristic
+        bool running_low = m_budget && m_budget->running_low();
+        bool memoize = m_memo_enabled && !running_low;
+        CrossingKey key;
+        cv::Rect window;
+        auto memo = m_memo.end();
+        if (memoize) {
+            key = crossing_key(i, j, sparse_pixel_weight, window);
+            memo = m_memo.find(key);
+            if (m_stats) {
+                if (memo != m_memo.end()) m_stats->memo_hits++;
+                else m_stats->memo_misses++;
+            }
+        }
+
+        if (memo != m_memo.end()) {
+            const CrossingVotes& votes = memo->second;
+            curve_weight = votes.curve;
+            island_weight = votes.island;
+            m_influence = cv::Rect(votes.influence.x + j, votes.influence.y + i, votes.influence.width, votes.influence.height);
+        } else {
+            //Heuristic 1 : curve lengths from each of the 2 diagonals, the most
+            //expensive one, skipped when the time budget runs low
+            if (running_low) {
+                m_budget->degrade(DegradedCurves);
+            } else {
+                std::size_t curve_length_1 = std::max(compute_curve_length(i, j), compute_curve_length(i+1,j+1)); // Diagonal 1 (Top-left to Bottom-right)
+                std::size_t curve_length_2 = std::max(compute_curve_length(i, j+1), compute_curve_length(i+1,j)); // Diagonal 2 (Top-right to Bottom-left)
 
-        //Positive votes for 1, negative for 2
-        curve_weight = static_cast<int>(curve_length_1) - static_cast<int>(curve_length_2);
+                //Positive votes for 1, negative for 2
+                curve_weight = static_cast<int>(curve_length_1) - static_cast<int>(curve_length_2);
+            }
 
-        // Heuristic 2 : Sparse Pixels Heuristic
-        // Measure the size difference of connected components in an 8x8 window between diagonal 1 and diagonal 2
-        sparse_pixel_weight = compute_component_size_difference(i, j);       
+            // Heuristic 2 : Sparse Pixels Heuristic
+            // Measure the size difference of connected components in an 8x8 window between diagonal 1 and diagonal 2,
+            // already counted by crossing_key when memoizing
+            if (!memoize) sparse_pixel_weight = compute_component_size_difference(i, j);
 
-        // Heuristic 3 : We treat the case of Islands
-        if (node_valence(i,j) == 1 || node_valence(i+1, j+1) == 1) island_weight += 5;
-        else if (node_valence(i+1,j) == 1 || node_valence(i, j+1) == 1) island_weight -= 5;
+            // Heuristic 3 : We treat the case of Islands
+            if (node_valence(i,j) == 1 || node_valence(i+1, j+1) == 1) island_weight += 5;
+            else if (node_valence(i+1,j) == 1 || node_valence(i, j+1) == 1) island_weight -= 5;
+
+            // Curves leaving the window depend on pixels the key does not hold
+            if (memoize && (m_influence & window) == m_influence) {
+                if (m_memo.size() >= MEMO_CAPACITY) m_memo.clear();
+                cv::Rect influence(m_influence.x - j, m_influence.y - i, m_influence.width, m_influence.height);
+                m_memo.emplace(key, CrossingVotes{curve_weight, sparse_pixel_weight, island_weight, influence});
+            }
+        }
 
         //Compute total weight
         int total_weight = curve_weight + sparse_pixel_weight + island_weight;
 
-        if (total_weight > 0) {
+        int decision = (total_weight > 0) - (total_weight < 0);
+        if (m_stats) {
+            m_stats->crossings++;
+            int curve_vote = curve_weight * decision;
+            int sparse_pixel_vote = sparse_pixel_weight * decision;
+            int island_vote = island_weight * decision;
+            if (decision == 0) m_stats->ties++;
+            else if (curve_vote >= sparse_pixel_vote && curve_vote >= island_vote) m_stats->decided_by_curves++;
+            else if (sparse_pixel_vote >= island_vote) m_stats->decided_by_sparse_pixels++;
+            else m_stats->decided_by_islands++;
+        }
+        apply_decision(i, j, decision);
+        return decision;
+    }
+
+    Graph::CrossingKey Graph::crossing_key(std::size_t i, std::size_t j, int& sparse_pixel_weight, cv::Rect& window) {
+        DPXL_TRACE_ZONE("Graph::crossing_key");
+        std::size_t height = get_height();
+        std::size_t width = get_width();
+        CrossingKey key;
+
+        // Window of MEMO_WINDOW pixels around the block, cut by the image
+        long top = static_cast<long>(i) - 3;
+        long left = static_cast<long>(j) - 3;
+        std::size_t start_row = std::max(top, 0l);
+        std::size_t end_row = std::min(i + 5, height);
+        std::size_t start_col = std::max(left, 0l);
+        std::size_t end_col = std::min(j + 5, width);
+        window = cv::Rect(start_col, start_row, end_col - start_col, end_row - start_row);
+        key.words[10] = (i - start_row) | (j - start_col) << 8 | (end_row - i) << 16 | (end_col - j) << 24;
+
+        // Links of the pixels, one byte each
+        for (std::size_t k = start_row; k < end_row; ++k) {
+            for (std::size_t l = start_col; l < end_col; ++l) {
+                std::size_t p = (k - top) * MEMO_WINDOW + (l - left);
+                uint64_t links = 0;
+                for (std::size_t d = 0; d < 8; ++d) {
+                    links |= static_cast<uint64_t>(m_neighbours(k, l, d)) << d;
+                }
+                key.words[p / 8] |= links << (8 * (p % 8));
+            }
+        }
+
+        // Colour classes in the window of compute_component_size_difference,
+        // which votes with them: 1 close to the colour of diagonal 1, 2 to the
+        // one of diagonal 2, 0 neither
+        sparse_pixel_weight = 0;
+        std::size_t sparse_end_row = std::min(i + 4, height);
+        std::size_t sparse_end_col = std::min(j + 4, width);
+        m_influence |= cv::Rect(start_col, start_row, sparse_end_col - start_col, sparse_end_row - start_row);
+        for (std::size_t k = start_row; k < sparse_end_row; ++k) {
+            for (std::size_t l = start_col; l < sparse_end_col; ++l) {
+                std::size_t p = (k - top) * MEMO_WINDOW + (l - left);
+                uint64_t colour_class = 0;
+                if (is_close_color(k, l, i, j)) {
+                    colour_class = 1;
+                    sparse_pixel_weight--;
+                } else if (is_close_color(k, l, i + 1, j)) {
+                    colour_class = 2;
+                    sparse_pixel_weight++;
+                }
+                key.words[8 + p / 32] |= colour_class << (2 * (p % 32));
+            }
+        }
+        return key;
+    }
+
+    std::size_t Graph::CrossingKeyHash::operator()(const CrossingKey& key) const {
+        uint64_t hash = 0;
+        for (uint64_t word : key.words) {
+            // splitmix64 finalizer on the running hash
+            hash ^= word + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+            hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+            hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+            hash ^= hash >> 31;
+        }
+        return hash;
+    }
+
+    void Graph::apply_decision(std::size_t i, std::size_t j, int decision) {
+        if (decision > 0) {
             // Keep Diagonal 1 (Top-left to Bottom-right)
             m_neighbours(i + 1, j, 1) = false;
             m_neighbours(i, j + 1, 5) = false;
         }
-        else if (total_weight < 0) {
+        else if (decision < 0) {
             // Keep Diagonal 2 (Top-right to Bottom-left)
             m_neighbours(i, j, 7) = false;
             m_neighbours(i + 1, j + 1, 3) = false;
@@ -45,7 +166,6 @@ namespace dpxl {
             m_neighbours(i + 1, j, 1) = false;
             m_neighbours(i, j + 1, 5) = false;
         }
-
     }
 
     std::size_t Graph::node_valence(std::size_t i, std::size_t j){
@@ -59,8 +179,7 @@ namespace dpxl {
 
     int Graph::compute_component_size_difference(std::size_t i, std::size_t j){
         //Computes the difference of the component attached to 1 compared to the one attached to 2.
-        xt::xarray<float> color_1 = xt::view(m_img, i, j, xt::all());
-        xt::xarray<float> color_2 = xt::view(m_img, i + 1, j, xt::all());
+        DPXL_TRACE_ZONE("Graph::compute_component_size_difference");
         std::size_t height = get_height();
         std::size_t width = get_width();
         int sum = 0;
@@ -70,15 +189,14 @@ namespace dpxl {
         std::size_t end_row = std::min(i + 4, height);
         std::size_t start_col = (j > 3) ? j - 3 : 0;
         std::size_t end_col = std::min(j + 4, width);
+        m_influence |= cv::Rect(start_col, start_row, end_col - start_col, end_row - start_row);
 
         for (std::size_t k = start_row; k < end_row; ++k) {
             for (std::size_t l = start_col; l < end_col; ++l) {
-                xt::xarray<float> current_color = xt::view(m_img, k, l, xt::all());
-
                 // Compare colors to calculate the sum
-                if (is_close_color(current_color, color_1)) {
+                if (is_close_color(k, l, i, j)) {
                     sum--; //Voting in favor of color_2, because color_1 present
-                } else if (is_close_color(current_color, color_2)) {
+                } else if (is_close_color(k, l, i + 1, j)) {
                     sum++; //the opposite
                 }
             }
@@ -86,21 +204,9 @@ namespace dpxl {
         return sum;
     }
 
-    std::vector<std::size_t> Graph::get_neighbours_list(std::size_t i, std::size_t j) {
-        // Computes the neighbours list of the node of coordinate (i,j)
-        auto neighbour_subarray = xt::view(m_neighbours, i,j, xt::all());
-        std::vector<std::size_t> neighbour_list;
-        // Iterate over the subarray to find the indices of true values
-        for (std::size_t k = 0; k < 8; ++k) {
-            if (neighbour_subarray(k)) {
-                neighbour_list.push_back(k);
-            }
-        }
-        return neighbour_list;
-    }
-    
     std::size_t Graph::compute_curve_length(std::size_t i, std::size_t j) {
-        // Compute the length of a curve using a priority queue
+        // Compute the length of a curve with a breadth-first walk
+        DPXL_TRACE_ZONE("Graph::compute_curve_length");
 
         // Check if the starting pixel has valence 2
         if (node_valence(i, j) != 2) {
@@ -108,7 +214,7 @@ namespace dpxl {
         }
 
         // Offsets for neighbor traversal (anti-clockwise starting from east)
-        const std::vector<std::pair<int, int>> offsets = {
+        static constexpr int offsets[8][2] = {
             {0, 1},   // East
             {-1, 1},  // North-East
             {-1, 0},  // North
@@ -119,37 +225,38 @@ namespace dpxl {
             {1, 1}    // South-East
         };
 
-        // Reverse offsets for bidirectional traversal
-        const std::vector<std::size_t> reverse_offsets = {4, 5, 6, 7, 0, 1, 2, 3};
-
-        // Priority queue for BFS traversal (stores {length, pixel coordinates, direction})
-        using QueueElement = std::pair<std::size_t, std::pair<std::size_t, std::size_t>>;
-        std::queue<QueueElement> pq;
-
-        // Visited set to avoid revisiting pixels
-        xt::xarray<bool> visited = xt::xarray<bool>::from_shape({get_height(), get_width()});
-        visited.fill(false);
+        // Queue (stores {length, pixel coordinates}) and visited set are kept
+        // in m_walk, so repeated walks reuse their memory
+        auto &pq = m_walk->queue;
+        auto &visited = m_walk->visited;
+        pq.clear();
+        visited.clear();
+        std::size_t width = get_width();
+        std::size_t height = get_height();
 
         // Initialize the queue with the starting pixel
-        visited(i, j) = true;
-        auto neighbor_list = get_neighbours_list(i, j);
+        visited.insert(i * width + j);
+        cv::Rect visited_box(j, i, 1, 1);
 
         // Add neighbors to the queue
-        for (std::size_t direction : neighbor_list) {
-            int ni = i + offsets[direction].first;
-            int nj = j + offsets[direction].second;
-            if (ni >= 0 && ni < get_height() && nj >= 0 && nj < get_width()) {
-                pq.push({1, {ni, nj}}); // Length starts at 1
-                visited(ni, nj) = true;
+        for (std::size_t direction = 0; direction < 8; ++direction) {
+            if (!m_neighbours(i, j, direction)) {
+                continue;
+            }
+            int ni = i + offsets[direction][0];
+            int nj = j + offsets[direction][1];
+            if (ni >= 0 && ni < height && nj >= 0 && nj < width) {
+                pq.push_back({1, {ni, nj}}); // Length starts at 1
+                visited.insert(ni * width + nj);
+                visited_box |= cv::Rect(nj, ni, 1, 1);
             }
         }
 
         std::size_t curve_length = 0;
 
-        // BFS traversal using the priority queue
-        while (!pq.empty()) {
-            auto [current_length, current_pixel] = pq.front();
-            pq.pop();
+        // Breadth-first traversal, the queue is consumed from its head
+        for (std::size_t head = 0; head < pq.size(); ++head) {
+            auto [current_length, current_pixel] = pq[head];
 
             std::size_t ci = current_pixel.first;
             std::size_t cj = current_pixel.second;
@@ -159,19 +266,21 @@ namespace dpxl {
                 continue; // Stop if the pixel is not part of the curve
             }
 
-            // Get neighbors of the current pixel
-            auto current_neighbors = get_neighbours_list(ci, cj);
-            for (std::size_t direction : current_neighbors) {
-                int ni = ci + offsets[direction].first;
-                int nj = cj + offsets[direction].second;
+            for (std::size_t direction = 0; direction < 8; ++direction) {
+                if (!m_neighbours(ci, cj, direction)) {
+                    continue;
+                }
+                int ni = ci + offsets[direction][0];
+                int nj = cj + offsets[direction][1];
 
                 // Skip already visited nodes
-                if (ni >= 0 && ni < get_height() && nj >= 0 && nj < get_width() && !visited(ni, nj)) {
-                    pq.push({current_length + 1, {ni, nj}});
-                    visited(ni, nj) = true;
+                if (ni >= 0 && ni < height && nj >= 0 && nj < width && visited.insert(ni * width + nj).second) {
+                    pq.push_back({current_length + 1, {ni, nj}});
+                    visited_box |= cv::Rect(nj, ni, 1, 1);
                 }
             }
         }
+        m_influence |= visited_box;
         return curve_length;
     }
 }
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include "depixel_lib/incremental.hpp"
+#include "depixel_lib/utils.hpp"
+
+namespace dpxl {
+
+IncrementalDepixelizer::IncrementalDepixelizer(xt::xarray<float> &img,
+                                               size_t scale_factor)
+    : m_graph(img), m_scale_factor(scale_factor) {
+  m_graph.compute_neighbours();
+  m_graph.remove_trivial_edges();
+  m_graph.resolve_diagonals();
+
+  m_cells.build_from_graph(m_graph);
+  m_output = m_cells.colorCells(m_scale_factor, m_graph.get_image());
+}
+
+void IncrementalDepixelizer::rebuild(const xt::xarray<float> &img) {
+  m_graph.reset(img);
+  m_graph.compute_neighbours();
+  m_graph.remove_trivial_edges();
+  m_graph.resolve_diagonals();
+
+  m_cells.build_from_graph(m_graph);
+  m_cells.colorCells(m_output, m_scale_factor, m_graph.get_image());
+}
+
+cv::Rect IncrementalDepixelizer::update(const xt::xarray<float> &img,
+                                        cv::Rect dirty) {
+  cv::Rect redrawn;
+  for (const auto &area : update(img, std::vector<cv::Rect>{dirty})) {
+    redrawn |= area;
+  }
+  return redrawn;
+}
+
+std::vector<cv::Rect>
+IncrementalDepixelizer::update(const xt::xarray<float> &img,
+                               const std::vector<cv::Rect> &dirty) {
+  // Past a share of the tiles, patching costs more than starting again
+  const auto &shape = m_graph.get_image().shape();
+  cv::Rect bounds(0, 0, shape[1], shape[0]);
+  const size_t tile = Graph::FLAT_TILE;
+  size_t dirty_tiles = 0;
+  utils::merge_rects(dirty, bounds, tile, &dirty_tiles);
+  size_t total_tiles =
+      ((shape[0] + tile - 1) / tile) * ((shape[1] + tile - 1) / tile);
+  if (dirty_tiles > REBUILD_FRACTION * total_tiles) {
+    rebuild(img);
+    return {cv::Rect(0, 0, m_output.cols, m_output.rows)};
+  }
+
+  // The cells are all patched before drawing, as the rebuilt areas overlap
+  std::vector<cv::Rect> rebuilt;
+  for (const auto &changed : m_graph.update_region(img, dirty)) {
+    rebuilt.push_back(m_cells.update_region(m_graph, changed));
+  }
+
+  std::vector<cv::Rect> redrawn;
+  for (const auto &rect : utils::merge_rects(rebuilt, bounds, tile)) {
+    redrawn.push_back(m_cells.colorCells(m_output, m_scale_factor,
+                                         m_graph.get_image(), rect));
+  }
+  return redrawn;
+}
+
+} // namespace dpxl
@@ -0,0 +1,167 @@
+#include "depixel_lib/locator.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace dpxl {
+
+CellLocator::CellLocator(const FlatCells &cells) : m_cells(cells) {
+  DPXL_TRACE_ZONE("CellLocator");
+  long h = cells.h;
+  long w = cells.w;
+
+  // Pixels overlapped by the bounding box of each cell, counted then listed
+  std::vector<cv::Rect> boxes(cells.counts.size());
+  m_bucket_offsets.assign(h * w + 1, 0);
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    const cv::Point *polygon = cells.points.data() + cells.offsets[c];
+    int x0 = polygon[0].x, x1 = polygon[0].x;
+    int y0 = polygon[0].y, y1 = polygon[0].y;
+    for (int k = 1; k < cells.counts[c]; ++k) {
+      x0 = std::min(x0, polygon[k].x);
+      x1 = std::max(x1, polygon[k].x);
+      y0 = std::min(y0, polygon[k].y);
+      y1 = std::max(y1, polygon[k].y);
+    }
+    // Nodes are 4 per pixel, the box is made of the pixels [j0, j1)x[i0, i1)
+    long j0 = std::clamp<long>(x0 / 4, 0, w - 1);
+    long j1 = std::clamp<long>((x1 + 3) / 4, j0 + 1, w);
+    long i0 = std::clamp<long>(y0 / 4, 0, h - 1);
+    long i1 = std::clamp<long>((y1 + 3) / 4, i0 + 1, h);
+    boxes[c] = cv::Rect(j0, i0, j1 - j0, i1 - i0);
+    for (long i = i0; i < i1; ++i) {
+      for (long j = j0; j < j1; ++j) {
+        ++m_bucket_offsets[i * w + j + 1];
+      }
+    }
+  }
+  for (long p = 0; p < h * w; ++p) {
+    m_bucket_offsets[p + 1] += m_bucket_offsets[p];
+  }
+  m_bucket_cells.resize(m_bucket_offsets.back());
+  std::vector<size_t> next(m_bucket_offsets.begin(), m_bucket_offsets.end() - 1);
+  for (size_t c = 0; c < boxes.size(); ++c) {
+    for (long i = boxes[c].y; i < boxes[c].y + boxes[c].height; ++i) {
+      for (long j = boxes[c].x; j < boxes[c].x + boxes[c].width; ++j) {
+        m_bucket_cells[next[i * w + j]++] = c;
+      }
+    }
+  }
+}
+
+size_t CellLocator::bucket(float x, float y) const {
+  long i = std::clamp<long>(std::floor(y), 0, m_cells.h - 1);
+  long j = std::clamp<long>(std::floor(x), 0, m_cells.w - 1);
+  return i * m_cells.w + j;
+}
+
+bool CellLocator::contains(uint32_t cell, float x, float y) const {
+  // Even-odd rule on the node grid, a crossing counts when right of the point
+  const cv::Point *polygon = m_cells.points.data() + m_cells.offsets[cell];
+  int count = m_cells.counts[cell];
+  float px = 4 * x;
+  float py = 4 * y;
+  bool inside = false;
+  for (int k = 0, l = count - 1; k < count; l = k++) {
+    const cv::Point &a = polygon[l];
+    const cv::Point &b = polygon[k];
+    if ((a.y > py) != (b.y > py) &&
+        px < a.x + (py - a.y) * (b.x - a.x) / float(b.y - a.y)) {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+uint32_t CellLocator::locate(float x, float y) const {
+  size_t p = bucket(x, y);
+  size_t begin = m_bucket_offsets[p];
+  size_t end = m_bucket_offsets[p + 1];
+  if (end - begin == 1) {
+    return m_bucket_cells[begin];
+  }
+  for (size_t k = end; k-- > begin;) {
+    if (contains(m_bucket_cells[k], x, y)) {
+      return m_bucket_cells[k];
+    }
+  }
+  return p;
+}
+
+void CellLocator::locate_row(float y, float x0, float dx, size_t count,
+                             uint32_t *out) const {
+  DPXL_TRACE_ZONE("CellLocator::locate_row");
+  long w = m_cells.w;
+  size_t row = bucket(0, y);
+  float py = 4 * y;
+  std::vector<float> crossings;
+  std::vector<bool> found;
+
+  size_t k = 0;
+  while (k < count) {
+    // The points [k, last) fall in the same pixel
+    long j = std::clamp<long>(std::floor(x0 + k * dx), 0, w - 1);
+    size_t last = k + 1;
+    if (j < w - 1) {
+      // First point right of the pixel, then corrected for the rounding
+      float steps = std::ceil((j + 1 - x0) / dx);
+      last = std::clamp<float>(steps, k + 1, count);
+      while (last > k + 1 && x0 + (last - 1) * dx >= j + 1) {
+        --last;
+      }
+      while (last < count && x0 + last * dx < j + 1) {
+        ++last;
+      }
+    } else {
+      last = count;
+    }
+
+    size_t p = row + j;
+    size_t begin = m_bucket_offsets[p];
+    size_t end = m_bucket_offsets[p + 1];
+    if (end - begin == 1) {
+      std::fill(out + k, out + last, m_bucket_cells[begin]);
+      k = last;
+      continue;
+    }
+
+    std::fill(out + k, out + last, uint32_t(p));
+    found.assign(last - k, false);
+    for (size_t b = end; b-- > begin;) {
+      uint32_t cell = m_bucket_cells[b];
+      const cv::Point *polygon = m_cells.points.data() + m_cells.offsets[cell];
+      int n = m_cells.counts[cell];
+      crossings.clear();
+      for (int e = 0, l = n - 1; e < n; l = e++) {
+        const cv::Point &a = polygon[l];
+        const cv::Point &c = polygon[e];
+        if ((a.y > py) != (c.y > py)) {
+          crossings.push_back(a.x + (py - a.y) * (c.x - a.x) / float(c.y - a.y));
+        }
+      }
+      if (crossings.empty()) {
+        continue;
+      }
+      std::sort(crossings.begin(), crossings.end());
+      // Inside when an odd number of crossings are right of the point
+      size_t right = crossings.size();
+      size_t next = 0;
+      for (size_t q = k; q < last; ++q) {
+        float px = 4 * (x0 + q * dx);
+        while (next < crossings.size() && crossings[next] <= px) {
+          ++next;
+          --right;
+        }
+        if (!found[q - k] && (right & 1)) {
+          out[q] = cell;
+          found[q - k] = true;
+        }
+      }
+    }
+    k = last;
+  }
+}
+
+} // namespace dpxl
@@ -0,0 +1,116 @@
+#include "depixel_lib/memory.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+#include <vector>
+
+namespace dpxl {
+
+namespace {
+// A std::set entry is a red-black tree node (3 pointers, a color and the
+// value), rounded up to the malloc chunk size
+const size_t SET_NODE_BYTES = 48;
+// A collapsed cell holds about 8 nodes, the lattice about 10 edge entries per
+// pixel (each edge is stored on both of its nodes)
+const size_t NODES_PER_CELL = 8;
+const size_t EDGES_PER_PIXEL = 10;
+// Worst case, every 2x2 block is a crossing (see Graph::Crossing)
+const size_t CROSSING_BYTES = 48;
+
+size_t graph_bytes(size_t h, size_t w) {
+  size_t pixels = h * w;
+  return pixels * 3            // decoded BGR image
+         + pixels * 3 * 4      // YUV float image
+#ifdef DPXL_TILED_STORAGE
+         + pixels * 3 * 4      // tiled copy of the image
+#endif
+         + pixels * 8          // neighbours
+         + pixels * CROSSING_BYTES;
+}
+
+size_t cells_bytes(size_t h, size_t w) {
+  size_t pixels = h * w;
+  size_t lattice = (4 * h + 1) * (4 * w + 1);
+  return pixels * (sizeof(std::vector<size_t>) + NODES_PER_CELL * 8 + 16) +
+         lattice * sizeof(std::set<size_t>) + lattice / 8 +
+         pixels * EDGES_PER_PIXEL * SET_NODE_BYTES;
+}
+
+size_t output_bytes(size_t rows, size_t w, size_t scale_factor) {
+  return rows * (4 * scale_factor + 1) * w * (4 * scale_factor + 1) * 3;
+}
+} // namespace
+
+MemoryEstimate estimate_memory(size_t height, size_t width,
+                               size_t scale_factor) {
+  MemoryEstimate estimate;
+  estimate.load = height * width * (3 + 3 + 3 * 4);
+  estimate.graph = graph_bytes(height, width);
+  estimate.cells = estimate.graph + cells_bytes(height, width);
+  estimate.render =
+      estimate.cells + output_bytes(height, width, scale_factor);
+  return estimate;
+}
+
+size_t estimate_band_memory(size_t height, size_t width, size_t scale_factor,
+                            size_t band_height, size_t halo) {
+  // The input stays decoded as a whole, a window holds the rows of a band,
+  // its halo and the rows the cells need around it. The output rows are
+  // converted once more before being written
+  size_t window = std::min(height, band_height + 2 * halo + 6);
+  return height * width * 3 + graph_bytes(window, width) +
+         cells_bytes(window, width) +
+         2 * output_bytes(band_height, width, scale_factor);
+}
+
+size_t band_height_for_budget(size_t height, size_t width, size_t scale_factor,
+                              size_t budget) {
+  size_t band_height = 1;
+  while (2 * band_height <= height) {
+    band_height *= 2;
+  }
+  for (; band_height > 0; band_height /= 2) {
+    if (estimate_band_memory(height, width, scale_factor, band_height) <=
+        budget) {
+      return band_height;
+    }
+  }
+  return 0;
+}
+
+size_t halo_for_budget(size_t height, size_t width, size_t scale_factor,
+                       size_t band_height, size_t budget) {
+  auto fits = [&](size_t halo) {
+    return estimate_band_memory(height, width, scale_factor, band_height,
+                                halo) <= budget;
+  };
+  if (!fits(8)) {
+    return 0;
+  }
+  // Past the height of the image, the window is the whole image
+  size_t low = 8, high = std::max<size_t>(height, 8);
+  if (fits(high)) {
+    return high;
+  }
+  while (high - low > 1) {
+    size_t middle = low + (high - low) / 2;
+    (fits(middle) ? low : high) = middle;
+  }
+  return low;
+}
+
+std::string format_bytes(size_t bytes) {
+  const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+  double value = bytes;
+  size_t unit = 0;
+  while (value >= 1024 && unit + 1 < sizeof(units) / sizeof(units[0])) {
+    value /= 1024;
+    ++unit;
+  }
+  char text[32];
+  std::snprintf(text, sizeof(text), "%.1f %s", value, units[unit]);
+  return text;
+}
+
+} // namespace dpxl
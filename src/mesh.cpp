@@ -0,0 +1,155 @@
+#include "depixel_lib/mesh.hpp"
+#include "depixel_lib/graph.hpp"
+#include "depixel_lib/trace.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+namespace fs = std::filesystem;
+
+namespace dpxl {
+
+namespace {
+const char MESH_MAGIC[4] = {'D', 'P', 'X', 'M'};
+const uint32_t NO_VERTEX = std::numeric_limits<uint32_t>::max();
+} // namespace
+
+CellMesh mesh_from_cells(const FlatCells &cells) {
+  DPXL_TRACE_ZONE("mesh_from_cells");
+  CellMesh mesh;
+  mesh.height = cells.h;
+  mesh.width = cells.w;
+  size_t stride = 4 * cells.w + 1;
+
+  // Vertex of each node of the grid, made when a cell first uses it
+  std::vector<uint32_t> vertex_of_node(stride * (4 * cells.h + 1), NO_VERTEX);
+  auto vertex = [&](int x, int y) {
+    uint32_t &v = vertex_of_node[y * stride + x];
+    if (v == NO_VERTEX) {
+      v = mesh.positions.size() / 2;
+      mesh.positions.push_back(x / 4.0f);
+      mesh.positions.push_back(y / 4.0f);
+    }
+    return v;
+  };
+
+  mesh.indices.reserve(3 * (cells.points.size() + cells.counts.size()));
+  mesh.colors.reserve(4 * (cells.points.size() + cells.counts.size()));
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    size_t i = c / cells.w;
+    size_t j = c % cells.w;
+    // The centre of the pixel is a node no cell uses
+    uint32_t centre = vertex(4 * j + 2, 4 * i + 2);
+    const auto &pixel = cells.img_bgr.at<cv::Vec3b>(i, j);
+    const cv::Point *polygon = cells.points.data() + cells.offsets[c];
+    for (int k = 0; k < cells.counts[c]; ++k) {
+      const cv::Point &a = polygon[k];
+      const cv::Point &b = polygon[(k + 1) % cells.counts[c]];
+      mesh.indices.push_back(centre);
+      mesh.indices.push_back(vertex(a.x, a.y));
+      mesh.indices.push_back(vertex(b.x, b.y));
+      mesh.colors.insert(mesh.colors.end(), {pixel[2], pixel[1], pixel[0], 255});
+    }
+  }
+  return mesh;
+}
+
+bool save_mesh(const std::string &path, const CellMesh &mesh) {
+  DPXL_TRACE_ZONE("save_mesh");
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    std::cerr << "Could not open the mesh file: " << path << std::endl;
+    return false;
+  }
+  MeshHeader header;
+  std::memcpy(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC));
+  header.version = MESH_FILE_VERSION;
+  header.height = mesh.height;
+  header.width = mesh.width;
+  header.vertex_count = mesh.vertex_count();
+  header.triangle_count = mesh.triangle_count();
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(mesh.positions.data()),
+             mesh.positions.size() * sizeof(float));
+  file.write(reinterpret_cast<const char *>(mesh.indices.data()),
+             mesh.indices.size() * sizeof(uint32_t));
+  file.write(reinterpret_cast<const char *>(mesh.colors.data()),
+             mesh.colors.size());
+  if (!file) {
+    std::cerr << "Could not write the mesh file: " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool load_mesh(const std::string &path, CellMesh &mesh) {
+  std::ifstream file(path, std::ios::binary);
+  MeshHeader header;
+  if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, MESH_MAGIC, sizeof(MESH_MAGIC)) != 0 ||
+      header.version != MESH_FILE_VERSION) {
+    std::cerr << "Not a mesh file: " << path << std::endl;
+    return false;
+  }
+  mesh.height = header.height;
+  mesh.width = header.width;
+  mesh.positions.resize(2 * size_t(header.vertex_count));
+  mesh.indices.resize(3 * size_t(header.triangle_count));
+  mesh.colors.resize(4 * size_t(header.triangle_count));
+  file.read(reinterpret_cast<char *>(mesh.positions.data()),
+            mesh.positions.size() * sizeof(float));
+  file.read(reinterpret_cast<char *>(mesh.indices.data()),
+            mesh.indices.size() * sizeof(uint32_t));
+  file.read(reinterpret_cast<char *>(mesh.colors.data()), mesh.colors.size());
+  if (!file) {
+    std::cerr << "Truncated mesh file: " << path << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void depixelize_mesh(const std::string &image_path) {
+  fs::path output_dir = "visualisation";
+  fs::create_directories(output_dir); // Ensure the output directory exists
+  std::string file_name = fs::absolute(image_path).stem().string();
+
+  cv::Mat img_bgr = cv::imread(image_path, cv::IMREAD_COLOR);
+  if (img_bgr.empty()) {
+    std::cerr << "Could not read the image: " << image_path << std::endl;
+    return;
+  }
+  cv::Mat img_yuv;
+  xt::xarray<float> img;
+  utils::image_to_arr(img_bgr, img, img_yuv);
+
+  Graph graph(img);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  VoronoiCells cells;
+  cells.build_from_graph(graph);
+
+  // Node indices are stored on 32 bits
+  if ((4 * graph.get_height() + 1) * (4 * graph.get_width() + 1) >
+      std::numeric_limits<uint32_t>::max()) {
+    std::cerr << "Image too large to be saved as a mesh: " << image_path
+              << std::endl;
+    return;
+  }
+
+  fs::path output_path = output_dir / (file_name + ".dpxm");
+  if (save_mesh(output_path.string(),
+                mesh_from_cells(cells.flatten(graph.get_image())))) {
+    std::cout << "Mesh saved to " << output_path << std::endl;
+  } else {
+    std::cerr << "Failed to save the mesh." << std::endl;
+  }
+}
+
+} // namespace dpxl
@@ -0,0 +1,158 @@
+#include "depixel_lib/multiscale.hpp"
+#include "depixel_lib/graph.hpp"
+#include "depixel_lib/trace.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+namespace dpxl {
+
+void render_flat_cells(const FlatCells &cells, size_t scale_factor,
+                       cv::Mat &output_image) {
+  DPXL_TRACE_ZONE("render_flat_cells");
+  cv::resize(cells.img_bgr, output_image, cv::Size(), 4 * scale_factor + 1,
+             4 * scale_factor + 1, cv::INTER_NEAREST);
+
+  std::vector<cv::Point> polygon;
+  int scale = scale_factor;
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    polygon.assign(cells.points.begin() + cells.offsets[c],
+                   cells.points.begin() + cells.offsets[c] + cells.counts[c]);
+    for (auto &point : polygon) {
+      point *= scale;
+    }
+    const cv::Point *points = polygon.data();
+    const auto &pixel_color = cells.img_bgr.at<cv::Vec3b>(c / cells.w,
+                                                          c % cells.w);
+    cv::fillPoly(output_image, &points, &cells.counts[c], 1,
+                 cv::Scalar(pixel_color[0], pixel_color[1], pixel_color[2]),
+                 cv::LINE_8, 0);
+  }
+}
+
+void render_multiple(const FlatCells &cells, size_t multiple,
+                     cv::Mat &output_image) {
+  DPXL_TRACE_ZONE("render_multiple");
+  cv::resize(cells.img_bgr, output_image, cv::Size(), multiple, multiple,
+             cv::INTER_NEAREST);
+
+  // In quarters of output pixels, drawn with 2 fractional bits
+  std::vector<cv::Point> polygon;
+  int scale = multiple;
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    polygon.assign(cells.points.begin() + cells.offsets[c],
+                   cells.points.begin() + cells.offsets[c] + cells.counts[c]);
+    for (auto &point : polygon) {
+      point *= scale;
+    }
+    const cv::Point *points = polygon.data();
+    const auto &pixel_color = cells.img_bgr.at<cv::Vec3b>(c / cells.w,
+                                                          c % cells.w);
+    cv::fillPoly(output_image, &points, &cells.counts[c], 1,
+                 cv::Scalar(pixel_color[0], pixel_color[1], pixel_color[2]),
+                 cv::LINE_8, 2);
+  }
+}
+
+namespace {
+// render(sizes[k], outputs[k]) for every k, on up to thread_count threads
+template <class Render>
+std::vector<cv::Mat> render_all(const std::vector<size_t> &sizes,
+                                size_t thread_count, const Render &render) {
+  std::vector<cv::Mat> outputs(sizes.size());
+  if (thread_count == 0) {
+    thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  thread_count = std::min(thread_count, sizes.size());
+
+  // Largest first, they take the longest
+  std::vector<size_t> order(sizes.size());
+  for (size_t k = 0; k < order.size(); ++k) {
+    order[k] = k;
+  }
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return sizes[a] > sizes[b]; });
+
+  std::atomic<size_t> next(0);
+  auto work = [&] {
+    for (size_t k = next++; k < order.size(); k = next++) {
+      render(sizes[order[k]], outputs[order[k]]);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < thread_count; ++t) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  return outputs;
+}
+} // namespace
+
+std::vector<cv::Mat> render_scales(const FlatCells &cells,
+                                   const std::vector<size_t> &scale_factors,
+                                   size_t thread_count) {
+  return render_all(scale_factors, thread_count,
+                    [&cells](size_t scale_factor, cv::Mat &output) {
+                      render_flat_cells(cells, scale_factor, output);
+                    });
+}
+
+std::vector<cv::Mat> render_multiples(const FlatCells &cells,
+                                      const std::vector<size_t> &multiples,
+                                      size_t thread_count) {
+  return render_all(multiples, thread_count,
+                    [&cells](size_t multiple, cv::Mat &output) {
+                      render_multiple(cells, multiple, output);
+                    });
+}
+
+void depixelize_scales(const std::string &image_path,
+                       const std::vector<size_t> &multiples) {
+  fs::path output_dir = "visualisation";
+  fs::create_directories(output_dir); // Ensure the output directory exists
+  std::string file_name = fs::absolute(image_path).stem().string();
+
+  cv::Mat img_bgr = cv::imread(image_path, cv::IMREAD_COLOR);
+  if (img_bgr.empty()) {
+    std::cerr << "Could not read the image: " << image_path << std::endl;
+    return;
+  }
+  cv::Mat img_yuv;
+  xt::xarray<float> img;
+  utils::image_to_arr(img_bgr, img, img_yuv);
+
+  // The geometry is built once for every scale
+  Graph graph(img);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  VoronoiCells cells;
+  cells.build_from_graph(graph);
+  FlatCells flat = cells.flatten(graph.get_image());
+
+  std::vector<cv::Mat> outputs = render_multiples(flat, multiples);
+  for (size_t k = 0; k < multiples.size(); ++k) {
+    fs::path output_path =
+        output_dir / (file_name + "_voronoi_cells_colored_x" +
+                      std::to_string(multiples[k]) + ".png");
+    if (cv::imwrite(output_path.string(), outputs[k])) {
+      std::cout << "Output image saved to " << output_path << std::endl;
+    } else {
+      std::cerr << "Failed to save the output image." << std::endl;
+    }
+  }
+}
+
+} // namespace dpxl
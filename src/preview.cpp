@@ -0,0 +1,137 @@
+#include "depixel_lib/preview.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+namespace dpxl {
+
+ProgressivePreview::ProgressivePreview(size_t scale_factor, Callback callback)
+    : m_scale_factor(scale_factor), m_callback(std::move(callback)) {
+  m_worker = std::thread(&ProgressivePreview::work, this);
+}
+
+ProgressivePreview::~ProgressivePreview() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+    m_has_pending = false;
+    ++m_generation;
+    if (m_budget) {
+      m_budget->cancel();
+    }
+  }
+  m_wake.notify_all();
+  m_worker.join();
+}
+
+uint64_t ProgressivePreview::submit(const cv::Mat &img_bgr) {
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    img_bgr.copyTo(m_pending);
+    m_has_pending = true;
+    generation = ++m_generation;
+    if (m_budget) {
+      m_budget->cancel();
+    }
+  }
+  m_wake.notify_one();
+  return generation;
+}
+
+void ProgressivePreview::cancel() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_has_pending = false;
+    ++m_generation;
+    if (m_budget) {
+      m_budget->cancel();
+    }
+  }
+  // A level may be in the callback right now
+  std::lock_guard<std::mutex> lock(m_deliver_mutex);
+}
+
+void ProgressivePreview::wait() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [this] { return !m_has_pending && !m_busy; });
+}
+
+void ProgressivePreview::work() {
+  cv::Mat img_bgr;
+  while (true) {
+    uint64_t generation;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_busy = false;
+      m_idle.notify_all();
+      m_wake.wait(lock, [this] { return m_stop || m_has_pending; });
+      if (m_stop) {
+        return;
+      }
+      // Only the last image submitted is worked on
+      cv::swap(img_bgr, m_pending);
+      m_has_pending = false;
+      m_busy = true;
+      generation = m_generation;
+      m_budget = std::make_unique<TimeBudget>();
+    }
+    m_context.set_budget(m_budget.get());
+    run(img_bgr, generation);
+  }
+}
+
+bool ProgressivePreview::deliver(const cv::Mat &image, PreviewLevel level,
+                                 uint64_t generation) {
+  std::lock_guard<std::mutex> lock(m_deliver_mutex);
+  if (m_generation != generation) {
+    return false;
+  }
+  m_callback(image, level, generation);
+  return true;
+}
+
+void ProgressivePreview::run(const cv::Mat &img_bgr, uint64_t generation) {
+  DPXL_TRACE_ZONE("ProgressivePreview::run");
+  cv::Size output_size(img_bgr.cols * (4 * m_scale_factor + 1),
+                       img_bgr.rows * (4 * m_scale_factor + 1));
+
+  cv::resize(img_bgr, m_preview, output_size, 0, 0, cv::INTER_NEAREST);
+  if (!deliver(m_preview, PreviewLevel::Pixels, generation)) {
+    return;
+  }
+
+  // The graph is the bulk of the work. Its stages, the cells and the renders
+  // degrade once the budget is cancelled, they are skipped in between
+  Graph &graph = m_context.load(img_bgr);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  if (m_generation != generation) {
+    return;
+  }
+  graph.resolve_diagonals();
+  if (m_generation != generation) {
+    return;
+  }
+  m_context.build_cells();
+  if (m_generation != generation) {
+    return;
+  }
+
+  cv::resize(m_context.render(1), m_preview, output_size, 0, 0,
+             cv::INTER_NEAREST);
+  if (!deliver(m_preview, PreviewLevel::Coarse, generation)) {
+    return;
+  }
+  if (!deliver(m_context.render(m_scale_factor), PreviewLevel::Full,
+               generation)) {
+    return;
+  }
+
+  // Supersampled twice in each direction, then averaged down
+  cv::resize(m_context.render(2 * m_scale_factor), m_preview, output_size, 0,
+             0, cv::INTER_AREA);
+  deliver(m_preview, PreviewLevel::Smooth, generation);
+}
+
+} // namespace dpxl
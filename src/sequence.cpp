@@ -0,0 +1,115 @@
+#include "depixel_lib/sequence.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+namespace dpxl {
+
+const cv::Mat &SequenceDepixelizer::next_frame(xt::xarray<float> &img) {
+  // A frame of a different size starts a new sequence
+  if (m_depixelizer == nullptr ||
+      m_depixelizer->get_graph().get_image().shape() != img.shape()) {
+    m_depixelizer =
+        std::make_unique<IncrementalDepixelizer>(img, m_scale_factor);
+
+    size_t h = img.shape()[0];
+    size_t w = img.shape()[1];
+    m_total_tiles = ((h + m_tile_size - 1) / m_tile_size) *
+                    ((w + m_tile_size - 1) / m_tile_size);
+    m_changed_tiles = m_total_tiles;
+    return m_depixelizer->get_output();
+  }
+
+  auto dirty = changed_tiles(img);
+  m_changed_tiles = dirty.size();
+  if (!dirty.empty()) {
+    m_depixelizer->update(img, dirty);
+  }
+  return m_depixelizer->get_output();
+}
+
+std::vector<cv::Rect>
+SequenceDepixelizer::changed_tiles(const xt::xarray<float> &img) {
+  // Smallest rectangle holding the changed pixels of each tile
+  const auto &previous = m_depixelizer->get_graph().get_image();
+  size_t h = img.shape()[0];
+  size_t w = img.shape()[1];
+
+  std::vector<cv::Rect> dirty;
+  for (size_t ti = 0; ti < h; ti += m_tile_size) {
+    for (size_t tj = 0; tj < w; tj += m_tile_size) {
+      cv::Rect changed;
+      for (size_t i = ti; i < std::min(ti + m_tile_size, h); ++i) {
+        for (size_t j = tj; j < std::min(tj + m_tile_size, w); ++j) {
+          if (img(i, j, 0) != previous(i, j, 0) ||
+              img(i, j, 1) != previous(i, j, 1) ||
+              img(i, j, 2) != previous(i, j, 2)) {
+            changed |= cv::Rect(j, i, 1, 1);
+          }
+        }
+      }
+      if (!changed.empty()) {
+        dirty.push_back(changed);
+      }
+    }
+  }
+  return dirty;
+}
+
+void depixelize_sequence(const std::vector<std::string> &frame_paths) {
+  fs::path output_dir = "visualisation";
+  fs::create_directories(output_dir); // Ensure the output directory exists
+
+  std::vector<cv::Mat> frames;
+  std::vector<std::string> file_names;
+  if (frame_paths.size() == 1) {
+    std::string file_name = fs::absolute(frame_paths[0]).stem().string();
+    if (!cv::imreadmulti(frame_paths[0], frames, cv::IMREAD_COLOR)) {
+      std::cerr << "Could not read the frames: " << frame_paths[0]
+                << std::endl;
+      return;
+    }
+    for (size_t k = 0; k < frames.size(); ++k) {
+      file_names.push_back(file_name + "_" + std::to_string(k));
+    }
+  } else {
+    for (const auto &path : frame_paths) {
+      frames.push_back(cv::imread(path, cv::IMREAD_COLOR));
+      if (frames.back().empty()) {
+        std::cerr << "Could not read the image: " << path << std::endl;
+        return;
+      }
+      file_names.push_back(fs::absolute(path).stem().string());
+    }
+  }
+
+  SequenceDepixelizer sequence(100);
+  for (size_t k = 0; k < frames.size(); ++k) {
+    cv::Mat img_yuv;
+    xt::xarray<float> img;
+    utils::image_to_arr(frames[k], img, img_yuv);
+
+    const cv::Mat &voronoi_cells_colored = sequence.next_frame(img);
+
+    fs::path output_path =
+        output_dir / (file_names[k] + "_voronoi_cells_colored.png");
+
+    if (cv::imwrite(output_path.string(), voronoi_cells_colored)) {
+      std::cout << "Output image saved to " << output_path << " ("
+                << sequence.get_changed_tiles() << "/"
+                << sequence.get_total_tiles() << " tiles processed)"
+                << std::endl;
+    } else {
+      std::cerr << "Failed to save the output image." << std::endl;
+    }
+  }
+}
+
+} // namespace dpxl
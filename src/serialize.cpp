@@ -0,0 +1,390 @@
+#include "depixel_lib/serialize.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace dpxl {
+
+namespace {
+const char STAGE_MAGIC[4] = {'D', 'P', 'X', 'L'};
+
+size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+struct PendingSection {
+  StageSectionTag tag;
+  const void *data;
+  size_t size;
+};
+
+template <typename T>
+PendingSection pending(StageSectionTag tag, const std::vector<T> &v) {
+  return PendingSection{tag, v.data(), v.size() * sizeof(T)};
+}
+
+// Whether the (4h + 1) x (4w + 1) node indices of an image fit on 32 bits,
+// without overflowing on the way
+bool node_indices_fit(size_t h, size_t w) {
+  return 4 * h + 1 <= std::numeric_limits<uint32_t>::max() / (4 * w + 1);
+}
+
+// Whether the count + 1 offsets of a CSR section go from 0 up to at most
+// value_count without ever decreasing
+bool valid_offsets(const uint32_t *offsets, size_t count, size_t value_count) {
+  if (offsets[0] != 0) {
+    return false;
+  }
+  for (size_t k = 0; k < count; ++k) {
+    if (offsets[k + 1] < offsets[k]) {
+      return false;
+    }
+  }
+  return offsets[count] <= value_count;
+}
+
+// Whether all the values are below bound
+bool below(const uint32_t *values, size_t count, size_t bound) {
+  return std::all_of(values, values + count,
+                     [&](uint32_t value) { return value < bound; });
+}
+} // namespace
+
+bool save_stages(const std::string &path, const Graph &graph,
+                 VoronoiCells *cells) {
+  DPXL_TRACE_ZONE("save_stages");
+  size_t h = graph.get_height();
+  size_t w = graph.get_width();
+
+  // Node indices are stored on 32 bits
+  if (!node_indices_fit(h, w)) {
+    std::cerr << "Image too large to be saved as stages: " << path
+              << std::endl;
+    return false;
+  }
+
+  const auto &img = graph.get_image();
+  const auto &neighbours = graph.get_neighbours();
+
+  std::vector<uint8_t> image(h * w * 3);
+  std::vector<uint8_t> mask(h * w, 0);
+  for (size_t i = 0; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      for (size_t c = 0; c < 3; ++c) {
+        image[(i * w + j) * 3 + c] =
+            static_cast<uint8_t>(std::lround(img(i, j, c) * 255.0f));
+      }
+      for (size_t k = 0; k < 8; ++k) {
+        if (neighbours(i, j, k)) {
+          mask[i * w + j] |= static_cast<uint8_t>(1 << k);
+        }
+      }
+    }
+  }
+
+  std::vector<PendingSection> sections = {
+      pending(StageSectionTag::Image, image),
+      pending(StageSectionTag::Mask, mask)};
+
+  // Cells and nodes are flattened in CSR form (offsets + values)
+  std::vector<uint32_t> cell_offsets, cell_nodes;
+  std::vector<uint32_t> node_ids, node_offsets, node_adjacency;
+  if (cells != nullptr) {
+    cell_offsets.reserve(h * w + 1);
+    cell_offsets.push_back(0);
+    for (const auto &cell : cells->get_cells()) {
+      for (auto node : cell) {
+        cell_nodes.push_back(static_cast<uint32_t>(node));
+      }
+      cell_offsets.push_back(static_cast<uint32_t>(cell_nodes.size()));
+    }
+
+    // Only the non isolated nodes are stored, most of the lattice is empty
+    const auto &nodes = cells->get_nodes();
+    node_offsets.push_back(0);
+    for (size_t k = 0; k < nodes.size(); ++k) {
+      if (nodes[k].empty()) {
+        continue;
+      }
+      node_ids.push_back(static_cast<uint32_t>(k));
+      for (auto n : nodes[k]) {
+        node_adjacency.push_back(static_cast<uint32_t>(n));
+      }
+      node_offsets.push_back(static_cast<uint32_t>(node_adjacency.size()));
+    }
+
+    sections.push_back(pending(StageSectionTag::CellOffsets, cell_offsets));
+    sections.push_back(pending(StageSectionTag::CellNodes, cell_nodes));
+    sections.push_back(pending(StageSectionTag::NodeIds, node_ids));
+    sections.push_back(pending(StageSectionTag::NodeOffsets, node_offsets));
+    sections.push_back(
+        pending(StageSectionTag::NodeAdjacency, node_adjacency));
+  }
+
+  std::ofstream out(path, std::ios::binary);
+  if (!out) {
+    std::cerr << "Could not open the stage file: " << path << std::endl;
+    return false;
+  }
+
+  StageHeader header = {};
+  std::memcpy(header.magic, STAGE_MAGIC, sizeof(STAGE_MAGIC));
+  header.version = STAGE_FILE_VERSION;
+  header.height = static_cast<uint32_t>(h);
+  header.width = static_cast<uint32_t>(w);
+  header.section_count = static_cast<uint32_t>(sections.size());
+
+  std::vector<StageSection> table(sections.size());
+  size_t offset =
+      align8(sizeof(StageHeader) + table.size() * sizeof(StageSection));
+  for (size_t s = 0; s < sections.size(); ++s) {
+    table[s] = StageSection{static_cast<uint32_t>(sections[s].tag), 0, offset,
+                            sections[s].size};
+    offset = align8(offset + sections[s].size);
+  }
+
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(table.data()),
+            table.size() * sizeof(StageSection));
+
+  const char padding[8] = {};
+  size_t written = sizeof(header) + table.size() * sizeof(StageSection);
+  for (size_t s = 0; s < sections.size(); ++s) {
+    out.write(padding, table[s].offset - written);
+    out.write(static_cast<const char *>(sections[s].data), sections[s].size);
+    written = table[s].offset + table[s].size;
+  }
+
+  return static_cast<bool>(out);
+}
+
+StageFile::~StageFile() { close(); }
+
+StageFile::StageFile(StageFile &&other) noexcept { *this = std::move(other); }
+
+StageFile &StageFile::operator=(StageFile &&other) noexcept {
+  if (this != &other) {
+    close();
+    m_data = other.m_data;
+    m_length = other.m_length;
+    m_h = other.m_h;
+    m_w = other.m_w;
+    m_image = other.m_image;
+    m_mask = other.m_mask;
+    m_cell_offsets = other.m_cell_offsets;
+    m_cell_nodes = other.m_cell_nodes;
+    m_node_ids = other.m_node_ids;
+    m_node_offsets = other.m_node_offsets;
+    m_node_adjacency = other.m_node_adjacency;
+    m_node_count = other.m_node_count;
+
+    // The mapping now belongs to this object
+    other.m_data = nullptr;
+    other.close();
+  }
+  return *this;
+}
+
+bool StageFile::open(const std::string &path) {
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open the stage file: " << path << std::endl;
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) < sizeof(StageHeader)) {
+    std::cerr << "Invalid stage file: " << path << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Could not map the stage file: " << path << std::endl;
+    return false;
+  }
+  m_data = data;
+  m_length = st.st_size;
+
+  auto header = static_cast<const StageHeader *>(m_data);
+  if (std::memcmp(header->magic, STAGE_MAGIC, sizeof(STAGE_MAGIC)) != 0 ||
+      header->version != STAGE_FILE_VERSION ||
+      sizeof(StageHeader) + header->section_count * sizeof(StageSection) >
+          m_length) {
+    std::cerr << "Invalid or incompatible stage file: " << path << std::endl;
+    close();
+    return false;
+  }
+  m_h = header->height;
+  m_w = header->width;
+  // As save_stages enforces, which also keeps the section sizes below from
+  // overflowing
+  if (!node_indices_fit(m_h, m_w)) {
+    std::cerr << "Invalid image size in stage file: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  size_t count;
+  m_image = static_cast<const uint8_t *>(
+      section(StageSectionTag::Image, 1, m_h * m_w * 3, count));
+  m_mask = static_cast<const uint8_t *>(
+      section(StageSectionTag::Mask, 1, m_h * m_w, count));
+  if (m_image == nullptr || m_mask == nullptr) {
+    std::cerr << "Missing graph in stage file: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  // The cells are optional
+  size_t cell_node_count = 0, adjacency_count = 0;
+  m_cell_offsets = static_cast<const uint32_t *>(
+      section(StageSectionTag::CellOffsets, 4, m_h * m_w + 1, count));
+  m_cell_nodes = static_cast<const uint32_t *>(
+      section(StageSectionTag::CellNodes, 4, 0, cell_node_count));
+  m_node_ids = static_cast<const uint32_t *>(
+      section(StageSectionTag::NodeIds, 4, 0, m_node_count));
+  m_node_offsets = static_cast<const uint32_t *>(
+      section(StageSectionTag::NodeOffsets, 4, m_node_count + 1, count));
+  m_node_adjacency = static_cast<const uint32_t *>(
+      section(StageSectionTag::NodeAdjacency, 4, 0, adjacency_count));
+
+  if (m_cell_offsets == nullptr || m_cell_nodes == nullptr ||
+      m_node_ids == nullptr || m_node_offsets == nullptr ||
+      m_node_adjacency == nullptr) {
+    m_cell_offsets = nullptr;
+    m_cell_nodes = nullptr;
+    m_node_ids = nullptr;
+    m_node_offsets = nullptr;
+    m_node_adjacency = nullptr;
+    m_node_count = 0;
+    return true;
+  }
+
+  // Everything to_cells and the accessors index with must be in range:
+  // offsets within their section, nodes on the grid, node ids sorted for the
+  // binary search of node_adjacency
+  size_t grid_nodes = (4 * m_h + 1) * (4 * m_w + 1);
+  bool sorted_ids = true;
+  for (size_t n = 1; n < m_node_count; ++n) {
+    sorted_ids = sorted_ids && m_node_ids[n - 1] < m_node_ids[n];
+  }
+  if (!valid_offsets(m_cell_offsets, m_h * m_w, cell_node_count) ||
+      !valid_offsets(m_node_offsets, m_node_count, adjacency_count) ||
+      !below(m_cell_nodes, cell_node_count, grid_nodes) ||
+      !below(m_node_ids, m_node_count, grid_nodes) ||
+      !below(m_node_adjacency, adjacency_count, grid_nodes) || !sorted_ids) {
+    std::cerr << "Corrupt cells in stage file: " << path << std::endl;
+    close();
+    return false;
+  }
+
+  return true;
+}
+
+void StageFile::close() {
+  if (m_data != nullptr) {
+    munmap(m_data, m_length);
+  }
+  m_data = nullptr;
+  m_length = 0;
+  m_h = 0;
+  m_w = 0;
+  m_image = nullptr;
+  m_mask = nullptr;
+  m_cell_offsets = nullptr;
+  m_cell_nodes = nullptr;
+  m_node_ids = nullptr;
+  m_node_offsets = nullptr;
+  m_node_adjacency = nullptr;
+  m_node_count = 0;
+}
+
+const void *StageFile::section(StageSectionTag tag, size_t elem_size,
+                               size_t expected_count, size_t &count) const {
+  // An expected_count of 0 accepts any number of elements
+  auto table = reinterpret_cast<const StageSection *>(
+      static_cast<const char *>(m_data) + sizeof(StageHeader));
+  auto header = static_cast<const StageHeader *>(m_data);
+
+  for (size_t s = 0; s < header->section_count; ++s) {
+    const auto &entry = table[s];
+    if (entry.tag != static_cast<uint32_t>(tag)) {
+      continue;
+    }
+    if (entry.offset % 8 != 0 || entry.size % elem_size != 0 ||
+        entry.offset > m_length || entry.size > m_length - entry.offset) {
+      return nullptr;
+    }
+    count = entry.size / elem_size;
+    if (expected_count != 0 && count != expected_count) {
+      return nullptr;
+    }
+    return static_cast<const char *>(m_data) + entry.offset;
+  }
+  return nullptr;
+}
+
+const uint32_t *StageFile::node_adjacency(size_t idx, size_t &count) const {
+  count = 0;
+  if (!has_cells()) {
+    return nullptr;
+  }
+  auto end = m_node_ids + m_node_count;
+  auto it = std::lower_bound(m_node_ids, end, static_cast<uint32_t>(idx));
+  if (it == end || *it != idx) {
+    return nullptr;
+  }
+  size_t n = it - m_node_ids;
+  count = m_node_offsets[n + 1] - m_node_offsets[n];
+  return m_node_adjacency + m_node_offsets[n];
+}
+
+Graph StageFile::to_graph() const {
+  xt::xarray<float> img = xt::xarray<float>::from_shape({m_h, m_w, 3});
+  xt::xarray<bool> neighbours = xt::xarray<bool>::from_shape({m_h, m_w, 8});
+  for (size_t i = 0; i < m_h; ++i) {
+    for (size_t j = 0; j < m_w; ++j) {
+      for (size_t c = 0; c < 3; ++c) {
+        img(i, j, c) = m_image[(i * m_w + j) * 3 + c] / 255.0f;
+      }
+      for (size_t k = 0; k < 8; ++k) {
+        neighbours(i, j, k) = neighbour(i, j, k);
+      }
+    }
+  }
+  return Graph(img, neighbours);
+}
+
+VoronoiCells StageFile::to_cells() const {
+  CellArray cells(m_h * m_w);
+  NodeArray nodes((4 * m_h + 1) * (4 * m_w + 1));
+  if (!has_cells()) {
+    return VoronoiCells(m_h, m_w, std::move(cells), std::move(nodes));
+  }
+
+  for (size_t c = 0; c < cells.size(); ++c) {
+    cells[c].assign(cell(c), cell(c) + cell_size(c));
+  }
+  for (size_t n = 0; n < m_node_count; ++n) {
+    nodes[m_node_ids[n]].insert(m_node_adjacency + m_node_offsets[n],
+                                m_node_adjacency + m_node_offsets[n + 1]);
+  }
+  return VoronoiCells(m_h, m_w, std::move(cells), std::move(nodes));
+}
+
+} // namespace dpxl
@@ -0,0 +1,370 @@
+#include "depixel_lib/server.hpp"
+#include "depixel_lib/context.hpp"
+#include "depixel_lib/memory.hpp"
+
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace dpxl {
+
+namespace {
+// Larger frames are rejected rather than allocated
+const uint32_t MAX_FRAME_SIZE = 1u << 30;
+
+bool read_all(int fd, void *data, size_t size) {
+  auto bytes = static_cast<char *>(data);
+  while (size > 0) {
+    ssize_t n = ::read(fd, bytes, size);
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool write_all(int fd, const void *data, size_t size) {
+  auto bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    ssize_t n = ::write(fd, bytes, size);
+    if (n <= 0) {
+      return false;
+    }
+    bytes += n;
+    size -= n;
+  }
+  return true;
+}
+
+void put_u32(std::vector<unsigned char> &out, uint32_t value) {
+  auto bytes = reinterpret_cast<const unsigned char *>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+uint32_t get_u32(const std::vector<unsigned char> &in, size_t offset) {
+  uint32_t value;
+  std::memcpy(&value, in.data() + offset, sizeof(value));
+  return value;
+}
+
+JobResponse error_response(uint32_t id, JobStatus status,
+                           const std::string &message) {
+  return JobResponse{id, status, 0, {message.begin(), message.end()}};
+}
+
+// Responses of one stream, written by the workers as their jobs finish
+struct Connection {
+  int out_fd;
+  std::mutex write_mutex;
+
+  std::mutex pending_mutex;
+  std::condition_variable done;
+  size_t pending = 0;
+};
+} // namespace
+
+bool read_frame(int fd, std::vector<unsigned char> &payload) {
+  uint32_t size;
+  if (!read_all(fd, &size, sizeof(size)) || size > MAX_FRAME_SIZE) {
+    return false;
+  }
+  payload.resize(size);
+  return read_all(fd, payload.data(), size);
+}
+
+bool write_frame(int fd, const std::vector<unsigned char> &payload) {
+  uint32_t size = static_cast<uint32_t>(payload.size());
+  return write_all(fd, &size, sizeof(size)) &&
+         write_all(fd, payload.data(), payload.size());
+}
+
+std::vector<unsigned char> encode_request(const JobRequest &request) {
+  std::vector<unsigned char> payload;
+  payload.reserve(12 + request.image.size());
+  put_u32(payload, request.id);
+  put_u32(payload, request.deadline_ms);
+  put_u32(payload, request.scale_factor);
+  payload.insert(payload.end(), request.image.begin(), request.image.end());
+  return payload;
+}
+
+bool decode_request(const std::vector<unsigned char> &payload,
+                    JobRequest &request) {
+  if (payload.size() < 12) {
+    return false;
+  }
+  request.id = get_u32(payload, 0);
+  request.deadline_ms = get_u32(payload, 4);
+  request.scale_factor = get_u32(payload, 8);
+  request.image.assign(payload.begin() + 12, payload.end());
+  return true;
+}
+
+std::vector<unsigned char> encode_response(const JobResponse &response) {
+  std::vector<unsigned char> payload;
+  payload.reserve(12 + response.data.size());
+  put_u32(payload, response.id);
+  put_u32(payload, static_cast<uint32_t>(response.status));
+  put_u32(payload, response.degraded);
+  payload.insert(payload.end(), response.data.begin(), response.data.end());
+  return payload;
+}
+
+bool decode_response(const std::vector<unsigned char> &payload,
+                     JobResponse &response) {
+  if (payload.size() < 12) {
+    return false;
+  }
+  response.id = get_u32(payload, 0);
+  response.status = static_cast<JobStatus>(get_u32(payload, 4));
+  response.degraded = get_u32(payload, 8);
+  response.data.assign(payload.begin() + 12, payload.end());
+  return true;
+}
+
+Server::Server(size_t thread_count, size_t max_queued_jobs,
+               size_t max_job_bytes)
+    : m_max_queued_jobs(max_queued_jobs), m_max_job_bytes(max_job_bytes) {
+  for (size_t t = 0; t < std::max<size_t>(thread_count, 1); ++t) {
+    m_workers.emplace_back(&Server::work, this);
+  }
+}
+
+Server::~Server() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (auto &worker : m_workers) {
+    worker.join();
+  }
+}
+
+bool Server::submit(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_tasks.size() >= m_max_queued_jobs) {
+      return false;
+    }
+    m_tasks.push_back(std::move(task));
+  }
+  m_wake.notify_one();
+  return true;
+}
+
+void Server::work() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+      if (m_tasks.empty()) {
+        return;
+      }
+      task = std::move(m_tasks.front());
+      m_tasks.pop_front();
+    }
+    task();
+  }
+}
+
+JobResponse Server::process(const JobRequest &request, Deadline deadline) {
+  // Buffers kept warm by each worker between jobs
+  thread_local cv::Mat img_bgr;
+  thread_local PipelineContext context;
+  thread_local std::vector<unsigned char> encoded;
+
+  auto expired = [&request, deadline] {
+    return request.deadline_ms != 0 &&
+           std::chrono::steady_clock::now() > deadline;
+  };
+
+  if (request.scale_factor == 0) {
+    return error_response(request.id, JobStatus::InvalidRequest,
+                          "The scale factor must be positive");
+  }
+  if (expired()) {
+    return error_response(request.id, JobStatus::DeadlineExceeded,
+                          "Deadline exceeded before the job started");
+  }
+
+  // A failing job, e.g. out of memory, is answered rather than bringing the
+  // server down
+  try {
+    img_bgr = cv::imdecode(request.image, cv::IMREAD_COLOR);
+    if (img_bgr.empty()) {
+      return error_response(request.id, JobStatus::InvalidImage,
+                            "Could not decode the image");
+    }
+
+    // The output alone, (4 * scale + 1)^2 BGR pixels per pixel of the
+    // image, is checked in floating point first: the estimate could overflow
+    double side = 4.0 * request.scale_factor + 1;
+    if (side * side * img_bgr.rows * img_bgr.cols * 3 > m_max_job_bytes ||
+        estimate_memory(img_bgr.rows, img_bgr.cols, request.scale_factor)
+                .peak() > m_max_job_bytes) {
+      return error_response(request.id, JobStatus::InvalidRequest,
+                            "The job would need more than " +
+                                format_bytes(m_max_job_bytes) +
+                                ", lower the scale factor");
+    }
+
+    // Once started, the job degrades the stages left rather than fail
+    std::unique_ptr<TimeBudget> budget =
+        request.deadline_ms != 0 ? std::make_unique<TimeBudget>(deadline)
+                                 : std::make_unique<TimeBudget>();
+    context.set_budget(budget.get());
+    const cv::Mat &output = context.process(img_bgr, request.scale_factor);
+    context.set_budget(nullptr);
+    if (!cv::imencode(".png", output, encoded)) {
+      return error_response(request.id, JobStatus::InvalidImage,
+                            "Could not encode the output image");
+    }
+    return JobResponse{request.id, JobStatus::Ok, budget->get_degraded(),
+                       encoded};
+  } catch (const std::exception &error) {
+    context.set_budget(nullptr);
+    return error_response(request.id, JobStatus::InternalError,
+                          std::string("The job failed: ") + error.what());
+  }
+}
+
+void Server::serve(int in_fd, int out_fd) {
+  auto connection = std::make_shared<Connection>();
+  connection->out_fd = out_fd;
+
+  std::vector<unsigned char> payload;
+  while (read_frame(in_fd, payload)) {
+    Deadline received = std::chrono::steady_clock::now();
+
+    JobRequest request;
+    if (!decode_request(payload, request)) {
+      std::lock_guard<std::mutex> lock(connection->write_mutex);
+      write_frame(out_fd, encode_response(error_response(
+                              0, JobStatus::InvalidRequest,
+                              "Truncated request header")));
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(connection->pending_mutex);
+      ++connection->pending;
+    }
+    Deadline deadline =
+        received + std::chrono::milliseconds(request.deadline_ms);
+    uint32_t id = request.id;
+    bool queued = submit([this, connection, request = std::move(request),
+                          deadline] {
+      auto response = encode_response(process(request, deadline));
+      {
+        std::lock_guard<std::mutex> lock(connection->write_mutex);
+        write_frame(connection->out_fd, response);
+      }
+      std::lock_guard<std::mutex> lock(connection->pending_mutex);
+      --connection->pending;
+      connection->done.notify_all();
+    });
+    if (!queued) {
+      {
+        std::lock_guard<std::mutex> lock(connection->write_mutex);
+        write_frame(out_fd, encode_response(error_response(
+                                id, JobStatus::Busy, "Too many jobs waiting")));
+      }
+      std::lock_guard<std::mutex> lock(connection->pending_mutex);
+      --connection->pending;
+    }
+  }
+
+  // The stream is closed, the jobs already read still get their response
+  std::unique_lock<std::mutex> lock(connection->pending_mutex);
+  connection->done.wait(lock, [&connection] { return connection->pending == 0; });
+}
+
+bool Server::listen(const std::string &socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return false;
+  }
+  std::strcpy(address.sun_path, socket_path.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    std::cerr << "Could not create the socket" << std::endl;
+    return false;
+  }
+  ::unlink(socket_path.c_str());
+  if (::bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) !=
+          0 ||
+      ::listen(fd, SOMAXCONN) != 0) {
+    std::cerr << "Could not listen on the socket: " << socket_path
+              << std::endl;
+    ::close(fd);
+    return false;
+  }
+
+  while (true) {
+    int client = ::accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+    std::thread([this, client] {
+      serve(client, client);
+      ::close(client);
+    }).detach();
+  }
+}
+
+Client::~Client() {
+  if (m_owned && m_fd >= 0) {
+    ::close(m_fd);
+  }
+}
+
+bool Client::connect(const std::string &socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    std::cerr << "Socket path too long: " << socket_path << std::endl;
+    return false;
+  }
+  std::strcpy(address.sun_path, socket_path.c_str());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr *>(&address),
+                          sizeof(address)) != 0) {
+    std::cerr << "Could not connect to the socket: " << socket_path
+              << std::endl;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  if (m_owned && m_fd >= 0) {
+    ::close(m_fd);
+  }
+  m_fd = fd;
+  m_owned = true;
+  return true;
+}
+
+bool Client::send(const JobRequest &request) {
+  return write_frame(m_fd, encode_request(request));
+}
+
+bool Client::receive(JobResponse &response) {
+  std::vector<unsigned char> payload;
+  return read_frame(m_fd, payload) && decode_response(payload, response);
+}
+
+} // namespace dpxl
@@ -0,0 +1,243 @@
+#include "depixel_lib/shading.hpp"
+#include "depixel_lib/trace.hpp"
+
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace dpxl {
+
+namespace {
+// Rows handed to a thread at a time
+constexpr size_t BAND = 32;
+
+// Runs fn(begin, end) over bands of the rows [0, rows), on thread_count
+// threads taking the next band as they finish
+template <class Fn>
+void for_each_band(size_t rows, size_t thread_count, const Fn &fn) {
+  std::atomic<size_t> next(0);
+  auto work = [&] {
+    for (size_t begin = BAND * next++; begin < rows; begin = BAND * next++) {
+      fn(begin, std::min(begin + BAND, rows));
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < std::min(thread_count, (rows + BAND - 1) / BAND);
+       ++t) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// Direction of the neighbour (i + di, j + dj), as in Graph
+int direction(long di, long dj) {
+  static const int directions[3][3] = {{3, 2, 1}, {4, -1, 0}, {5, 6, 7}};
+  return directions[di + 1][dj + 1];
+}
+
+bool out_of_time(TimeBudget *budget) {
+  if (budget && budget->expired()) {
+    budget->degrade(DegradedShading);
+    return true;
+  }
+  return false;
+}
+
+const long OFFSETS[8][2] = {{0, 1},  {-1, 1}, {-1, 0}, {-1, -1},
+                            {0, -1}, {1, -1}, {1, 0},  {1, 1}};
+} // namespace
+
+void shade_cells(const Graph &graph, const FlatCells &cells,
+                 size_t scale_factor, cv::Mat &output_image,
+                 const ShadingOptions &options, Stats *stats) {
+  DPXL_TRACE_ZONE("shade_cells");
+  StageTimer timer(stats, &Stats::shading);
+  size_t h = cells.h;
+  size_t w = cells.w;
+  size_t thread_count = options.thread_count;
+  if (thread_count == 0) {
+    thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+  }
+  const float lambda = options.data_weight;
+
+  // Links of each pixel, one bit per direction
+  const auto &neighbours = graph.get_neighbours();
+  std::vector<unsigned char> links(h * w, 0);
+  for (size_t i = 0; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      for (int k = 0; k < 8; ++k) {
+        links[i * w + j] |= neighbours(i, j, k) << k;
+      }
+    }
+  }
+  auto linked = [&](size_t a, size_t b) {
+    if (a == b) {
+      return true;
+    }
+    long di = long(b / w) - long(a / w);
+    long dj = long(b % w) - long(a % w);
+    if (di < -1 || di > 1 || dj < -1 || dj > 1) {
+      return false;
+    }
+    return ((links[a] >> direction(di, dj)) & 1) != 0;
+  };
+
+  // Coarse level: Jacobi sweeps on the pixel graph
+  std::vector<float> colours(3 * h * w);
+  for (size_t p = 0; p < h * w; ++p) {
+    const auto &pixel = cells.img_bgr.at<cv::Vec3b>(p / w, p % w);
+    for (int c = 0; c < 3; ++c) {
+      colours[3 * p + c] = pixel[c];
+    }
+  }
+  std::vector<float> coarse = colours;
+  std::vector<float> coarse_next(coarse.size());
+  for (size_t sweep = 0;
+       sweep < options.coarse_sweeps && !out_of_time(options.budget); ++sweep) {
+    for_each_band(h, thread_count, [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        for (size_t j = 0; j < w; ++j) {
+          size_t p = i * w + j;
+          float acc[3] = {lambda * colours[3 * p], lambda * colours[3 * p + 1],
+                          lambda * colours[3 * p + 2]};
+          float weight = lambda;
+          for (int k = 0; k < 8; ++k) {
+            if ((links[p] >> k) & 1) {
+              size_t q = (i + OFFSETS[k][0]) * w + j + OFFSETS[k][1];
+              for (int c = 0; c < 3; ++c) {
+                acc[c] += coarse[3 * q + c];
+              }
+              weight += 1;
+            }
+          }
+          for (int c = 0; c < 3; ++c) {
+            coarse_next[3 * p + c] = acc[c] / weight;
+          }
+        }
+      }
+    });
+    std::swap(coarse, coarse_next);
+  }
+
+  // Cell covering each output pixel, drawn as colorCells draws its colours
+  size_t step = 4 * scale_factor + 1;
+  size_t rows = h * step;
+  size_t cols = w * step;
+  cv::Mat labels(rows, cols, CV_32SC1);
+  for (size_t y = 0; y < rows; ++y) {
+    int *row = labels.ptr<int>(y);
+    for (size_t x = 0; x < cols; ++x) {
+      row[x] = (y / step) * w + x / step;
+    }
+  }
+  std::vector<cv::Point> polygon;
+  int scale = scale_factor;
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    polygon.assign(cells.points.begin() + cells.offsets[c],
+                   cells.points.begin() + cells.offsets[c] + cells.counts[c]);
+    for (auto &point : polygon) {
+      point *= scale;
+    }
+    const cv::Point *points = polygon.data();
+    cv::fillPoly(labels, &points, &cells.counts[c], 1, cv::Scalar(c),
+                 cv::LINE_8, 0);
+  }
+
+  // Prolongation: bilinear between the pixel centres, among the pixels
+  // linked to the covering one only
+  std::vector<float> target(3 * rows * cols);
+  for_each_band(rows, thread_count, [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; ++y) {
+      const int *label_row = labels.ptr<int>(y);
+      float py = (y + 0.5f) / (4 * scale_factor) - 0.5f;
+      long i0 = std::floor(py);
+      float fy = py - i0;
+      for (size_t x = 0; x < cols; ++x) {
+        size_t label = label_row[x];
+        float px = (x + 0.5f) / (4 * scale_factor) - 0.5f;
+        long j0 = std::floor(px);
+        float fx = px - j0;
+        float acc[3] = {0, 0, 0};
+        float weight = 0;
+        for (long di = 0; di < 2; ++di) {
+          for (long dj = 0; dj < 2; ++dj) {
+            long i = i0 + di;
+            long j = j0 + dj;
+            if (i < 0 || j < 0 || i >= long(h) || j >= long(w) ||
+                !linked(label, i * w + j)) {
+              continue;
+            }
+            float wij = (di ? fy : 1 - fy) * (dj ? fx : 1 - fx);
+            for (int c = 0; c < 3; ++c) {
+              acc[c] += wij * coarse[3 * (i * w + j) + c];
+            }
+            weight += wij;
+          }
+        }
+        float *out = &target[3 * (y * cols + x)];
+        for (int c = 0; c < 3; ++c) {
+          out[c] = weight > 0 ? acc[c] / weight : coarse[3 * label + c];
+        }
+      }
+    }
+  });
+
+  // Fine level: Jacobi sweeps on the output grid, across the boundaries of
+  // linked cells only, to smooth out the kinks of the interpolation
+  std::vector<float> fine = target;
+  std::vector<float> fine_next(fine.size());
+  const long FINE_OFFSETS[4][2] = {{0, 1}, {-1, 0}, {0, -1}, {1, 0}};
+  for (size_t sweep = 0;
+       sweep < options.fine_sweeps && !out_of_time(options.budget); ++sweep) {
+    for_each_band(rows, thread_count, [&](size_t begin, size_t end) {
+      for (size_t y = begin; y < end; ++y) {
+        for (size_t x = 0; x < cols; ++x) {
+          size_t p = y * cols + x;
+          size_t label = labels.at<int>(y, x);
+          float acc[3] = {lambda * target[3 * p], lambda * target[3 * p + 1],
+                          lambda * target[3 * p + 2]};
+          float weight = lambda;
+          for (const auto &offset : FINE_OFFSETS) {
+            long yy = long(y) + offset[0];
+            long xx = long(x) + offset[1];
+            if (yy < 0 || xx < 0 || yy >= long(rows) || xx >= long(cols) ||
+                !linked(label, labels.at<int>(yy, xx))) {
+              continue;
+            }
+            size_t q = yy * cols + xx;
+            for (int c = 0; c < 3; ++c) {
+              acc[c] += fine[3 * q + c];
+            }
+            weight += 1;
+          }
+          for (int c = 0; c < 3; ++c) {
+            fine_next[3 * p + c] = acc[c] / weight;
+          }
+        }
+      }
+    });
+    std::swap(fine, fine_next);
+  }
+
+  output_image.create(rows, cols, CV_8UC3);
+  for_each_band(rows, thread_count, [&](size_t begin, size_t end) {
+    for (size_t y = begin; y < end; ++y) {
+      auto *row = output_image.ptr<cv::Vec3b>(y);
+      for (size_t x = 0; x < cols; ++x) {
+        for (int c = 0; c < 3; ++c) {
+          row[x][c] = std::clamp(std::lround(fine[3 * (y * cols + x) + c]),
+                                 0l, 255l);
+        }
+      }
+    }
+  });
+}
+
+} // namespace dpxl
@@ -0,0 +1,85 @@
+#include "depixel_lib/stats.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+// Heap growth of this thread since its current stage started, only counted
+// during a stage. Plain thread locals, safe to touch from operator new
+thread_local bool tracking = false;
+thread_local long heap_bytes = 0;
+thread_local long heap_peak = 0;
+} // namespace
+
+namespace dpxl {
+
+void record_heap_alloc(std::size_t bytes) {
+  if (!tracking) {
+    return;
+  }
+  heap_bytes += bytes;
+  heap_peak = std::max(heap_peak, heap_bytes);
+}
+
+void record_heap_free(std::size_t bytes) {
+  if (tracking) {
+    heap_bytes -= bytes;
+  }
+}
+
+StageTimer::StageTimer(Stats *stats, StageStats Stats::*stage) {
+  if (stats == nullptr) {
+    return;
+  }
+  m_stage = &(stats->*stage);
+  heap_bytes = 0;
+  heap_peak = 0;
+  tracking = true;
+  m_start = std::chrono::steady_clock::now();
+}
+
+StageTimer::~StageTimer() {
+  if (m_stage == nullptr) {
+    return;
+  }
+  m_stage->seconds += std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - m_start)
+                          .count();
+  tracking = false;
+  m_stage->peak_bytes = std::max(m_stage->peak_bytes, heap_peak);
+}
+
+std::string Stats::to_json() const {
+  std::ostringstream json;
+  auto stage = [&json](const char *name, const StageStats &s, bool last) {
+    json << "    \"" << name << "\": {\"seconds\": " << s.seconds
+         << ", \"peak_bytes\": " << s.peak_bytes << "}" << (last ? "\n" : ",\n");
+  };
+
+  json << "{\n  \"stages\": {\n";
+  stage("load", load, false);
+  stage("similarity", similarity, false);
+  stage("trivial_edges", trivial_edges, false);
+  stage("heuristics", heuristics, false);
+  stage("cells", cells, false);
+  stage("collapse", collapse, false);
+  stage("render", render, false);
+  stage("shading", shading, false);
+  stage("encode", encode, true);
+  json << "  },\n"
+       << "  \"crossings\": " << crossings << ",\n"
+       << "  \"decided_by\": {\"curves\": " << decided_by_curves
+       << ", \"sparse_pixels\": " << decided_by_sparse_pixels
+       << ", \"islands\": " << decided_by_islands << "},\n"
+       << "  \"ties\": " << ties << ",\n"
+       << "  \"crossing_memo\": {\"hits\": " << memo_hits
+       << ", \"misses\": " << memo_misses << "},\n"
+       << "  \"flat_tiles\": " << flat_tiles << ",\n"
+       << "  \"nodes_collapsed\": " << nodes_collapsed << ",\n"
+       << "  \"polygons_rasterized\": " << polygons_rasterized << ",\n"
+       << "  \"estimated_peak_bytes\": " << estimated_peak_bytes << "\n"
+       << "}";
+  return json.str();
+}
+
+} // namespace dpxl
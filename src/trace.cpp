@@ -0,0 +1,133 @@
+#include "depixel_lib/trace.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dpxl {
+namespace trace {
+
+std::atomic<bool> g_enabled(false);
+
+namespace {
+struct Event {
+  const char *name;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;
+};
+
+// Events are appended to fixed chunks that never move. Only its thread
+// appends to a buffer and publishes each event by storing the count of its
+// chunk, so write() reads up to that count without stopping the thread, even
+// while zones still open on workers end. The registry keeps a buffer alive
+// after its thread exits so that it can still be written
+struct Chunk {
+  static constexpr size_t CAPACITY = 1024;
+  Event events[CAPACITY];
+  std::atomic<size_t> count{0};
+  std::atomic<Chunk *> next{nullptr};
+};
+
+struct ThreadBuffer {
+  size_t tid;
+  Chunk head;
+  Chunk *tail = &head;
+
+  ~ThreadBuffer() {
+    for (Chunk *chunk = head.next; chunk != nullptr;) {
+      Chunk *next = chunk->next;
+      delete chunk;
+      chunk = next;
+    }
+  }
+};
+
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<ThreadBuffer>> registry;
+std::string trace_path;
+std::chrono::steady_clock::time_point trace_start;
+
+ThreadBuffer &thread_buffer() {
+  thread_local std::shared_ptr<ThreadBuffer> buffer = [] {
+    auto buffer = std::make_shared<ThreadBuffer>();
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    buffer->tid = registry.size() + 1;
+    registry.push_back(buffer);
+    return buffer;
+  }();
+  return *buffer;
+}
+
+void write_at_exit() { write(); }
+} // namespace
+
+void enable(const std::string &path) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  if (trace_path.empty()) {
+    std::atexit(write_at_exit);
+  }
+  trace_path = path;
+  trace_start = std::chrono::steady_clock::now();
+  g_enabled = true;
+}
+
+void Zone::record(const char *name, std::chrono::steady_clock::time_point start,
+                  std::chrono::steady_clock::time_point end) {
+  ThreadBuffer &buffer = thread_buffer();
+  Chunk *chunk = buffer.tail;
+  size_t count = chunk->count.load(std::memory_order_relaxed);
+  if (count == Chunk::CAPACITY) {
+    Chunk *next = new Chunk;
+    chunk->next.store(next, std::memory_order_release);
+    chunk = buffer.tail = next;
+    count = 0;
+  }
+  chunk->events[count] = {name, start, end};
+  chunk->count.store(count + 1, std::memory_order_release);
+}
+
+bool write() {
+  g_enabled = false;
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  if (trace_path.empty()) {
+    return false;
+  }
+
+  std::ofstream out(trace_path);
+  if (!out) {
+    std::cerr << "Could not open the trace file: " << trace_path << std::endl;
+    return false;
+  }
+
+  // Complete ("X") events, in microseconds since enable
+  auto micros = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+  };
+  out << "{\"traceEvents\": [";
+  bool first = true;
+  for (const auto &buffer : registry) {
+    out << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": "
+        << "\"M\", \"pid\": 1, \"tid\": " << buffer->tid
+        << ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+    first = false;
+    for (const Chunk *chunk = &buffer->head; chunk != nullptr;
+         chunk = chunk->next.load(std::memory_order_acquire)) {
+      size_t count = chunk->count.load(std::memory_order_acquire);
+      for (size_t e = 0; e < count; ++e) {
+        const Event &event = chunk->events[e];
+        out << ",\n{\"name\": \"" << event.name
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid
+            << ", \"ts\": " << micros(event.start - trace_start)
+            << ", \"dur\": " << micros(event.end - event.start) << "}";
+      }
+    }
+  }
+  out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+  return static_cast<bool>(out);
+}
+
+} // namespace trace
+} // namespace dpxl
@@ -7,62 +7,216 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgcodecs.hpp>
 
+#include <opencv2/imgproc.hpp>
+
 #include <xtensor/xadapt.hpp>
 #include <xtensor/xarray.hpp>
 
+#include <cassert>
+#include <cstdint>
+#include <map>
+#include <utility>
+
 namespace dpxl {
 namespace utils {
 // Utilities to convert back and forth between opencv's mat and xtensor's xarray
 // for use with depixel_lib
-xt::xarray<float> mat_to_arr(const cv::Mat &mat) {
-  // Ensure the input image has 3 channels
-  // assert(mat.type() == CV_8UC3 && "Expected CV_8UC3 Mat");
+namespace {
+// Value of each byte in the float arrays, the division is done once
+struct ByteToFloat {
+  float values[256];
+  ByteToFloat() {
+    for (int v = 0; v < 256; ++v) {
+      values[v] = v / 255.0f;
+    }
+  }
+};
+const ByteToFloat byte_to_float;
 
-  // Get image dimensions
-  int nrows = mat.rows;
-  int ncols = mat.cols;
-  int nchannels = 3; // Assuming 3 channels for RGB/YUV images
+// Converts a row of n pixels of channels bytes, the loops have no branch so
+// that the compiler vectorizes them
+void row_to_floats(const uint8_t *row, size_t n, int channels, float *out) {
+  const float *values = byte_to_float.values;
+  if (channels == 3) {
+    for (size_t k = 0; k < 3 * n; ++k) {
+      out[k] = values[row[k]];
+    }
+    return;
+  }
+  for (size_t k = 0; k < n; ++k) {
+    out[3 * k] = values[row[channels * k]];
+    out[3 * k + 1] = values[row[channels * k + 1]];
+    out[3 * k + 2] = values[row[channels * k + 2]];
+  }
+}
 
-  // Create an xt::xarray with the appropriate shape
-  xt::xarray<float> arr = xt::empty<float>({nrows, ncols, nchannels});
+void floats_to_row(const float *in, size_t n, uint8_t *row) {
+  for (size_t k = 0; k < 3 * n; ++k) {
+    row[k] = static_cast<uint8_t>(in[k] * 255.0f);
+  }
+}
 
-  // Populate the xtensor array from the cv::Mat
-  for (int rr = 0; rr < nrows; rr++) {
-    for (int cc = 0; cc < ncols; cc++) {
-      // Access the pixel as a 3-channel vector (uchar per channel)
-      cv::Vec3b pxl = mat.at<cv::Vec3b>(rr, cc);
-      for (int chan = 0; chan < nchannels; chan++) {
-        arr(rr, cc, chan) = pxl[chan] / 255.0f;
-      }
-    }
+void reshape(xt::xarray<float> &arr, size_t nrows, size_t ncols) {
+  if (arr.dimension() != 3 || arr.shape()[0] != nrows ||
+      arr.shape()[1] != ncols || arr.shape()[2] != 3) {
+    arr = xt::xarray<float>::from_shape({nrows, ncols, 3});
   }
+}
+} // namespace
+
+xt::xarray<float> mat_to_arr(const cv::Mat &mat) {
+  xt::xarray<float> arr;
+  mat_to_arr(mat, arr);
   return arr;
 }
 
+void mat_to_arr(const cv::Mat &mat, xt::xarray<float> &arr) {
+  assert(mat.depth() == CV_8U && mat.channels() >= 3 &&
+         "Expected an 8 bit Mat of 3 or 4 channels");
+  size_t nrows = mat.rows;
+  size_t ncols = mat.cols;
+  reshape(arr, nrows, ncols);
+
+  // The array is row major, with the channels of a pixel next to each other
+  float *data = arr.data();
+  for (size_t rr = 0; rr < nrows; rr++) {
+    row_to_floats(mat.ptr<uint8_t>(rr), ncols, mat.channels(),
+                  data + rr * ncols * 3);
+  }
+}
+
 cv::Mat arr_to_mat(const xt::xarray<float> &arr) {
-  // Ensure the input array has 3 dimensions
-  assert(arr.dimension() == 3 && "Expected a 3D xarray");
+  cv::Mat mat;
+  arr_to_mat(arr, mat);
+  return mat;
+}
 
-  // Get array dimensions
+void arr_to_mat(const xt::xarray<float> &arr, cv::Mat &mat) {
+  assert(arr.dimension() == 3 && arr.shape()[2] == 3 &&
+         "Expected a 3D xarray of 3 channels");
   int nrows = arr.shape()[0];
   int ncols = arr.shape()[1];
-  int nchannels = arr.shape()[2];
-  assert(nchannels == 3 && "Expected 3 channels");
 
-  // Create a cv::Mat with 3 channels
-  cv::Mat mat(nrows, ncols, CV_8UC3);
-
-  // Populate the cv::Mat from the xtensor array
+  // A cv::Mat with 3 channels, kept if it already has this size
+  mat.create(nrows, ncols, CV_8UC3);
+  if (mat.isContinuous()) {
+    floats_to_row(arr.data(), size_t(nrows) * ncols, mat.ptr<uint8_t>());
+    return;
+  }
   for (int rr = 0; rr < nrows; rr++) {
-    for (int cc = 0; cc < ncols; cc++) {
-      cv::Vec3b pxl;
-      for (int chan = 0; chan < nchannels; chan++) {
-        pxl[chan] = static_cast<uint8_t>(arr(rr, cc, chan) * 255.0f);
+    floats_to_row(arr.data() + size_t(rr) * ncols * 3, ncols,
+                  mat.ptr<uint8_t>(rr));
+  }
+}
+
+cv::Mat arr_to_mat(const xt::xarray<float> &arr, const cv::Rect &roi) {
+  assert(arr.dimension() == 3 && "Expected a 3D xarray");
+
+  cv::Mat mat(roi.height, roi.width, CV_8UC3);
+  size_t ncols = arr.shape()[1];
+  for (int rr = 0; rr < roi.height; rr++) {
+    floats_to_row(arr.data() + ((roi.y + rr) * ncols + roi.x) * 3, roi.width,
+                  mat.ptr<uint8_t>(rr));
+  }
+  return mat;
+}
+
+void image_to_arr(const cv::Mat &image, xt::xarray<float> &arr,
+                  cv::Mat &yuv_scratch) {
+  // Grey pixels have Y = g and U = V = 128 exactly
+  if (image.channels() == 1) {
+    reshape(arr, image.rows, image.cols);
+    const float *values = byte_to_float.values;
+    float *data = arr.data();
+    for (int rr = 0; rr < image.rows; rr++) {
+      const uint8_t *row = image.ptr<uint8_t>(rr);
+      float *out = data + size_t(rr) * image.cols * 3;
+      for (int cc = 0; cc < image.cols; cc++) {
+        out[3 * cc] = values[row[cc]];
+        out[3 * cc + 1] = values[128];
+        out[3 * cc + 2] = values[128];
       }
-      mat.at<cv::Vec3b>(rr, cc) = pxl;
     }
+    return;
   }
-  return mat;
+  // cvtColor takes BGRA as is, no separate pass drops the alpha
+  cv::cvtColor(image, yuv_scratch, cv::COLOR_BGR2YUV);
+  mat_to_arr(yuv_scratch, arr);
+}
+
+void arr_to_bgr(const xt::xarray<float> &arr, cv::Mat &bgr,
+                cv::Mat &yuv_scratch) {
+  arr_to_mat(arr, yuv_scratch);
+  cv::cvtColor(yuv_scratch, bgr, cv::COLOR_YUV2BGR);
+}
+
+cv::Rect grow_rect(const cv::Rect &rect, int margin) {
+  return cv::Rect(rect.x - margin, rect.y - margin, rect.width + 2 * margin,
+                  rect.height + 2 * margin);
+}
+
+std::vector<cv::Rect> merge_rects(const std::vector<cv::Rect> &rects,
+                                  const cv::Rect &bounds, int tile,
+                                  size_t *tile_count) {
+  // Smallest rectangle holding the pixels of rects in each tile met, in scan
+  // order of the tiles
+  std::map<std::pair<int, int>, cv::Rect> tiles;
+  for (const auto &rect : rects) {
+    cv::Rect inside = rect & bounds;
+    if (inside.empty()) {
+      continue;
+    }
+    for (int ti = inside.y / tile; ti <= (inside.y + inside.height - 1) / tile;
+         ++ti) {
+      for (int tj = inside.x / tile;
+           tj <= (inside.x + inside.width - 1) / tile; ++tj) {
+        tiles[{ti, tj}] |= inside & cv::Rect(tj * tile, ti * tile, tile, tile);
+      }
+    }
+  }
+  if (tile_count != nullptr) {
+    *tile_count = tiles.size();
+  }
+
+  // Runs of tiles along a row, each joined with the run of the same columns
+  // on the row above when there is one. The rectangles of tiles are disjoint,
+  // and so are the pixels they give
+  std::vector<cv::Rect> merged;
+  // First and last column of the runs of a row, to their rectangle in merged
+  std::map<std::pair<int, int>, size_t> above, current;
+  int row = -1;
+  auto it = tiles.begin();
+  while (it != tiles.end()) {
+    int ti = it->first.first;
+    if (ti != row) {
+      if (ti == row + 1) {
+        above.swap(current);
+      } else {
+        above.clear();
+      }
+      current.clear();
+      row = ti;
+    }
+    int first = it->first.second;
+    int last = first;
+    cv::Rect run = it->second;
+    for (++it; it != tiles.end() && it->first.first == ti &&
+               it->first.second == last + 1;
+         ++it) {
+      ++last;
+      run |= it->second;
+    }
+
+    auto joined = above.find({first, last});
+    if (joined != above.end()) {
+      merged[joined->second] |= run;
+      current[{first, last}] = joined->second;
+    } else {
+      current[{first, last}] = merged.size();
+      merged.push_back(run);
+    }
+  }
+  return merged;
 }
 
 } // namespace utils
@@ -3,8 +3,30 @@
 #include <xtensor/xarray.hpp>
 #include <xtensor/xtensor_forward.hpp>
 
+#include "depixel_lib/band.hpp"
 #include "depixel_lib/cells.hpp"
+#include "depixel_lib/context.hpp"
 #include "depixel_lib/graph.hpp"
+#include "depixel_lib/incremental.hpp"
+#include "depixel_lib/locator.hpp"
+#include "depixel_lib/memory.hpp"
+#include "depixel_lib/mesh.hpp"
+#include "depixel_lib/multiscale.hpp"
+#include "depixel_lib/preview.hpp"
+#include "depixel_lib/sequence.hpp"
+#include "depixel_lib/serialize.hpp"
+#include "depixel_lib/server.hpp"
+#include "depixel_lib/shading.hpp"
+#include "depixel_lib/utils.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
 
 namespace {
 int setup_test_func_1() { return 0; }
@@ -25,12 +47,915 @@ void test_voronoi_1() {
 
   c.build_from_graph(g);
 }
+
+void test_stages_round_trip() {
+  xt::xarray<float> img = {
+      {{1., 1., 1.}, {0., 0., 0.}, {1., 1., 1.}},
+      {{0., 0., 0.}, {1., 1., 1.}, {0., 0., 0.}},
+      {{1., 1., 1.}, {0., 0., 0.}, {1., 1., 1.}}};
+
+  dpxl::Graph g(img);
+  g.compute_neighbours();
+  g.remove_trivial_edges();
+  g.resolve_diagonals();
+
+  dpxl::VoronoiCells c;
+  c.build_from_graph(g);
+
+  std::string path = "test_stages_round_trip.dpxl";
+  ASSERT_TRUE(dpxl::save_stages(path, g, &c));
+
+  dpxl::StageFile stages;
+  ASSERT_TRUE(stages.open(path));
+  ASSERT_TRUE(stages.has_cells());
+  EXPECT_EQ(stages.to_graph().get_neighbours(), g.get_neighbours());
+  EXPECT_EQ(stages.to_cells().get_cells(), c.get_cells());
+  EXPECT_EQ(stages.to_cells().get_nodes(), c.get_nodes());
+  stages.close();
+
+  // A decreasing cell offset makes the file invalid
+  std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+  dpxl::StageHeader header;
+  file.read(reinterpret_cast<char *>(&header), sizeof(header));
+  for (uint32_t s = 0; s < header.section_count; ++s) {
+    dpxl::StageSection section;
+    file.read(reinterpret_cast<char *>(&section), sizeof(section));
+    if (section.tag ==
+        static_cast<uint32_t>(dpxl::StageSectionTag::CellOffsets)) {
+      uint32_t bad_offset = 1000;
+      file.seekp(section.offset + 4 * sizeof(uint32_t));
+      file.write(reinterpret_cast<const char *>(&bad_offset),
+                 sizeof(bad_offset));
+      break;
+    }
+  }
+  file.close();
+  EXPECT_FALSE(stages.open(path));
+
+  // So does an image size whose node indices overflow
+  ASSERT_TRUE(dpxl::save_stages(path, g, &c));
+  file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+  dpxl::StageHeader huge = header;
+  huge.height = huge.width = 1u << 31;
+  file.write(reinterpret_cast<const char *>(&huge), sizeof(huge));
+  file.close();
+  EXPECT_FALSE(stages.open(path));
+
+  // And a section whose end wraps around past the end of the file
+  ASSERT_TRUE(dpxl::save_stages(path, g, &c));
+  file.open(path, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekg(sizeof(header));
+  dpxl::StageSection wrapped;
+  file.read(reinterpret_cast<char *>(&wrapped), sizeof(wrapped));
+  wrapped.offset = std::numeric_limits<uint64_t>::max() - 7;
+  file.seekp(sizeof(header));
+  file.write(reinterpret_cast<const char *>(&wrapped), sizeof(wrapped));
+  file.close();
+  EXPECT_FALSE(stages.open(path));
+  std::remove(path.c_str());
+}
+
+// Image made of a few random colors, so that there are many crossings
+xt::xarray<float> random_image(size_t h, size_t w, std::mt19937 &rng) {
+  std::vector<float> palette = {0.2f, 0.5f, 0.5f, 0.9f, 0.5f, 0.5f,
+                                0.5f, 0.3f, 0.8f, 0.5f, 0.3f, 0.7f};
+  xt::xarray<float> img = xt::xarray<float>::from_shape({h, w, 3});
+  for (size_t i = 0; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      size_t color = rng() % 4;
+      for (size_t c = 0; c < 3; ++c) {
+        img(i, j, c) = palette[3 * color + c];
+      }
+    }
+  }
+  return img;
+}
+
+void test_incremental_update(unsigned seed) {
+  std::mt19937 rng(seed);
+  size_t h = 12, w = 16;
+  auto img = random_image(h, w, rng);
+  dpxl::IncrementalDepixelizer incremental(img, 2);
+
+  // Paint a few random rectangles one after the other, each update is
+  // compared with a run from scratch
+  auto edited = img;
+  for (size_t k = 0; k < 3; ++k) {
+    auto brush = random_image(h, w, rng);
+    cv::Rect dirty(rng() % w, rng() % h, 1 + rng() % 4, 1 + rng() % 4);
+    dirty &= cv::Rect(0, 0, w, h);
+    for (int i = dirty.y; i < dirty.y + dirty.height; ++i) {
+      for (int j = dirty.x; j < dirty.x + dirty.width; ++j) {
+        for (size_t c = 0; c < 3; ++c) {
+          edited(i, j, c) = brush(i, j, c);
+        }
+      }
+    }
+    incremental.update(edited, dirty);
+
+    dpxl::IncrementalDepixelizer full(edited, 2);
+    EXPECT_EQ(incremental.get_graph().get_neighbours(),
+              full.get_graph().get_neighbours());
+    EXPECT_EQ(incremental.get_cells().get_cells(),
+              full.get_cells().get_cells());
+    EXPECT_EQ(incremental.get_cells().get_nodes(),
+              full.get_cells().get_nodes());
+    EXPECT_EQ(cv::norm(incremental.get_output(), full.get_output(),
+                       cv::NORM_INF),
+              0);
+  }
+
+  // Repainting most of the image processes it again from scratch
+  auto repainted = random_image(h, w, rng);
+  for (size_t i = h - 2; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      for (size_t c = 0; c < 3; ++c) {
+        repainted(i, j, c) = edited(i, j, c);
+      }
+    }
+  }
+  incremental.update(repainted, cv::Rect(0, 0, w, h - 2));
+  dpxl::IncrementalDepixelizer full(repainted, 2);
+  EXPECT_EQ(incremental.get_graph().get_neighbours(),
+            full.get_graph().get_neighbours());
+  EXPECT_EQ(incremental.get_cells().get_cells(), full.get_cells().get_cells());
+  EXPECT_EQ(cv::norm(incremental.get_output(), full.get_output(),
+                     cv::NORM_INF),
+            0);
+}
+
+void test_sequence(unsigned seed) {
+  std::mt19937 rng(seed);
+  size_t h = 12, w = 20;
+  auto frame = random_image(h, w, rng);
+  dpxl::SequenceDepixelizer sequence(2, 4);
+
+  // A sprite moving over a fixed background, a few pixels change per frame
+  for (size_t f = 0; f < 5; ++f) {
+    auto brush = random_image(h, w, rng);
+    size_t x = rng() % w, y = rng() % h;
+    for (size_t i = y; i < std::min(y + 3, h); ++i) {
+      for (size_t j = x; j < std::min(x + 2, w); ++j) {
+        for (size_t c = 0; c < 3; ++c) {
+          frame(i, j, c) = brush(i, j, c);
+        }
+      }
+    }
+
+    auto img = frame;
+    const cv::Mat &output = sequence.next_frame(img);
+    dpxl::IncrementalDepixelizer full(frame, 2);
+    EXPECT_EQ(cv::norm(output, full.get_output(), cv::NORM_INF), 0);
+    if (f > 0) {
+      EXPECT_LT(sequence.get_changed_tiles(), sequence.get_total_tiles());
+    }
+  }
+}
+
+void test_bands(unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<cv::Vec3b> palette = {cv::Vec3b(20, 40, 200), cv::Vec3b(30, 200, 60),
+                                    cv::Vec3b(220, 220, 220), cv::Vec3b(25, 45, 190)};
+  cv::Mat img_bgr(15, 9, CV_8UC3);
+  for (int i = 0; i < img_bgr.rows; ++i) {
+    for (int j = 0; j < img_bgr.cols; ++j) {
+      img_bgr.at<cv::Vec3b>(i, j) = palette[rng() % palette.size()];
+    }
+  }
+
+  cv::Mat img_yuv;
+  cv::cvtColor(img_bgr, img_yuv, cv::COLOR_BGR2YUV);
+  xt::xarray<float> img = dpxl::utils::mat_to_arr(img_yuv);
+  dpxl::IncrementalDepixelizer full(img, 2);
+
+  // Small bands and halo, so that the halo has to grow now and then
+  dpxl::BandDepixelizer bands(img_bgr, 2, 2, 1);
+  cv::Mat output(bands.get_output_height(), bands.get_output_width(), CV_8UC3);
+  size_t next = 0;
+  bands.run([&](const cv::Mat &rows, size_t y) {
+    EXPECT_EQ(y, next);
+    rows.copyTo(output(cv::Rect(0, y, rows.cols, rows.rows)));
+    next = y + rows.rows;
+  });
+  EXPECT_EQ(next, size_t(output.rows));
+  EXPECT_EQ(cv::norm(output, full.get_output(), cv::NORM_INF), 0);
+}
+
+void test_server() {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  dpxl::Server server(2);
+  std::thread serving([&server, &fds] { server.serve(fds[1], fds[1]); });
+
+  // Several jobs in flight on the same stream, and a broken one
+  std::mt19937 rng(0);
+  std::vector<cv::Mat> expected;
+  dpxl::Client client(fds[0]);
+  for (uint32_t id = 0; id < 4; ++id) {
+    cv::Mat img_bgr, img_yuv;
+    cv::cvtColor(dpxl::utils::arr_to_mat(random_image(6 + id, 7, rng)),
+                 img_bgr, cv::COLOR_YUV2BGR);
+    cv::cvtColor(img_bgr, img_yuv, cv::COLOR_BGR2YUV);
+    xt::xarray<float> img = dpxl::utils::mat_to_arr(img_yuv);
+    dpxl::IncrementalDepixelizer full(img, 3);
+    expected.push_back(full.get_output());
+
+    dpxl::JobRequest request;
+    request.id = id;
+    request.scale_factor = 3;
+    cv::imencode(".png", img_bgr, request.image);
+    EXPECT_TRUE(client.send(request));
+  }
+  dpxl::JobRequest broken;
+  broken.id = 4;
+  broken.image = {1, 2, 3};
+  EXPECT_TRUE(client.send(broken));
+
+  shutdown(fds[0], SHUT_WR);
+  for (size_t k = 0; k < 5; ++k) {
+    dpxl::JobResponse response;
+    ASSERT_TRUE(client.receive(response));
+    if (response.id == 4) {
+      EXPECT_EQ(response.status, dpxl::JobStatus::InvalidImage);
+      continue;
+    }
+    ASSERT_EQ(response.status, dpxl::JobStatus::Ok);
+    cv::Mat output = cv::imdecode(response.data, cv::IMREAD_COLOR);
+    EXPECT_EQ(cv::norm(output, expected[response.id], cv::NORM_INF), 0);
+  }
+
+  serving.join();
+  close(fds[0]);
+  close(fds[1]);
+
+  // An output over the limit is refused, as is any job once the queue is full
+  dpxl::JobRequest huge;
+  huge.scale_factor = 1u << 30;
+  cv::imencode(".png", cv::Mat(16, 16, CV_8UC3, cv::Scalar(1, 2, 3)),
+               huge.image);
+  EXPECT_EQ(server.process(huge, dpxl::Server::Deadline()).status,
+            dpxl::JobStatus::InvalidRequest);
+
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  dpxl::Server full(1, 0);
+  std::thread serving_full([&full, &fds] { full.serve(fds[1], fds[1]); });
+  dpxl::Client full_client(fds[0]);
+  EXPECT_TRUE(full_client.send(huge));
+  shutdown(fds[0], SHUT_WR);
+  dpxl::JobResponse response;
+  ASSERT_TRUE(full_client.receive(response));
+  EXPECT_EQ(response.status, dpxl::JobStatus::Busy);
+  serving_full.join();
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void test_stats() {
+  std::mt19937 rng(0);
+  auto img = random_image(10, 12, rng);
+  dpxl::Stats stats;
+
+  dpxl::Graph graph(img);
+  graph.set_stats(&stats);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  dpxl::VoronoiCells cells;
+  cells.set_stats(&stats);
+  cells.build_from_graph(graph);
+  cells.colorCells(2, graph.get_image());
+
+  EXPECT_GT(stats.crossings, 0);
+  EXPECT_EQ(stats.crossings, stats.decided_by_curves +
+                                 stats.decided_by_sparse_pixels +
+                                 stats.decided_by_islands + stats.ties);
+  EXPECT_EQ(stats.polygons_rasterized, 10 * 12);
+  EXPECT_GT(stats.cells.peak_bytes, 0);
+}
+
+void test_memory_budget() {
+  auto estimate = dpxl::estimate_memory(256, 256, 100);
+  EXPECT_LT(estimate.load, estimate.graph);
+  EXPECT_LT(estimate.cells, estimate.render);
+
+  // A quarter of the budget still fits in bands, a few bytes do not
+  size_t budget = estimate.peak() / 4;
+  size_t band_height = dpxl::band_height_for_budget(256, 256, 100, budget);
+  EXPECT_GT(band_height, 0);
+  EXPECT_LT(band_height, 256);
+  EXPECT_LE(dpxl::estimate_band_memory(256, 256, 100, band_height), budget);
+  EXPECT_EQ(dpxl::band_height_for_budget(256, 256, 100, 1000), 0);
+
+  // The halo can grow within the budget, not past it
+  size_t halo = dpxl::halo_for_budget(256, 256, 100, band_height, budget);
+  EXPECT_GE(halo, 8);
+  EXPECT_LE(dpxl::estimate_band_memory(256, 256, 100, band_height, halo),
+            budget);
+  EXPECT_GT(dpxl::estimate_band_memory(256, 256, 100, band_height, halo + 1),
+            budget);
+
+  // A diagonal line across the bands needs a wide halo, a band fails when
+  // its halo is limited below that
+  cv::Mat line(24, 24, CV_8UC3, cv::Scalar(220, 220, 220));
+  for (int k = 0; k < 24; ++k) {
+    line.at<cv::Vec3b>(k, k) = cv::Vec3b(20, 40, 200);
+  }
+  dpxl::BandDepixelizer bands(line, 1, 2, 1);
+  auto ignore = [](const cv::Mat &, size_t) {};
+  EXPECT_TRUE(bands.run(ignore));
+  EXPECT_GT(bands.get_max_halo(), 2);
+  bands.set_halo_limit(2);
+  EXPECT_FALSE(bands.run(ignore));
+}
+
+void test_context() {
+  std::mt19937 rng(0);
+  dpxl::PipelineContext context;
+  size_t chunk_allocations = 0;
+  for (size_t k = 0; k < 6; ++k) {
+    cv::Mat img_bgr, img_yuv;
+    cv::cvtColor(dpxl::utils::arr_to_mat(random_image(10, 14, rng)), img_bgr,
+                 cv::COLOR_YUV2BGR);
+    cv::cvtColor(img_bgr, img_yuv, cv::COLOR_BGR2YUV);
+    xt::xarray<float> img = dpxl::utils::mat_to_arr(img_yuv);
+    dpxl::IncrementalDepixelizer full(img, 2);
+
+    const cv::Mat &output = context.process(img_bgr, 2);
+    EXPECT_EQ(context.get_cells().get_cells(), full.get_cells().get_cells());
+    EXPECT_EQ(cv::norm(output, full.get_output(), cv::NORM_INF), 0);
+
+    // Once warm, the arena takes nothing more from the heap
+    if (k == 1) {
+      chunk_allocations = context.get_arena().get_chunk_allocations();
+    } else if (k > 1) {
+      EXPECT_EQ(context.get_arena().get_chunk_allocations(),
+                chunk_allocations);
+    }
+  }
+}
+
+void test_color_metrics() {
+  std::mt19937 rng(0);
+  auto img = random_image(9, 11, rng);
+  auto neighbours = [&img](const dpxl::ColorMetricConfig &config) {
+    dpxl::Graph graph(img);
+    graph.set_color_metric(config);
+    graph.compute_neighbours();
+    return graph.get_neighbours();
+  };
+
+  // The palette of random_image has no two colours within 1/255, so tight
+  // YUV thresholds give the exact metric
+  dpxl::ColorMetricConfig exact;
+  exact.metric = dpxl::ColorMetric::Exact;
+  dpxl::ColorMetricConfig tight;
+  tight.y_threshold = tight.u_threshold = tight.v_threshold = 1.0f / 255;
+  auto exact_neighbours = neighbours(exact);
+  EXPECT_EQ(neighbours(tight), exact_neighbours);
+  for (size_t i = 0; i + 1 < 9; ++i) {
+    for (size_t j = 0; j < 11; ++j) {
+      bool same = img(i, j, 0) == img(i + 1, j, 0) &&
+                  img(i, j, 1) == img(i + 1, j, 1) &&
+                  img(i, j, 2) == img(i + 1, j, 2);
+      EXPECT_EQ(exact_neighbours(i, j, 6), same);
+      EXPECT_EQ(exact_neighbours(i + 1, j, 2), same);
+    }
+  }
+
+  // Wide enough thresholds link every pixel inside the image
+  dpxl::ColorMetricConfig loose;
+  loose.y_threshold = loose.u_threshold = loose.v_threshold = 1.0f;
+  auto loose_neighbours = neighbours(loose);
+  EXPECT_TRUE(loose_neighbours(4, 5, 0) && loose_neighbours(4, 5, 3));
+  EXPECT_FALSE(loose_neighbours(0, 0, 2));
+
+  // The Lab image kept by the graph follows the edits of update_region
+  dpxl::ColorMetricConfig lab;
+  lab.metric = dpxl::ColorMetric::Lab;
+  auto resolve = [&lab](dpxl::Graph &graph) {
+    graph.set_color_metric(lab);
+    graph.compute_neighbours();
+    graph.remove_trivial_edges();
+    graph.resolve_diagonals();
+  };
+  auto edited = img;
+  auto brush = random_image(9, 11, rng);
+  cv::Rect dirty(3, 2, 4, 5);
+  for (int i = dirty.y; i < dirty.y + dirty.height; ++i) {
+    for (int j = dirty.x; j < dirty.x + dirty.width; ++j) {
+      for (size_t c = 0; c < 3; ++c) {
+        edited(i, j, c) = brush(i, j, c);
+      }
+    }
+  }
+  dpxl::Graph updated(img), full(edited);
+  resolve(updated);
+  updated.update_region(edited, dirty);
+  resolve(full);
+  EXPECT_EQ(updated.get_neighbours(), full.get_neighbours());
+}
+
+void test_preview() {
+  std::mt19937 rng(0);
+  cv::Mat img_bgr, img_yuv;
+  cv::cvtColor(dpxl::utils::arr_to_mat(random_image(8, 10, rng)), img_bgr,
+               cv::COLOR_YUV2BGR);
+  cv::cvtColor(img_bgr, img_yuv, cv::COLOR_BGR2YUV);
+  xt::xarray<float> img = dpxl::utils::mat_to_arr(img_yuv);
+  dpxl::IncrementalDepixelizer full(img, 2);
+
+  std::mutex mutex;
+  std::vector<dpxl::PreviewLevel> levels;
+  cv::Mat full_level;
+  dpxl::ProgressivePreview preview(
+      2, [&](const cv::Mat &image, dpxl::PreviewLevel level, uint64_t) {
+        std::lock_guard<std::mutex> lock(mutex);
+        levels.push_back(level);
+        EXPECT_EQ(image.size(), full.get_output().size());
+        if (level == dpxl::PreviewLevel::Full) {
+          image.copyTo(full_level);
+        }
+      });
+
+  preview.submit(img_bgr);
+  preview.wait();
+  std::vector<dpxl::PreviewLevel> expected = {
+      dpxl::PreviewLevel::Pixels, dpxl::PreviewLevel::Coarse,
+      dpxl::PreviewLevel::Full, dpxl::PreviewLevel::Smooth};
+  EXPECT_EQ(levels, expected);
+  EXPECT_EQ(cv::norm(full_level, full.get_output(), cv::NORM_INF), 0);
+
+  // Nothing of a cancelled image comes after cancel returns
+  preview.submit(img_bgr);
+  preview.cancel();
+  size_t delivered;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    delivered = levels.size();
+  }
+  preview.wait();
+  EXPECT_EQ(levels.size(), delivered);
+}
+
+void test_scales() {
+  std::mt19937 rng(0);
+  auto img = random_image(9, 12, rng);
+  dpxl::Graph graph(img);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  dpxl::VoronoiCells cells;
+  cells.build_from_graph(graph);
+
+  std::vector<size_t> scale_factors = {1, 4, 2, 3};
+  auto outputs = dpxl::render_scales(cells.flatten(graph.get_image()),
+                                     scale_factors, 3);
+  ASSERT_EQ(outputs.size(), scale_factors.size());
+  for (size_t k = 0; k < scale_factors.size(); ++k) {
+    cv::Mat expected = cells.colorCells(scale_factors[k], graph.get_image());
+    EXPECT_EQ(cv::norm(outputs[k], expected, cv::NORM_INF), 0);
+  }
+
+  // Multiples of the image size, the colour of each output pixel is the one
+  // of the cell covering its centre, but along the edges of the cells
+  dpxl::FlatCells flat = cells.flatten(graph.get_image());
+  dpxl::CellLocator locator(flat);
+  std::vector<size_t> multiples = {2, 3, 4, 8};
+  auto sized = dpxl::render_multiples(flat, multiples, 2);
+  ASSERT_EQ(sized.size(), multiples.size());
+  for (size_t k = 0; k < multiples.size(); ++k) {
+    size_t m = multiples[k];
+    ASSERT_EQ(sized[k].rows, int(9 * m));
+    ASSERT_EQ(sized[k].cols, int(12 * m));
+    size_t same = 0;
+    for (int y = 0; y < sized[k].rows; ++y) {
+      for (int x = 0; x < sized[k].cols; ++x) {
+        uint32_t cell = locator.locate((x + 0.5f) / m, (y + 0.5f) / m);
+        same += sized[k].at<cv::Vec3b>(y, x) == locator.colour(cell);
+      }
+    }
+    EXPECT_GT(same, 0.95 * sized[k].rows * sized[k].cols);
+  }
+}
+
+// Flat tiles take shortcuts in every stage, an incremental update of the whole
+// image takes none of them
+void test_flat_tiles() {
+  std::mt19937 rng(0);
+  size_t h = 24, w = 30;
+  auto img = random_image(h, w, rng);
+  auto flat = random_image(h, w, rng);
+  for (size_t i = 0; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      // Flat tiles of a few colours
+      if ((i / 8 + j / 8) % 3 != 2) {
+        for (size_t c = 0; c < 3; ++c) {
+          flat(i, j, c) = img(i / 8 * 8, j / 8 * 8, c);
+        }
+      }
+    }
+  }
+  // One of them broken by a pixel
+  flat(12, 3, 0) += 0.05f;
+  dpxl::IncrementalDepixelizer incremental(img, 2);
+  incremental.update(flat, cv::Rect(0, 0, w, h));
+
+  dpxl::IncrementalDepixelizer full(flat, 2);
+  EXPECT_TRUE(full.get_graph().is_flat_tile(0, 0));
+  EXPECT_FALSE(full.get_graph().is_flat_tile(1, 0));
+  EXPECT_EQ(incremental.get_graph().get_neighbours(),
+            full.get_graph().get_neighbours());
+  EXPECT_EQ(incremental.get_cells().get_cells(), full.get_cells().get_cells());
+  EXPECT_EQ(incremental.get_cells().get_nodes(), full.get_cells().get_nodes());
+  EXPECT_EQ(cv::norm(incremental.get_output(), full.get_output(),
+                     cv::NORM_INF),
+            0);
+
+  // Mending the pixel makes the tile flat again, the cells see it too
+  auto mended_img = flat;
+  mended_img(12, 3, 0) = mended_img(12, 4, 0);
+  incremental.update(mended_img, cv::Rect(3, 12, 1, 1));
+  dpxl::IncrementalDepixelizer mended(mended_img, 2);
+  EXPECT_TRUE(incremental.get_graph().is_flat_tile(1, 0));
+  EXPECT_EQ(incremental.get_cells().get_cells(),
+            mended.get_cells().get_cells());
+  EXPECT_EQ(cv::norm(incremental.get_output(), mended.get_output(),
+                     cv::NORM_INF),
+            0);
+
+  cv::Mat per_cell;
+  dpxl::render_flat_cells(full.get_cells().flatten(flat), 2, per_cell);
+  EXPECT_EQ(cv::norm(full.get_output(), per_cell, cv::NORM_INF), 0);
+}
+
+void test_shading() {
+  // Colours of random_image are never similar, the shading changes nothing
+  std::mt19937 rng(0);
+  auto img = random_image(9, 12, rng);
+  dpxl::Graph graph(img);
+  graph.compute_neighbours();
+  graph.remove_trivial_edges();
+  graph.resolve_diagonals();
+  dpxl::VoronoiCells cells;
+  cells.build_from_graph(graph);
+  cv::Mat shaded;
+  dpxl::shade_cells(graph, cells.flatten(graph.get_image()), 2, shaded);
+  EXPECT_EQ(cv::norm(shaded, cells.colorCells(2, graph.get_image()),
+                     cv::NORM_INF),
+            0);
+
+  // A gradient of similar steps next to a sharp edge
+  img = xt::xarray<float>::from_shape({6, 8, 3});
+  for (size_t i = 0; i < 6; ++i) {
+    for (size_t j = 0; j < 8; ++j) {
+      img(i, j, 0) = j < 4 ? 0.3f + 0.02f * j : 0.9f;
+      img(i, j, 1) = img(i, j, 2) = 0.5f;
+    }
+  }
+  dpxl::Graph gradient(img);
+  gradient.compute_neighbours();
+  gradient.remove_trivial_edges();
+  gradient.resolve_diagonals();
+  dpxl::VoronoiCells gradient_cells;
+  gradient_cells.build_from_graph(gradient);
+  cv::Mat flat = gradient_cells.colorCells(2, img);
+  dpxl::ShadingOptions options;
+  options.thread_count = 3;
+  dpxl::shade_cells(gradient, gradient_cells.flatten(img), 2, shaded, options);
+  ASSERT_EQ(shaded.rows, flat.rows);
+  ASSERT_EQ(shaded.cols, flat.cols);
+
+  // Over the cells, blended within a step of the flat colours, the other
+  // side of the edge (the nodes of column 16 at scale 2) left as is
+  bool blended = false;
+  int edge = 16 * 2;
+  for (int y = 0; y < 4 * 6 * 2; ++y) {
+    for (int x = 0; x < 4 * 8 * 2; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        int a = flat.at<cv::Vec3b>(y, x)[c];
+        int b = shaded.at<cv::Vec3b>(y, x)[c];
+        if (x > edge) {
+          EXPECT_EQ(a, b);
+        } else {
+          EXPECT_LE(std::abs(a - b), 6);
+          blended |= a != b;
+        }
+      }
+    }
+  }
+  EXPECT_TRUE(blended);
+}
+
+void test_budget() {
+  std::mt19937 rng(0);
+  cv::Mat img_bgr;
+  cv::cvtColor(dpxl::utils::arr_to_mat(random_image(10, 12, rng)), img_bgr,
+               cv::COLOR_YUV2BGR);
+  dpxl::PipelineContext context;
+  cv::Mat expected = context.process(img_bgr, 2).clone();
+
+  // No limit, nothing changes
+  dpxl::TimeBudget unlimited;
+  context.set_budget(&unlimited);
+  EXPECT_EQ(cv::norm(context.process(img_bgr, 2), expected, cv::NORM_INF), 0);
+  EXPECT_EQ(unlimited.get_degraded(), 0u);
+
+  // Low from the start, the crossings go without the curve heuristic
+  dpxl::TimeBudget low(std::chrono::hours(1), 0.0);
+  context.set_budget(&low);
+  context.process(img_bgr, 2);
+  EXPECT_EQ(low.get_degraded(), uint32_t(dpxl::DegradedCurves));
+  EXPECT_EQ(context.get_cells().get_cells().size(), 10u * 12u);
+
+  // Cancelled, the output is the pixels upscaled
+  dpxl::TimeBudget cancelled;
+  cancelled.cancel();
+  context.set_budget(&cancelled);
+  const cv::Mat &output = context.process(img_bgr, 2);
+  EXPECT_EQ(cancelled.get_degraded(),
+            uint32_t(dpxl::DegradedHeuristics | dpxl::DegradedCells));
+  cv::Mat upscaled;
+  cv::resize(img_bgr, upscaled, cv::Size(), 9, 9, cv::INTER_NEAREST);
+  EXPECT_EQ(cv::norm(output, upscaled, cv::NORM_INF), 0);
+  EXPECT_EQ(dpxl::degraded_steps_to_string(cancelled.get_degraded()),
+            "heuristics,cells");
+  context.set_budget(nullptr);
+}
+
+void test_conversions() {
+  // Every byte value survives the round trip, also from a view
+  cv::Mat bytes(16, 20, CV_8UC3);
+  for (int y = 0; y < bytes.rows; ++y) {
+    for (int x = 0; x < bytes.cols; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        bytes.at<cv::Vec3b>(y, x)[c] = (3 * (y * bytes.cols + x) + c) % 256;
+      }
+    }
+  }
+  EXPECT_EQ(cv::norm(dpxl::utils::arr_to_mat(dpxl::utils::mat_to_arr(bytes)),
+                     bytes, cv::NORM_INF),
+            0);
+  cv::Rect roi(3, 2, 9, 7);
+  auto arr = dpxl::utils::mat_to_arr(bytes(roi));
+  EXPECT_EQ(cv::norm(dpxl::utils::arr_to_mat(arr), bytes(roi).clone(),
+                     cv::NORM_INF),
+            0);
+
+  // BGRA and grey images give the same array as their BGR version
+  cv::Mat img_yuv, scratch;
+  xt::xarray<float> expected, converted;
+  dpxl::utils::image_to_arr(bytes, expected, img_yuv);
+  cv::Mat bgra(bytes.rows, bytes.cols, CV_8UC4);
+  for (int y = 0; y < bytes.rows; ++y) {
+    for (int x = 0; x < bytes.cols; ++x) {
+      const auto &pixel = bytes.at<cv::Vec3b>(y, x);
+      bgra.at<cv::Vec4b>(y, x) = cv::Vec4b(pixel[0], pixel[1], pixel[2], 7);
+    }
+  }
+  dpxl::utils::image_to_arr(bgra, converted, scratch);
+  EXPECT_EQ(converted, expected);
+
+  cv::Mat grey(bytes.rows, bytes.cols, CV_8UC1);
+  cv::Mat grey_bgr(bytes.rows, bytes.cols, CV_8UC3);
+  for (int y = 0; y < bytes.rows; ++y) {
+    for (int x = 0; x < bytes.cols; ++x) {
+      uchar g = bytes.at<cv::Vec3b>(y, x)[0];
+      grey.at<uchar>(y, x) = g;
+      grey_bgr.at<cv::Vec3b>(y, x) = cv::Vec3b(g, g, g);
+    }
+  }
+  dpxl::utils::image_to_arr(grey, converted, scratch);
+  dpxl::utils::image_to_arr(grey_bgr, expected, img_yuv);
+  EXPECT_EQ(converted, expected);
+}
+
+void test_merge_rects() {
+  // Rectangles in neighbouring tiles are merged, the others are kept apart,
+  // and every pixel given is covered once
+  cv::Rect bounds(0, 0, 40, 30);
+  std::vector<cv::Rect> rects = {cv::Rect(1, 1, 2, 2), cv::Rect(9, 3, 3, 2),
+                                 cv::Rect(2, 10, 8, 1), cv::Rect(30, 20, 20, 20),
+                                 cv::Rect(3, 2, 1, 1), cv::Rect(20, 0, 2, 2)};
+  size_t tiles = 0;
+  auto merged = dpxl::utils::merge_rects(rects, bounds, 8, &tiles);
+  EXPECT_EQ(tiles, 9);
+  EXPECT_EQ(merged.size(), 3);
+  for (int y = 0; y < bounds.height; ++y) {
+    for (int x = 0; x < bounds.width; ++x) {
+      bool given = false;
+      for (const auto &rect : rects) {
+        given = given || rect.contains(cv::Point(x, y));
+      }
+      int covered = 0;
+      for (const auto &rect : merged) {
+        covered += rect.contains(cv::Point(x, y));
+      }
+      EXPECT_LE(covered, 1);
+      if (given) {
+        EXPECT_EQ(covered, 1);
+      }
+    }
+  }
+}
+
+void test_mesh() {
+  std::mt19937 rng(17);
+  size_t h = 12, w = 16;
+  auto img = random_image(h, w, rng);
+  dpxl::Graph g(img);
+  g.compute_neighbours();
+  g.remove_trivial_edges();
+  g.resolve_diagonals();
+  dpxl::VoronoiCells cells;
+  cells.build_from_graph(g);
+  dpxl::CellMesh mesh = dpxl::mesh_from_cells(cells.flatten(img));
+
+  // Shared nodes are single vertices, and the triangles tile the image with
+  // the same winding
+  EXPECT_LE(mesh.vertex_count(), (4 * h + 1) * (4 * w + 1));
+  EXPECT_EQ(mesh.colors.size(), 4 * mesh.triangle_count());
+  double area = 0;
+  for (size_t t = 0; t < mesh.triangle_count(); ++t) {
+    const float *a = &mesh.positions[2 * mesh.indices[3 * t]];
+    const float *b = &mesh.positions[2 * mesh.indices[3 * t + 1]];
+    const float *c = &mesh.positions[2 * mesh.indices[3 * t + 2]];
+    // Counter-clockwise on the image, with y pointing down
+    double signed_area =
+        ((c[0] - a[0]) * (b[1] - a[1]) - (b[0] - a[0]) * (c[1] - a[1])) / 2;
+    EXPECT_GE(signed_area, 0);
+    area += signed_area;
+  }
+  EXPECT_DOUBLE_EQ(area, double(h * w));
+
+  std::string path = "test_mesh_round_trip.dpxm";
+  ASSERT_TRUE(dpxl::save_mesh(path, mesh));
+  dpxl::CellMesh loaded;
+  ASSERT_TRUE(dpxl::load_mesh(path, loaded));
+  std::remove(path.c_str());
+  EXPECT_EQ(loaded.height, h);
+  EXPECT_EQ(loaded.width, w);
+  EXPECT_EQ(loaded.positions, mesh.positions);
+  EXPECT_EQ(loaded.indices, mesh.indices);
+  EXPECT_EQ(loaded.colors, mesh.colors);
+}
+
+// Last cell in drawing order whose polygon holds (x, y), by the even-odd
+// rule, or -1
+long covering_cell(const dpxl::FlatCells &cells, float x, float y) {
+  long found = -1;
+  for (size_t c = 0; c < cells.counts.size(); ++c) {
+    const cv::Point *polygon = cells.points.data() + cells.offsets[c];
+    int count = cells.counts[c];
+    bool inside = false;
+    for (int k = 0, l = count - 1; k < count; l = k++) {
+      const cv::Point &a = polygon[l];
+      const cv::Point &b = polygon[k];
+      if ((a.y > 4 * y) != (b.y > 4 * y) &&
+          4 * x < a.x + (4 * y - a.y) * (b.x - a.x) / float(b.y - a.y)) {
+        inside = !inside;
+      }
+    }
+    if (inside) {
+      found = c;
+    }
+  }
+  return found;
+}
+
+void test_locator() {
+  std::mt19937 rng(23);
+  size_t h = 10, w = 14;
+  auto img = random_image(h, w, rng);
+  dpxl::Graph g(img);
+  g.compute_neighbours();
+  g.remove_trivial_edges();
+  g.resolve_diagonals();
+  dpxl::VoronoiCells cells;
+  cells.build_from_graph(g);
+  dpxl::FlatCells flat = cells.flatten(img);
+  dpxl::CellLocator locator(flat);
+
+  // Same cell as a search through all of them, and the centre of a pixel is
+  // in its own cell
+  std::vector<uint32_t> row(7 * w + 2);
+  for (size_t r = 0; r < 7 * h; ++r) {
+    float y = (r + 0.5f) / 7;
+    float x0 = -0.5f / 7;
+    float dx = 1.0f / 7;
+    locator.locate_row(y, x0, dx, row.size(), row.data());
+    for (size_t q = 0; q < row.size(); ++q) {
+      float x = x0 + q * dx;
+      uint32_t cell = locator.locate(x, y);
+      EXPECT_EQ(row[q], cell);
+      long expected = covering_cell(flat, x, y);
+      if (expected >= 0) {
+        EXPECT_EQ(cell, expected);
+      }
+    }
+  }
+  for (size_t i = 0; i < h; ++i) {
+    for (size_t j = 0; j < w; ++j) {
+      EXPECT_EQ(locator.locate(j + 0.5f, i + 0.5f), i * w + j);
+    }
+  }
+}
+
+void test_crossing_memo() {
+  // A dithered pattern repeated over the image, then one with no repetition
+  std::mt19937 rng(5);
+  auto motif = random_image(4, 6, rng);
+  xt::xarray<float> tiled = xt::xarray<float>::from_shape({36, 42, 3});
+  for (size_t i = 0; i < 36; ++i) {
+    for (size_t j = 0; j < 42; ++j) {
+      for (size_t c = 0; c < 3; ++c) {
+        tiled(i, j, c) = motif(i % 4, j % 6, c);
+      }
+    }
+  }
+  std::vector<xt::xarray<float>> images = {tiled, random_image(30, 34, rng)};
+  for (auto &img : images) {
+    dpxl::Stats stats;
+    dpxl::Graph memoized(img);
+    memoized.set_stats(&stats);
+    memoized.compute_neighbours();
+    memoized.remove_trivial_edges();
+    memoized.resolve_diagonals();
+
+    dpxl::Stats reference_stats;
+    dpxl::Graph reference(img);
+    reference.set_stats(&reference_stats);
+    reference.set_crossing_memo(false);
+    reference.compute_neighbours();
+    reference.remove_trivial_edges();
+    reference.resolve_diagonals();
+
+    EXPECT_EQ(memoized.get_neighbours(), reference.get_neighbours());
+    EXPECT_EQ(stats.memo_hits + stats.memo_misses, stats.crossings);
+    EXPECT_EQ(stats.decided_by_curves, reference_stats.decided_by_curves);
+    EXPECT_EQ(stats.ties, reference_stats.ties);
+    EXPECT_EQ(reference_stats.memo_hits + reference_stats.memo_misses, 0);
+    // The repeated pattern hits
+    if (&img == &images[0]) {
+      EXPECT_GT(stats.memo_hits, stats.memo_misses);
+    }
+  }
+}
 } // namespace
 
 TEST(TestModuleSetupTopic, DummyGoodTest) { EXPECT_EQ(setup_test_func_1(), 0); }
 
 TEST(VornoiTests, InstatiationTest) { EXPECT_NO_THROW(test_voronoi_1()); }
 
+TEST(SerializeTests, RoundTripTest) { test_stages_round_trip(); }
+
+TEST(IncrementalTests, MatchesFullRunTest) {
+  for (unsigned seed = 0; seed < 20; ++seed) {
+    test_incremental_update(seed);
+  }
+}
+
+TEST(SequenceTests, MatchesPerFrameTest) {
+  for (unsigned seed = 0; seed < 10; ++seed) {
+    test_sequence(seed);
+  }
+}
+
+TEST(BandTests, MatchesWholeImageTest) {
+  for (unsigned seed = 0; seed < 10; ++seed) {
+    test_bands(seed);
+  }
+}
+
+TEST(ServerTests, ConcurrentRequestsTest) { test_server(); }
+
+TEST(StatsTests, CountersTest) { test_stats(); }
+
+TEST(MemoryTests, BudgetTest) { test_memory_budget(); }
+
+TEST(ContextTests, ReuseTest) { test_context(); }
+
+TEST(GraphTests, ColorMetricsTest) { test_color_metrics(); }
+
+TEST(PreviewTests, LevelsTest) { test_preview(); }
+
+TEST(MultiscaleTests, MatchesColorCellsTest) { test_scales(); }
+
+TEST(GraphTests, FlatTilesTest) { test_flat_tiles(); }
+
+TEST(ShadingTests, BlendsSimilarCellsTest) { test_shading(); }
+
+TEST(BudgetTests, DegradesTest) { test_budget(); }
+
+TEST(UtilsTests, ConversionTest) { test_conversions(); }
+
+TEST(UtilsTests, MergeRectsTest) { test_merge_rects(); }
+
+TEST(MeshTests, TilesImageTest) { test_mesh(); }
+
+TEST(LocatorTests, MatchesSearchTest) { test_locator(); }
+
+TEST(GraphTests, CrossingMemoTest) { test_crossing_memo(); }
+
 // TEST(TestModuleSetupTopic, DummyBadTest) {
 //  EXPECT_EQ(setup_test_func_1(), setup_test_func_2())
 //      << "Forced error successfully detected ! This test is here to check that